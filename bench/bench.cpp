@@ -0,0 +1,207 @@
+#include <SFML/Graphics.hpp>
+#include "richtext.h"
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+//Headless benchmarks of RichText; results are printed as JSON on the standard output, progress on the error output.
+//Usage: bench [font file] [largest corpus, in bytes]
+
+std::atomic<size_t> allocations(0);
+std::atomic<size_t> allocatedBytes(0);
+
+void* operator new(size_t size) {
+	allocations++;
+	allocatedBytes += size;
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+struct Corpus {
+	std::string name;
+	size_t bytes;
+	float tagDensity; //Fraction of words inside a tag
+	float width;
+	bool outline;
+	std::string markup;
+};
+
+//Words separated by spaces and line breaks, some of them inside tags. A tag with ID 1 sits in the middle, tags with ID 2 are spread everywhere
+std::string generateMarkup(size_t bytes, float tagDensity, std::mt19937& random) {
+	const char* words[] = { "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do", "eiusmod", "tempor",
+		"incididunt", "ut", "labore", "et", "dolore", "magna", "aliqua", "enim", "ad", "minim", "veniam", "quis", "nostrud" };
+	const char* tags[][2] = { { "<b>", "</b>" }, { "<i>", "</i>" }, { "<u>", "</u>" }, { "<c=blue,id=2>", "</c>" }, { "<ot=2,oc=red>", "</ot,/oc>" }, { "<lts=1.5>", "</lts>" } };
+
+	std::uniform_real_distribution<float> chance(0.f, 1.f);
+	std::string markup;
+	markup.reserve(bytes + 64);
+	bool middleTag = false;
+	size_t wordsInLine = 0;
+	while (markup.size() < bytes) {
+		const char* word = words[random() % (sizeof(words) / sizeof(words[0]))];
+		if (!middleTag && markup.size() >= bytes / 2) {
+			markup += "<c=red,id=1>";
+			markup += word;
+			markup += "</c>";
+			middleTag = true;
+		}
+		else if (chance(random) < tagDensity) {
+			const char* const* tag = tags[random() % (sizeof(tags) / sizeof(tags[0]))];
+			markup += tag[0];
+			markup += word;
+			markup += tag[1];
+		}
+		else
+			markup += word;
+		markup += (++wordsInLine % 16 == 0) ? '\n' : ' ';
+	}
+	return markup;
+}
+
+struct Result {
+	std::string name;
+	size_t iterations = 0;
+	double seconds = 0;
+	double bytesPerIteration = 0; //Markup covered by one iteration, for the throughput
+	size_t allocations = 0;
+	size_t allocatedBytes = 0;
+};
+
+//Runs the operation until it took a quarter of a second (at least once)
+template<class Operation>
+Result measure(std::string const& name, double bytesPerIteration, Operation&& operation) {
+	Result result;
+	result.name = name;
+	result.bytesPerIteration = bytesPerIteration;
+	size_t startAllocations = allocations;
+	size_t startAllocatedBytes = allocatedBytes;
+	auto start = std::chrono::steady_clock::now();
+	do {
+		operation(result.iterations);
+		result.iterations++;
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (result.seconds < 0.25 && result.iterations < 100000);
+	result.allocations = allocations - startAllocations;
+	result.allocatedBytes = allocatedBytes - startAllocatedBytes;
+	return result;
+}
+
+std::vector<Result> runCorpus(sf::Font const& font, Corpus const& corpus) {
+	std::vector<Result> results;
+	double bytes = static_cast<double>(corpus.markup.size());
+
+	RichText text;
+	text.setFont(font);
+	text.setHorizontalLimit(corpus.width);
+	if (corpus.outline)
+		text.setOutlineThickness(1.f);
+
+	results.push_back(measure("parse_full", bytes, [&](size_t) {
+		text.parseString(corpus.markup);
+	}));
+
+	//Appends split at line breaks, which never fall inside a tag
+	std::vector<std::string> chunks;
+	size_t chunkSize = corpus.markup.size() / 16 + 1;
+	for (size_t start = 0; start < corpus.markup.size();) {
+		size_t end = corpus.markup.find('\n', start + chunkSize);
+		end = (end == std::string::npos) ? corpus.markup.size() : end + 1;
+		chunks.push_back(corpus.markup.substr(start, end - start));
+		start = end;
+	}
+	results.push_back(measure("parse_append", bytes, [&](size_t) {
+		for (size_t i = 0; i < chunks.size(); i++)
+			text.parseString(chunks[i], i > 0);
+	}));
+
+	text.getLocalBounds();
+	results.push_back(measure("layout_full", bytes, [&](size_t i) {
+		text.setFillColor(i % 2 ? sf::Color::Black : sf::Color::White);
+		text.getLocalBounds();
+	}));
+
+	results.push_back(measure("layout_middle", bytes / 2, [&](size_t i) {
+		text.setFillColor(1, i % 2 ? sf::Color::Red : sf::Color::Green);
+		text.getLocalBounds();
+	}));
+
+	std::mt19937 random(42);
+	size_t length = text.getParsedString().getSize();
+	results.push_back(measure("find_character_bounds", bytes / 2, [&](size_t) {
+		text.findCharacterBounds(random() % length);
+	}));
+
+	size_t maxLimit = text.getMaxEffectiveCharacterLimit();
+	results.push_back(measure("character_limit_sweep", bytes, [&](size_t) {
+		for (size_t step = 0; step <= 16; step++) {
+			text.setCharacterLimit(maxLimit * step / 16);
+			text.getLocalBounds();
+		}
+	}));
+	text.setCharacterLimit(std::numeric_limits<size_t>::max());
+
+	results.push_back(measure("id_fill_color_toggle", bytes, [&](size_t i) {
+		text.setFillColor(2, i % 2 ? sf::Color::Blue : sf::Color::Cyan);
+		text.getLocalBounds();
+	}));
+
+	results.push_back(measure("horizontal_limit_change", bytes, [&](size_t i) {
+		text.setHorizontalLimit(i % 2 ? corpus.width : corpus.width * 0.75f);
+		text.getLocalBounds();
+	}));
+
+	return results;
+}
+
+int main(int argc, char** argv) {
+	std::string fontFile = argc > 1 ? argv[1] : "Resources/OpenSans.ttf";
+	size_t maxBytes = argc > 2 ? std::stoull(argv[2]) : 10 * 1024 * 1024;
+
+	sf::Font font;
+	if (!font.loadFromFile(fontFile)) {
+		std::fprintf(stderr, "Could not load %s\n", fontFile.c_str());
+		return 1;
+	}
+	RichText::setLayoutCacheEnabled(false); //Every iteration would be a cache hit
+
+	std::mt19937 random(1234);
+	std::vector<Corpus> corpora;
+	for (size_t bytes = 1024; bytes <= maxBytes; bytes *= 10) {
+		corpora.push_back(Corpus { "sparse_" + std::to_string(bytes), bytes, 0.02f, 1200.f, false, "" });
+		corpora.push_back(Corpus { "dense_outlined_" + std::to_string(bytes), bytes, 0.3f, 400.f, true, "" });
+	}
+
+	std::printf("{\n\t\"corpora\": [");
+	for (size_t c = 0; c < corpora.size(); c++) {
+		Corpus& corpus = corpora[c];
+		std::fprintf(stderr, "%s...\n", corpus.name.c_str());
+		corpus.markup = generateMarkup(corpus.bytes, corpus.tagDensity, random);
+		std::vector<Result> results = runCorpus(font, corpus);
+
+		std::printf("%s\n\t\t{\n\t\t\t\"name\": \"%s\", \"bytes\": %zu, \"tagDensity\": %g, \"width\": %g, \"outline\": %s,\n\t\t\t\"results\": {",
+			c ? "," : "", corpus.name.c_str(), corpus.markup.size(), corpus.tagDensity, corpus.width, corpus.outline ? "true" : "false");
+		for (size_t r = 0; r < results.size(); r++) {
+			Result const& result = results[r];
+			double perIteration = result.seconds / result.iterations;
+			std::printf("%s\n\t\t\t\t\"%s\": { \"iterations\": %zu, \"secondsPerIteration\": %.9f, \"bytesPerSecond\": %.0f, \"allocationsPerIteration\": %.1f, \"allocatedBytesPerIteration\": %.0f }",
+				r ? "," : "", result.name.c_str(), result.iterations, perIteration, result.bytesPerIteration / perIteration,
+				static_cast<double>(result.allocations) / result.iterations, static_cast<double>(result.allocatedBytes) / result.iterations);
+		}
+		std::printf("\n\t\t\t}\n\t\t}");
+		std::fflush(stdout);
+		corpus.markup.clear();
+		corpus.markup.shrink_to_fit();
+	}
+	std::printf("\n\t]\n}\n");
+	return 0;
+}
@@ -5,4 +5,5 @@ BUILD_FLAGS := \
 	-pg
 
 BUILD_MACROS := \
-	_DEBUG
\ No newline at end of file
+	_DEBUG \
+	RICHTEXT_PERFORMANCE_COUNTERS
\ No newline at end of file
@@ -4,4 +4,5 @@ BUILD_FLAGS := \
 	$(BUILD_FLAGS)
 
 BUILD_MACROS := \
-	_DEBUG
+	_DEBUG \
+	RICHTEXT_PERFORMANCE_COUNTERS
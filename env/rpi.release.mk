@@ -20,3 +20,6 @@ LINK_LIBRARIES := \
 
 BUILD_FLAGS := \
 	-pthread
+
+BUILD_MACROS := \
+	RICHTEXT_COMPACT_STORAGE
@@ -3,7 +3,7 @@ CFLAGS := -Wfatal-errors -Wunreachable-code -Wextra -Wall -std=c++17 -fdiagnosti
 RC := windres.exe
 
 _MINGW := D:/Programming/mingw32/bin
-_SFML := D:/Programming/SFML-2.5.1
+_SFML := D:/Programming/SFML-2.6.1
 _SFML_BIN := $(_SFML)/bin
 
 LIB_DIRS := \
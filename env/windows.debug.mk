@@ -4,7 +4,8 @@ BUILD_FLAGS := \
 	-pg
 
 BUILD_MACROS := \
-	_DEBUG
+	_DEBUG \
+	RICHTEXT_PERFORMANCE_COUNTERS
 
 LINK_LIBRARIES := \
 	sfml-graphics-d \
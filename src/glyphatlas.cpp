@@ -0,0 +1,275 @@
+#include "glyphatlas.h"
+#include <algorithm>
+#include <cmath>
+
+GlyphAtlas::GlyphAtlas() {
+	reset();
+}
+
+bool GlyphAtlas::loadFromFile(std::string const& filename) {
+	m_filename = filename;
+	m_fontData.clear();
+	reset();
+	return reloadFont();
+}
+
+bool GlyphAtlas::loadFromMemory(void const* data, size_t sizeInBytes) {
+	m_filename.clear();
+	m_fontData.assign(static_cast<char const*>(data), static_cast<char const*>(data) + sizeInBytes);
+	reset();
+	return reloadFont();
+}
+
+void GlyphAtlas::setMemoryBudget(size_t bytes) {
+	m_memoryBudget = bytes;
+	reset();
+}
+
+size_t GlyphAtlas::getMemoryBudget() const { return m_memoryBudget; }
+
+void GlyphAtlas::setOutlineThicknessStep(float step) {
+	m_outlineThicknessStep = step;
+}
+
+float GlyphAtlas::getOutlineThicknessStep() const { return m_outlineThicknessStep; }
+
+float GlyphAtlas::quantizeOutlineThickness(float thickness) const {
+	if (m_outlineThicknessStep <= 0.f)
+		return thickness;
+	return std::round(thickness / m_outlineThicknessStep) * m_outlineThicknessStep;
+}
+
+sf::Glyph const& GlyphAtlas::getGlyph(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness, unsigned int* shelf, bool* cold) {
+	GlyphKey key { codePoint, characterSize, bold, quantizeOutlineThickness(outlineThickness) };
+
+	auto it = m_glyphs.find(key);
+	bool found = it != m_glyphs.end();
+	if (found)
+		m_stats.hits++;
+	else {
+		m_stats.misses++;
+		it = m_glyphs.emplace(key, Entry { m_font.getGlyph(codePoint, characterSize, bold, key.outlineThickness) }).first;
+	}
+
+	Entry& entry = it->second;
+	if (entry.failed || (!found && entry.glyph.textureRect.width > 0 && entry.glyph.textureRect.height > 0)) //New glyph, or one that didn't fit before
+		place(key, entry);
+	else if (entry.shelf != NoShelf)
+		m_shelves[entry.shelf].lastUse = m_useStamp;
+
+	if (shelf)
+		*shelf = entry.shelf;
+	if (cold)
+		*cold = !found;
+	return entry.glyph;
+}
+
+sf::Texture const& GlyphAtlas::getTexture() const { return m_texture; }
+
+void GlyphAtlas::flush() {
+	if (!m_pendingCopies.empty()) {
+		std::sort(m_pendingCopies.begin(), m_pendingCopies.end(), [](PendingCopy const& a, PendingCopy const& b) { return a.characterSize < b.characterSize; });
+
+		//Read each font page back once, then copy every glyph of that size out of it
+		sf::Image page;
+		unsigned int pageSize = 0;
+		std::vector<sf::Uint8> buffer;
+		for (PendingCopy const& copy : m_pendingCopies) {
+			if (pageSize != copy.characterSize) {
+				page = m_font.getTexture(copy.characterSize).copyToImage();
+				pageSize = copy.characterSize;
+			}
+			sf::Uint8 const* pixels = page.getPixelsPtr();
+			int pageWidth = page.getSize().x;
+			int pageHeight = page.getSize().y;
+
+			//Anything outside the page (the padding of glyphs at its edge) stays transparent
+			buffer.assign(copy.source.width * copy.source.height * 4, 255);
+			for (size_t i = 3; i < buffer.size(); i += 4)
+				buffer[i] = 0;
+			int left = std::max(copy.source.left, 0);
+			int right = std::min(copy.source.left + copy.source.width, pageWidth);
+			for (int y = std::max(copy.source.top, 0); y < std::min(copy.source.top + copy.source.height, pageHeight) && left < right; y++) {
+				sf::Uint8 const* row = pixels + (y * pageWidth + left) * 4;
+				std::copy(row, row + (right - left) * 4, buffer.begin() + ((y - copy.source.top) * copy.source.width + left - copy.source.left) * 4);
+			}
+			m_texture.update(buffer.data(), copy.source.width, copy.source.height, copy.destination.x, copy.destination.y);
+		}
+		m_pendingCopies.clear();
+	}
+
+	//Release the pages of the rasterizing font once they hold more than half the budget; the glyphs live in the atlas now
+	size_t stagingBytes = 0;
+	for (unsigned int size : m_stagingSizes) {
+		sf::Vector2u pageSize = m_font.getTexture(size).getSize();
+		stagingBytes += pageSize.x * pageSize.y * 4;
+	}
+	if (stagingBytes > m_memoryBudget / 2) {
+		reloadFont();
+		m_stats.fontReloads++;
+	}
+}
+
+void GlyphAtlas::touch(unsigned int shelf) {
+	if (shelf < m_shelves.size())
+		m_shelves[shelf].lastUse = m_useStamp;
+}
+
+void GlyphAtlas::beginUse() {
+	m_useStamp++;
+}
+
+sf::Uint64 GlyphAtlas::getGeneration() const { return m_generation; }
+
+sf::Uint64 GlyphAtlas::getShelfGeneration(unsigned int shelf) const {
+	return shelf < m_shelves.size() ? m_shelves[shelf].generation : 0;
+}
+
+GlyphAtlas::Stats GlyphAtlas::getStats() const {
+	Stats stats = m_stats;
+	stats.glyphs = m_glyphs.size();
+	stats.shelves = m_shelves.size();
+	stats.occupancy = static_cast<float>(m_usedArea) / (static_cast<float>(m_textureSize) * m_textureSize);
+	stats.textureBytes = static_cast<size_t>(m_textureSize) * m_textureSize * 4;
+	return stats;
+}
+
+bool GlyphAtlas::GlyphKey::operator==(GlyphKey const& other) const {
+	return codePoint == other.codePoint && characterSize == other.characterSize && bold == other.bold && outlineThickness == other.outlineThickness;
+}
+
+size_t GlyphAtlas::GlyphKeyHasher::operator()(GlyphKey const& key) const {
+	size_t hash = std::hash<sf::Uint32>()(key.codePoint);
+	hash = hash * 31 + std::hash<unsigned int>()(key.characterSize);
+	hash = hash * 31 + (key.bold ? 1 : 0);
+	hash = hash * 31 + std::hash<float>()(key.outlineThickness);
+	return hash;
+}
+
+bool GlyphAtlas::reloadFont() {
+	m_stagingSizes.clear();
+	if (!m_filename.empty())
+		return m_font.loadFromFile(m_filename);
+	if (!m_fontData.empty())
+		return m_font.loadFromMemory(m_fontData.data(), m_fontData.size());
+	return false;
+}
+
+void GlyphAtlas::reset() {
+	//Largest power of two texture that fits in the budget
+	unsigned int maximumSize = sf::Texture::getMaximumSize();
+	m_textureSize = 64;
+	while (m_textureSize * 2 <= maximumSize && static_cast<size_t>(m_textureSize) * 2 * m_textureSize * 2 * 4 <= m_memoryBudget)
+		m_textureSize *= 2;
+
+	//Transparent white everywhere, except for an opaque block in the corner used by underlines and strikethroughs (like the pages of sf::Font)
+	std::vector<sf::Uint8> pixels(m_textureSize * m_textureSize * 4, 255);
+	for (size_t i = 3; i < pixels.size(); i += 4)
+		pixels[i] = 0;
+	for (unsigned int y = 0; y < 4; y++)
+		for (unsigned int x = 0; x < 4; x++)
+			pixels[(y * m_textureSize + x) * 4 + 3] = 255;
+	m_texture.create(m_textureSize, m_textureSize);
+	m_texture.update(pixels.data());
+	m_texture.setSmooth(true);
+
+	m_glyphs.clear();
+	m_pendingCopies.clear();
+	m_usedArea = 0;
+	m_nextShelfTop = 8; //Keeps the reserved corner and a transparent area for glyphs that don't fit
+	m_shelves.clear(); //Shelf generations keep increasing, so instances that used the old shelves see them as evicted
+	m_generation++;
+}
+
+void GlyphAtlas::place(GlyphKey const& key, Entry& entry) {
+	//Always ask the rasterizing font again: it may have been reloaded since the glyph was first requested
+	sf::IntRect rect = m_font.getGlyph(key.codePoint, key.characterSize, key.bold, key.outlineThickness).textureRect;
+	if (std::find(m_stagingSizes.begin(), m_stagingSizes.end(), key.characterSize) == m_stagingSizes.end())
+		m_stagingSizes.push_back(key.characterSize);
+
+	//RichText samples one pixel around the glyph; the font pages keep it transparent, so it is copied along
+	unsigned int width = rect.width + 2;
+	unsigned int height = rect.height + 2;
+	sf::Vector2u position;
+	unsigned int shelf = allocate(width, height, position);
+	if (shelf == NoShelf) {
+		m_stats.failedInsertions++;
+		entry.glyph.textureRect = sf::IntRect(6, 2, 0, 0); //Transparent area
+		entry.failed = true;
+		return;
+	}
+
+	m_pendingCopies.push_back(PendingCopy { key.characterSize, sf::IntRect(rect.left - 1, rect.top - 1, width, height), position });
+	entry.glyph.textureRect = sf::IntRect(position.x + 1, position.y + 1, rect.width, rect.height);
+	entry.shelf = shelf;
+	entry.failed = false;
+
+	Shelf& s = m_shelves[shelf];
+	s.glyphs.push_back(key);
+	s.usedArea += width * height;
+	s.lastUse = m_useStamp;
+	m_usedArea += width * height;
+}
+
+unsigned int GlyphAtlas::allocate(unsigned int width, unsigned int height, sf::Vector2u& position) {
+	if (width > m_textureSize)
+		return NoShelf;
+	unsigned int shelfHeight = (height + 3) / 4 * 4;
+
+	//Tightest existing shelf with room left
+	unsigned int best = NoShelf;
+	for (unsigned int i = 0; i < m_shelves.size(); i++) {
+		Shelf const& s = m_shelves[i];
+		if (s.height >= shelfHeight && s.height <= shelfHeight + shelfHeight / 2 + 4 && s.fill + width <= m_textureSize
+				&& (best == NoShelf || s.height < m_shelves[best].height))
+			best = i;
+	}
+
+	//New shelf below the others
+	if (best == NoShelf && m_nextShelfTop + shelfHeight <= m_textureSize) {
+		Shelf s;
+		s.top = m_nextShelfTop;
+		s.height = shelfHeight;
+		s.generation = ++m_shelfCounter;
+		m_shelves.push_back(s);
+		m_nextShelfTop += shelfHeight;
+		best = m_shelves.size() - 1;
+	}
+
+	//Least recently used shelf that is tall enough and wasn't used during the current period
+	if (best == NoShelf) {
+		for (unsigned int i = 0; i < m_shelves.size(); i++) {
+			Shelf const& s = m_shelves[i];
+			if (s.height >= shelfHeight && s.lastUse < m_useStamp
+					&& (best == NoShelf || s.lastUse < m_shelves[best].lastUse || (s.lastUse == m_shelves[best].lastUse && s.height < m_shelves[best].height)))
+				best = i;
+		}
+		if (best == NoShelf)
+			return NoShelf;
+		evict(best);
+	}
+
+	Shelf& s = m_shelves[best];
+	position = sf::Vector2u(s.fill, s.top);
+	s.fill += width;
+	return best;
+}
+
+void GlyphAtlas::evict(unsigned int shelf) {
+	Shelf& s = m_shelves[shelf];
+	for (GlyphKey const& key : s.glyphs)
+		m_glyphs.erase(key);
+	m_pendingCopies.erase(std::remove_if(m_pendingCopies.begin(), m_pendingCopies.end(), [&](PendingCopy const& copy) {
+		return copy.destination.y == s.top;
+	}), m_pendingCopies.end());
+
+	m_stats.evictedShelves++;
+	m_stats.evictedGlyphs += s.glyphs.size();
+	m_usedArea -= s.usedArea;
+
+	s.glyphs.clear();
+	s.fill = 0;
+	s.usedArea = 0;
+	s.generation = ++m_shelfCounter;
+	m_generation++;
+}
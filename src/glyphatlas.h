@@ -0,0 +1,118 @@
+#ifndef GLYPHATLAS_H
+#define GLYPHATLAS_H
+
+#include <SFML/Graphics.hpp>
+#include <unordered_map>
+#include <vector>
+#include <string>
+
+//Glyph texture shared by RichText instances, packing glyphs of every size in shelves under a memory budget.
+//sf::Font never frees the texture pages of the sizes it rasterized; the atlas rasterizes with its own copy of the font,
+//copies the glyphs it needs and reloads that copy from time to time to release its pages.
+//When the budget is reached, the least recently used shelf is evicted and the instances that used it lay out again.
+class GlyphAtlas
+{
+public:
+	GlyphAtlas();
+
+	bool loadFromFile(std::string const& filename); //Must be the same font as the one given to the RichText instances
+	bool loadFromMemory(void const* data, size_t sizeInBytes); //The data is copied
+
+	void setMemoryBudget(size_t bytes); //Texture memory; resets the atlas
+	size_t getMemoryBudget() const;
+
+	void setOutlineThicknessStep(float step); //Outline thicknesses are rounded to a multiple of step so that arbitrary values don't multiply glyph variants
+	float getOutlineThicknessStep() const;
+	float quantizeOutlineThickness(float thickness) const;
+
+	//shelf receives where the glyph is stored (NoShelf for empty glyphs), cold whether it had to be rasterized
+	sf::Glyph const& getGlyph(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness, unsigned int* shelf = nullptr, bool* cold = nullptr);
+	sf::Texture const& getTexture() const;
+
+	void flush(); //Uploads the pixels of the glyphs added since the last flush; called by RichText before drawing
+	void touch(unsigned int shelf); //Marks the shelf as used now, for the eviction order
+	void beginUse(); //Starts a new use period; shelves used during the current period are never evicted
+
+	sf::Uint64 getGeneration() const; //Changes every time a shelf is evicted
+	sf::Uint64 getShelfGeneration(unsigned int shelf) const; //Changes every time the shelf is evicted
+
+	struct Stats {
+		size_t glyphs = 0;
+		size_t shelves = 0;
+		float occupancy = 0.f; //Fraction of the texture area used by glyphs
+		size_t hits = 0;
+		size_t misses = 0;
+		size_t evictedShelves = 0;
+		size_t evictedGlyphs = 0;
+		size_t failedInsertions = 0; //Glyphs that could not fit even after eviction; they are drawn empty
+		size_t fontReloads = 0;
+		size_t textureBytes = 0;
+	};
+	Stats getStats() const;
+
+	static const unsigned int NoShelf = static_cast<unsigned int>(-1);
+
+private:
+	struct GlyphKey {
+		sf::Uint32 codePoint;
+		unsigned int characterSize;
+		bool bold;
+		float outlineThickness;
+		bool operator==(GlyphKey const& other) const;
+	};
+
+	struct GlyphKeyHasher {
+		size_t operator()(GlyphKey const& key) const;
+	};
+
+	struct Entry {
+		sf::Glyph glyph;
+		unsigned int shelf = NoShelf;
+		bool failed = false;
+	};
+
+	struct Shelf {
+		unsigned int top;
+		unsigned int height;
+		unsigned int fill = 0;
+		unsigned int usedArea = 0;
+		sf::Uint64 lastUse = 0;
+		sf::Uint64 generation = 1;
+		std::vector<GlyphKey> glyphs;
+	};
+
+	struct PendingCopy {
+		unsigned int characterSize;
+		sf::IntRect source; //In the font page, padding included
+		sf::Vector2u destination;
+	};
+
+	bool reloadFont();
+	void reset();
+	void place(GlyphKey const& key, Entry& entry);
+	unsigned int allocate(unsigned int width, unsigned int height, sf::Vector2u& position); //Returns the shelf, or NoShelf
+	void evict(unsigned int shelf);
+
+	sf::Font m_font;
+	std::string m_filename;
+	std::vector<char> m_fontData;
+	std::vector<unsigned int> m_stagingSizes; //Character sizes for which m_font holds a page
+
+	sf::Texture m_texture;
+	unsigned int m_textureSize = 0;
+	size_t m_memoryBudget = 4 * 1024 * 1024;
+	float m_outlineThicknessStep = 0.5f;
+
+	std::unordered_map<GlyphKey, Entry, GlyphKeyHasher> m_glyphs;
+	std::vector<Shelf> m_shelves;
+	unsigned int m_nextShelfTop = 0;
+	std::vector<PendingCopy> m_pendingCopies;
+
+	sf::Uint64 m_useStamp = 1;
+	sf::Uint64 m_generation = 0;
+	sf::Uint64 m_shelfCounter = 0;
+	size_t m_usedArea = 0;
+	Stats m_stats;
+};
+
+#endif // GLYPHATLAS_H
@@ -26,6 +26,10 @@ int main() {
 	highlightRect.setPosition(charBounds.left, charBounds.top);
 	highlightRect.setSize(sf::Vector2f(charBounds.width, charBounds.height));
 
+	RichText counters(font, "", 14); //Performance counters of rt, shown with C in builds defining RICHTEXT_PERFORMANCE_COUNTERS
+	counters.setPosition(10, 520);
+	bool showCounters = false;
+
 	sf::RectangleShape boundsRect;
 	boundsRect.setFillColor(sf::Color::Blue);
 	sf::FloatRect bounds = rt.getLocalBounds();
@@ -73,6 +77,9 @@ int main() {
 				case sf::Keyboard::X:
 					rt.parseString("Another extension can be added by pressing X. ", true);
 					break;
+				case sf::Keyboard::C:
+					showCounters = !showCounters;
+					break;
 				default:
 					break;
 				}
@@ -86,6 +93,13 @@ int main() {
 		window.draw(boundsRect);
 		window.draw(highlightRect);
 		window.draw(rt);
+		if (showCounters) {
+			RichText::PerformanceCounters const& c = rt.getPerformanceCounters();
+			counters.parseString("<c=white>Parses: " + std::to_string(c.parses) + " - Layouts: " + std::to_string(c.layouts) + " (" + std::to_string(c.fullLayouts) + " full, last from line " + std::to_string(c.lastLayoutStartLine) + ")"
+				+ "\nLines: " + std::to_string(c.linesLaidOut) + " - Vertices: " + std::to_string(c.verticesGenerated) + " - Stylizers: " + std::to_string(c.stylizersReplayed) + " - Glyph misses: " + std::to_string(c.glyphCacheMisses)
+				+ "\nLayout: " + std::to_string(c.layoutNanoseconds / 1000) + " us - Draw: " + std::to_string(c.drawNanoseconds / 1000) + " us");
+			window.draw(counters);
+		}
         window.display();
     }
 }
@@ -1,16 +1,162 @@
 #include "richtext.h"
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <functional>
 #include <cmath>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+
+#ifdef RICHTEXT_PERFORMANCE_COUNTERS
+std::mutex globalCountersMutex;
+RichText::PerformanceCounters globalCounters;
+
+void addCounters(RichText::PerformanceCounters& to, RichText::PerformanceCounters const& counters, RichText::PerformanceCounters const& since) {
+	to.parses += counters.parses - since.parses;
+	to.charactersParsed += counters.charactersParsed - since.charactersParsed;
+	to.layouts += counters.layouts - since.layouts;
+	to.fullLayouts += counters.fullLayouts - since.fullLayouts;
+	to.lastLayoutStartLine = counters.lastLayoutStartLine;
+	to.linesLaidOut += counters.linesLaidOut - since.linesLaidOut;
+	to.verticesGenerated += counters.verticesGenerated - since.verticesGenerated;
+	to.stylizersReplayed += counters.stylizersReplayed - since.stylizersReplayed;
+	to.glyphCacheMisses += counters.glyphCacheMisses - since.glyphCacheMisses;
+	to.characterBoundsScanned += counters.characterBoundsScanned - since.characterBoundsScanned;
+	to.measures += counters.measures - since.measures;
+	to.variablesReplaced += counters.variablesReplaced - since.variablesReplaced;
+	to.parseNanoseconds += counters.parseNanoseconds - since.parseNanoseconds;
+	to.layoutNanoseconds += counters.layoutNanoseconds - since.layoutNanoseconds;
+	to.drawNanoseconds += counters.drawNanoseconds - since.drawNanoseconds;
+	to.animateNanoseconds += counters.animateNanoseconds - since.animateNanoseconds;
+	to.characterBoundsNanoseconds += counters.characterBoundsNanoseconds - since.characterBoundsNanoseconds;
+	to.measureNanoseconds += counters.measureNanoseconds - since.measureNanoseconds;
+}
+
+//Times a phase into the counters of an instance; the outermost phase then adds everything counted meanwhile to the global counters
+class PhaseTimer {
+public:
+	PhaseTimer(RichText::PerformanceCounters& counters, unsigned int& depth, sf::Uint64 RichText::PerformanceCounters::* nanoseconds) :
+		m_counters(counters), m_depth(depth), m_nanoseconds(nanoseconds), m_start(std::chrono::steady_clock::now())
+	{
+		if (m_depth++ == 0)
+			m_since = counters;
+	}
+
+	~PhaseTimer() {
+		m_counters.*m_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+		if (--m_depth == 0) {
+			std::lock_guard<std::mutex> lock(globalCountersMutex);
+			addCounters(globalCounters, m_counters, m_since);
+		}
+	}
+
+private:
+	RichText::PerformanceCounters& m_counters;
+	unsigned int& m_depth;
+	sf::Uint64 RichText::PerformanceCounters::* m_nanoseconds;
+	std::chrono::steady_clock::time_point m_start;
+	RichText::PerformanceCounters m_since;
+};
+
+#define RICHTEXT_COUNT(counter, amount) (m_counters.counter += (amount))
+#define RICHTEXT_SET(counter, value) (m_counters.counter = (value))
+#define RICHTEXT_TIME_PHASE(counter) PhaseTimer phaseTimer(m_counters, m_countersDepth, &PerformanceCounters::counter)
+//Into other counters than the instance's, such as the ones of a prepared geometry
+#define RICHTEXT_COUNT_TO(counters, counter, amount) ((counters).counter += (amount))
+#define RICHTEXT_SET_TO(counters, counter, value) ((counters).counter = (value))
+#define RICHTEXT_TIME_PHASE_TO(counters, depth, counter) PhaseTimer phaseTimer(counters, depth, &PerformanceCounters::counter)
+#else
+#define RICHTEXT_COUNT(counter, amount) ((void)0)
+#define RICHTEXT_SET(counter, value) ((void)0)
+#define RICHTEXT_TIME_PHASE(counter) ((void)0)
+#define RICHTEXT_COUNT_TO(counters, counter, amount) ((void)0)
+#define RICHTEXT_SET_TO(counters, counter, value) ((void)0)
+#define RICHTEXT_TIME_PHASE_TO(counters, depth, counter) ((void)0)
+#endif
+
+#ifdef RICHTEXT_TRACING
+struct TraceEvent {
+	char const* name;
+	void const* instance;
+	sf::Uint64 start; //In nanoseconds since traceEpoch
+	sf::Uint64 duration;
+	size_t startLine;
+	size_t characters;
+};
+
+//Last events of a thread; only that thread writes to it, so recording takes no lock
+struct TraceBuffer {
+	static constexpr size_t capacity = 16384;
+	std::vector<TraceEvent> events = std::vector<TraceEvent>(capacity);
+	std::atomic<size_t> recorded { 0 };
+	size_t cleared = 0; //Events before this one were cleared; guarded by traceBuffersMutex
+	unsigned int thread;
+};
+
+const std::chrono::steady_clock::time_point traceEpoch = std::chrono::steady_clock::now();
+std::mutex traceBuffersMutex;
+std::vector<std::shared_ptr<TraceBuffer>> traceBuffers; //Kept after their thread exits, so that its events can still be saved
+
+TraceBuffer& threadTraceBuffer() {
+	thread_local std::shared_ptr<TraceBuffer> buffer;
+	if (!buffer) {
+		buffer = std::make_shared<TraceBuffer>();
+		std::lock_guard<std::mutex> lock(traceBuffersMutex);
+		buffer->thread = traceBuffers.size() + 1;
+		traceBuffers.push_back(buffer);
+	}
+	return *buffer;
+}
+
+sf::Uint64 traceNow() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+//Records the time between its construction and end() (or destruction) as a complete event
+class TraceScope {
+public:
+	TraceScope(char const* name, void const* instance, size_t startLine, size_t characters) :
+		startLine(startLine), characters(characters), m_name(name), m_instance(instance), m_start(traceNow()) {}
+	~TraceScope() { end(); }
+
+	void end() {
+		if (!m_name)
+			return;
+		TraceBuffer& buffer = threadTraceBuffer();
+		size_t recorded = buffer.recorded.load(std::memory_order_relaxed);
+		buffer.events[recorded % TraceBuffer::capacity] = TraceEvent { m_name, m_instance, m_start, traceNow() - m_start, startLine, characters };
+		buffer.recorded.store(recorded + 1, std::memory_order_release);
+		m_name = nullptr;
+	}
+
+	size_t startLine;
+	size_t characters;
+
+private:
+	char const* m_name;
+	void const* m_instance;
+	sf::Uint64 m_start;
+};
+
+#define RICHTEXT_TRACE_SCOPE(scope, name, startLine, characters) TraceScope scope(name, this, startLine, characters)
+#define RICHTEXT_TRACE_ARGUMENT(scope, argument, value) (scope.argument = (value))
+#define RICHTEXT_TRACE_END(scope) scope.end()
+#else
+#define RICHTEXT_TRACE_SCOPE(scope, name, startLine, characters) ((void)0)
+#define RICHTEXT_TRACE_ARGUMENT(scope, argument, value) ((void)0)
+#define RICHTEXT_TRACE_END(scope) ((void)0)
+#endif
 
 RichText::RichText() :
 	m_font(nullptr),
 	m_characterSize(20),
-	m_charVertices(sf::Triangles),
-	m_charOutlineVertices(sf::Triangles),
-	m_lineVertices(sf::Triangles),
-	m_lineOutlineVertices(sf::Triangles),
+	m_document(std::make_shared<Document>()),
+	m_geometry(std::make_shared<Geometry>()),
 	m_shouldUpdateVertices(false)
 {
 }
@@ -18,22 +164,61 @@ RichText::RichText() :
 RichText::RichText(sf::Font const& font, sf::String const& string, uint characterSize) :
 	m_font(&font),
 	m_characterSize(characterSize),
-	m_charVertices(sf::Triangles),
-	m_charOutlineVertices(sf::Triangles),
-	m_lineVertices(sf::Triangles),
-	m_lineOutlineVertices(sf::Triangles),
+	m_document(std::make_shared<Document>()),
+	m_geometry(std::make_shared<Geometry>()),
 	m_shouldUpdateVertices(true)
 {
+	updateGlyphRegistries();
 	initializeLineStarts();
 	parseString(string);
 }
 
+RichText::RichText(RichText&& other) :
+	RichText(static_cast<RichText const&>(other)) //Cheap, and leaves the source in a state it can be cleared from
+{
+	other.clearMovedFrom();
+}
+
+RichText& RichText::operator=(RichText&& other) {
+	if (&other != this) {
+		*this = static_cast<RichText const&>(other);
+		other.clearMovedFrom();
+	}
+	return *this;
+}
+
+void RichText::clearMovedFrom() {
+	m_document = std::make_shared<Document>();
+	std::atomic_store(&m_preparedGeometry, std::shared_ptr<Geometry>());
+	m_adoptedGeometry.reset();
+	m_geometry = std::make_shared<Geometry>();
+	m_layoutInProgress = false;
+	m_measurements.clear();
+	m_updateStartLine = 0;
+	m_shouldUpdateVertices = true;
+}
+
 RichText::~RichText() {
-	for (auto it = m_stylizers.begin(); it != m_stylizers.end(); it++)
-		delete it->second;
+	if (std::shared_ptr<RichTextScheduler::Registry> scheduler = m_scheduler.registry.lock())
+		scheduler->remove(this);
+}
+
+//Adds the line breaks and displayable characters of plain text to the counts of a document
+void countCharacters(sf::String const& text, size_t& lineBreaks, size_t& displayable) {
+	for (size_t k = 0; k < text.getSize(); k++) {
+		if (text[k] == '\n')
+			lineBreaks++;
+		else if (text[k] != ' ' && text[k] != '\t')
+			displayable++;
+	}
 }
 
 void RichText::parseString(sf::String const& s, bool append) {
+	//The markup parsed last isn't kept: a text with its length and hash is taken for it. Nothing new to prewarm or drop from the log then
+	sf::Uint64 markupHash = append ? 0 : Document::hashMarkup(s);
+	if (!append && m_document->isParsedMarkup && s.getSize() == m_document->markupLength && markupHash == m_document->markupHash)
+		return;
+
 	const std::unordered_map<std::string, Stylizer::StyleProperty> tagMap {
 		{"b", Stylizer::Bold},
 		{"i", Stylizer::Italic},
@@ -43,7 +228,11 @@ void RichText::parseString(sf::String const& s, bool append) {
 		{"ot", Stylizer::OutlineThickness},
 		{"oc", Stylizer::OutlineColor},
 		{"lts", Stylizer::LetterSpacing},
-		{"lns", Stylizer::LineSpacing}
+		{"lns", Stylizer::LineSpacing},
+		{"sz", Stylizer::CharacterSize},
+		{"wave", Stylizer::Wave},
+		{"shake", Stylizer::Shake},
+		{"pulse", Stylizer::Pulse}
 	};
 
 	const std::unordered_map<std::string, sf::Color> colorMap {
@@ -58,37 +247,33 @@ void RichText::parseString(sf::String const& s, bool append) {
 		{"transparent", sf::Color::Transparent}
 	};
 
-	m_shouldUpdateVertices = true;
+	RICHTEXT_TIME_PHASE(parseNanoseconds);
+	RICHTEXT_COUNT(parses, 1);
+	RICHTEXT_COUNT(charactersParsed, s.getSize());
+	RICHTEXT_TRACE_SCOPE(trace, "parse", 0, s.getSize());
 
+	std::shared_ptr<Document> previous;
 	if (!append) {
-		m_string.clear();
-		for (auto it = m_stylizers.begin(); it != m_stylizers.end(); it++)
-			delete it->second;
-		m_stylizers.clear();
-		m_modifiableStylizers.clear();
-
-		m_charVertices.clear();
-		m_lineVertices.clear();
-		m_charOutlineVertices.clear();
-		m_lineOutlineVertices.clear();
-
-		m_totalDisplayableCharacters = 0;
-
-		m_updateStartLine = 0;
+		previous = m_document;
+		m_document = std::make_shared<Document>(); //Never clear in place: the previous document may be shared
 	}
 	else {
-		m_updateStartLine = std::min(m_lineStart_i.size()-1, m_updateStartLine);
+		requestLayout();
+		m_updateStartLine = std::min(getLaidOutGeometry().layout.lines.size()-1, m_updateStartLine);
 	}
+	Document& document = editDocument();
 
 	size_t i = 0;
-	size_t true_i = m_string.getSize();
-	size_t i_displayOnly = m_totalDisplayableCharacters;
+	size_t true_i = document.string.getSize();
+	size_t firstParsedChar = true_i;
+	size_t i_displayOnly = document.totalDisplayableCharacters;
 	size_t len = s.getSize();
 	while (i < len) {
 		if (s[i] == '<') {
 			std::vector<Stylizer*> stylizers;
 			bool modifiable = false;
 			int ID;
+			std::string variable;
 
 			size_t tags_end = s.find('>', i+1);
 			sf::String tags = s.substring(i+1, tags_end-i-1);
@@ -117,6 +302,11 @@ void RichText::parseString(sf::String const& s, bool append) {
 					case Stylizer::Italic:
 					case Stylizer::Underlined:
 					case Stylizer::StrikeThrough:
+					case Stylizer::Wave:
+					case Stylizer::Shake:
+					case Stylizer::Pulse:
+						if (it->second >= Stylizer::Wave)
+							document.hasAnimationTags = true;
 						if (ender)
 							stylizers.push_back(new EnderStylizer<bool>(it->second));
 						else if (inactive)
@@ -159,6 +349,7 @@ void RichText::parseString(sf::String const& s, bool append) {
 					case Stylizer::OutlineThickness:
 					case Stylizer::LetterSpacing:
 					case Stylizer::LineSpacing:
+					case Stylizer::CharacterSize:
 						if (ender)
 							stylizers.push_back(new EnderStylizer<float>(it->second));
 						else if (inactive)
@@ -185,30 +376,44 @@ void RichText::parseString(sf::String const& s, bool append) {
 				else if (tag == "id") {
 					if (arg.getSize() == 0)
 						break;
-					size_t j;
-					int tempID;
+					size_t j = 0;
+					int tempID = 0;
 					try {
 						tempID = std::stoi(arg.toAnsiString(), &j);
 					} catch (...) {
-						break;
+						j = 0;
 					}
-					if (j == arg.getSize()) {
+					//Negative numbers belong to the IDs of names: the tag gets no ID
+					if (j != arg.getSize() || tempID >= 0) {
 						modifiable = true;
-						ID = tempID;
+						ID = j == arg.getSize() ? tempID : getID(arg.toAnsiString());
 					}
 				}
+				else if (tag == "var") {
+					variable = arg.toAnsiString();
+				}
 
 				start = end+1;
 			} while (end != sf::String::InvalidPos);
 
 			for (auto it = stylizers.begin(); it != stylizers.end(); it++) {
-				m_stylizers.emplace(true_i, *it);
+				(*it)->index = document.stylizers.size(); //Parsing only ever adds stylizers at the end
+				document.stylizers.emplace(true_i, *it);
 			}
 
 			if (modifiable) {
-				for (auto it = stylizers.begin(); it != stylizers.end(); it++) {
-					m_modifiableStylizers.emplace(ID, *it);
-				}
+				std::vector<Stylizer*>& modifiableStylizers = document.modifiableStylizers[ID];
+				modifiableStylizers.insert(modifiableStylizers.end(), stylizers.begin(), stylizers.end());
+			}
+
+			//The value is inserted as it is, after the tag's stylizers
+			if (!variable.empty()) {
+				auto found = m_variables.find(variable);
+				sf::String value = found != m_variables.end() ? found->second : sf::String();
+				document.variables.push_back(Document::Variable { variable, true_i, value.getSize(), document.stylizers.size() });
+				document.string += value;
+				true_i += value.getSize();
+				countCharacters(value, document.lineBreaks, i_displayOnly);
 			}
 
 			i = tags_end;
@@ -216,242 +421,480 @@ void RichText::parseString(sf::String const& s, bool append) {
 		else if (s[i] != '\r') {
 			if (s[i] == '\\' && i+1 < len)
 				i++;
-			m_string += s[i];
+			document.string += s[i];
 			true_i++;
+			if (s[i] == '\n')
+				document.lineBreaks++;
 			if (s[i] != ' ' && s[i] != '\n' && s[i] != '\t' && s[i] != '\r')
 				i_displayOnly++;
 		}
 		i++;
 	}
 
-	m_totalDisplayableCharacters = i_displayOnly;
+	document.totalDisplayableCharacters = i_displayOnly;
+
+	//A new text is laid out again from where it starts differing from the previous one
+	if (!append) {
+		document.markupHash = markupHash;
+		document.markupLength = s.getSize();
+		document.isParsedMarkup = true;
+		firstParsedChar = findFirstDifference(*previous, document);
+		if (firstParsedChar == std::numeric_limits<size_t>::max())
+			return;
+		requestLayoutFrom(firstParsedChar);
+	}
+	RICHTEXT_TRACE_ARGUMENT(trace, startLine, m_updateStartLine);
+
+	if (m_prewarmOnParse)
+		prewarm(firstParsedChar);
+	dropLogLines();
+}
+
+sf::String const& RichText::getParsedString() const { return m_document->string; }
+
+void RichText::setVariable(std::string const& name, sf::String const& value) {
+	auto found = m_variables.find(name);
+	if (found != m_variables.end() ? found->second == value : value.isEmpty())
+		return;
+	m_variables[name] = value;
+	auto named = [&](Document::Variable const& variable) { return variable.name == name; };
+	if (std::none_of(m_document->variables.begin(), m_document->variables.end(), named))
+		return;
+	RICHTEXT_TRACE_SCOPE(trace, "set variable", 0, value.getSize());
+
+	Document& document = editDocument();
+	size_t firstChanged = std::numeric_limits<size_t>::max();
+	for (size_t v = 0; v < document.variables.size(); v++) {
+		Document::Variable& variable = document.variables[v];
+		if (variable.name != name)
+			continue;
+		sf::String replaced = document.string.substring(variable.start, variable.length);
+		if (replaced == value)
+			continue;
+
+		//A value as long as the one it replaces is written over it, then its glyphs are replaced where they are if they can be
+		if (value.getSize() == variable.length) {
+			for (size_t k = 0; k < value.getSize(); k++)
+				document.string[variable.start + k] = value[k];
+			if (firstChanged == std::numeric_limits<size_t>::max() && replaceVariableGlyphs(variable.start, replaced))
+				continue;
+		}
+		else {
+			document.string.erase(variable.start, variable.length);
+			document.string.insert(variable.start, value);
+		}
+		firstChanged = std::min(firstChanged, variable.start);
+
+		//The text after it moves, with the stylizers parsed after it and the variables after it
+		size_t replacedLineBreaks = 0, replacedDisplayable = 0;
+		countCharacters(replaced, replacedLineBreaks, replacedDisplayable);
+		document.lineBreaks -= replacedLineBreaks;
+		document.totalDisplayableCharacters -= replacedDisplayable;
+		countCharacters(value, document.lineBreaks, document.totalDisplayableCharacters);
+		size_t oldEnd = variable.start + variable.length;
+		size_t firstStylizer = variable.firstStylizer;
+		variable.length = value.getSize();
+		if (oldEnd != variable.start + variable.length) {
+			size_t movement = variable.start + variable.length - oldEnd; //Wraps around when the text gets shorter
+			RichTextLayout::Stylizers stylizers;
+			for (auto it = document.stylizers.begin(); it != document.stylizers.end(); it++)
+				stylizers.emplace_hint(stylizers.end(), it->second->index >= firstStylizer ? it->first + movement : it->first, it->second);
+			document.stylizers.swap(stylizers);
+			for (size_t w = v+1; w < document.variables.size(); w++)
+				document.variables[w].start += movement;
+		}
+	}
+
+	if (firstChanged != std::numeric_limits<size_t>::max())
+		requestLayoutFrom(firstChanged);
+}
+
+sf::String RichText::getVariable(std::string const& name) const {
+	auto found = m_variables.find(name);
+	return found != m_variables.end() ? found->second : sf::String();
+}
+
+RichText::Document& RichText::editDocument() {
+	if (m_document.use_count() > 1)
+		m_document = std::make_shared<Document>(*m_document);
+	m_document->isParsedMarkup = false;
+	return *m_document;
+}
+
+void RichText::requestLayoutFrom(size_t character) {
+	//Lines wrapped before a word may take it back once it changed, so they're laid out again from the line before
+	std::vector<RichTextLayout::Line> const& lines = getLaidOutGeometry().layout.lines;
+	auto after = [](size_t character, RichTextLayout::Line const& line) { return character < line.firstCharacter; };
+	size_t line = std::upper_bound(lines.begin(), lines.end(), character, after) - lines.begin();
+	line = line > 0 ? line - 1 : 0;
+	if (line > 0 && m_document->string[lines[line].firstCharacter - 1] != '\n')
+		line--;
+
+	requestLayout();
+	if (line == 0) {
+		initializeLineStarts();
+		m_updateStartLine = 0;
+	}
+	else
+		m_updateStartLine = std::min(m_updateStartLine, line);
+}
+
+size_t RichText::findFirstDifference(Document const& previous, Document const& document) {
+	sf::String const& a = previous.string;
+	sf::String const& b = document.string;
+	size_t length = std::min(a.getSize(), b.getSize());
+	size_t first = 0;
+	while (first < length && a[first] == b[first])
+		first++;
+	if (first == length && a.getSize() == b.getSize())
+		first = std::numeric_limits<size_t>::max();
+
+	//Stylizers are the same while they're at the same characters with the same effects, in the same order
+	auto x = previous.stylizers.begin();
+	auto y = document.stylizers.begin();
+	while (x != previous.stylizers.end() && y != document.stylizers.end() && x->first == y->first && x->first < first && x->second->hash() == y->second->hash()) {
+		x++;
+		y++;
+	}
+	if (x != previous.stylizers.end())
+		first = std::min(first, x->first);
+	if (y != document.stylizers.end())
+		first = std::min(first, y->first);
+	return first;
+}
+
+RichText::Document::Document(Document const& other) :
+	string(other.string),
+	totalDisplayableCharacters(other.totalDisplayableCharacters),
+	lineBreaks(other.lineBreaks),
+	hasAnimationTags(other.hasAnimationTags),
+	variables(other.variables)
+{
+	std::unordered_map<Stylizer const*, Stylizer*> clones;
+	for (auto it = other.stylizers.begin(); it != other.stylizers.end(); it++) {
+		Stylizer* clone = it->second->clone();
+		clones.emplace(it->second, clone);
+		stylizers.emplace_hint(stylizers.end(), it->first, clone);
+	}
+	for (auto it = other.modifiableStylizers.begin(); it != other.modifiableStylizers.end(); it++) {
+		std::vector<Stylizer*>& cloned = modifiableStylizers[it->first];
+		for (Stylizer* stylizer : it->second)
+			cloned.push_back(clones[stylizer]);
+	}
+}
+
+RichText::Document::~Document() {
+	for (auto it = stylizers.begin(); it != stylizers.end(); it++)
+		delete it->second;
 }
 
-sf::String const& RichText::getParsedString() const { return m_string; }
+size_t RichText::getStylizerLine(Stylizer const* stylizer) const {
+	std::vector<size_t> const& lines = getLaidOutGeometry().layout.stylizerLines;
+	return stylizer->index < lines.size() ? lines[stylizer->index] : std::numeric_limits<size_t>::max();
+}
 
 void RichText::setFont(const sf::Font &font) {
 	m_font = &font;
-	m_shouldUpdateVertices = true;
+	updateFontCoverages();
+	updateGlyphRegistries();
+	requestLayout();
 	m_updateStartLine = 0;
 	initializeLineStarts();
 }
 
 void RichText::setCharacterSize(uint size) {
 	m_characterSize = size;
-	m_shouldUpdateVertices = true;
+	requestLayout();
+	m_updateStartLine = 0;
+	initializeLineStarts();
+}
+
+void RichText::setGlyphAtlas(GlyphAtlas* atlas) {
+	m_atlas = atlas;
+	m_atlasShelves.clear();
+	m_atlasGeneration = atlas ? atlas->getGeneration() : 0;
+	requestLayout();
+	m_updateStartLine = 0;
+	initializeLineStarts();
+}
+
+void RichText::setFallbackFonts(std::vector<sf::Font const*> const& fonts) {
+	m_fallbackFonts = fonts;
+	updateFontCoverages();
+	updateGlyphRegistries();
+	requestLayout();
+	m_updateStartLine = 0;
+	initializeLineStarts();
+}
+
+void RichText::updateFontCoverages() {
+	m_fontCoverages.clear();
+	if (m_fallbackFonts.empty() || !m_font)
+		return;
+	m_fontCoverages.push_back(RichTextLayout::FontCoverage::of(*m_font));
+	for (sf::Font const* font : m_fallbackFonts)
+		m_fontCoverages.push_back(RichTextLayout::FontCoverage::of(*font));
+}
+
+unsigned int RichText::findFont(sf::Uint32 codePoint) const {
+	if (m_atlas || m_fontCoverages.empty())
+		return 0;
+	return RichTextLayout::FontCoverage::findFont(m_fontCoverages, codePoint);
+}
+
+sf::Font const& RichText::getChainFont(unsigned int font) const {
+	return (font == 0 || font > m_fallbackFonts.size()) ? *m_font : *m_fallbackFonts[font-1];
+}
+
+void RichText::setMetricsProvider(RichTextLayout::MetricsProvider const* metrics) {
+	m_metrics = metrics;
+	requestLayout();
+	m_updateStartLine = 0;
+	initializeLineStarts();
+}
+
+void RichText::setCompactStorage(bool compact) {
+	if (m_compactStorage == compact)
+		return;
+	m_compactStorage = compact;
+	m_visibleCharVertices = sf::VertexArray(sf::Triangles);
+	m_visibleCharOutlineVertices = sf::VertexArray(sf::Triangles);
+	requestLayout();
 	m_updateStartLine = 0;
 	initializeLineStarts();
 }
 
+bool RichText::getCompactStorage() const { return m_compactStorage; }
+
 void RichText::setStyle(sf::Uint32 style) {
 	m_style.bolds.front() = style & sf::Text::Bold;
 	m_style.italics.front() = style & sf::Text::Italic;
 	m_style.underlineds.front() = style & sf::Text::Underlined;
 	m_style.strikeThroughs.front() = style & sf::Text::StrikeThrough;
 	m_updateStartLine = 0;
-	m_shouldUpdateVertices = true;
+	requestLayout();
 }
 
 void RichText::setStyle(int ID, sf::Uint32 style) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		switch (it->second->getType()) {
-		case Stylizer::Bold:
-			static_cast<StarterStylizer<bool>*>(it->second)->setValue(style & sf::Text::Bold);
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-			break;
-		case Stylizer::Italic:
-			static_cast<StarterStylizer<bool>*>(it->second)->setValue(style & sf::Text::Italic);
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-			break;
-		case Stylizer::Underlined:
-			static_cast<StarterStylizer<bool>*>(it->second)->setValue(style & sf::Text::Underlined);
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-			break;
-		case Stylizer::StrikeThrough:
-			static_cast<StarterStylizer<bool>*>(it->second)->setValue(style & sf::Text::StrikeThrough);
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-			break;
-		default:
-			break;
-		}
-	}
-	m_shouldUpdateVertices = true;
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::None, false, true, style, sf::Color(), 0.f }))
+		requestLayout();
 }
 
 void RichText::setStyle(int ID, sf::Uint32 style, bool activated) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		switch (it->second->getType()) {
-		case Stylizer::Bold:
-			if (style & sf::Text::Bold) {
-				static_cast<StarterStylizer<bool>*>(it->second)->activated = activated;
-				m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-				m_shouldUpdateVertices = true;
-			}
-			break;
-		case Stylizer::Italic:
-			if (style & sf::Text::Italic) {
-				static_cast<StarterStylizer<bool>*>(it->second)->activated = activated;
-				m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-				m_shouldUpdateVertices = true;
-			}
-			break;
-		case Stylizer::Underlined:
-			if (style & sf::Text::Underlined) {
-				static_cast<StarterStylizer<bool>*>(it->second)->activated = activated;
-				m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-				m_shouldUpdateVertices = true;
-			}
-			break;
-		case Stylizer::StrikeThrough:
-			if (style & sf::Text::StrikeThrough) {
-				static_cast<StarterStylizer<bool>*>(it->second)->activated = activated;
-				m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-				m_shouldUpdateVertices = true;
-			}
-			break;
-		default:
-			break;
-		}
-	}
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::None, true, activated, style, sf::Color(), 0.f }))
+		requestLayout();
 }
 
 void RichText::setFillColor(sf::Color color) {
 	m_style.fillColors.front() = color;
 	m_updateStartLine = 0;
-	m_shouldUpdateVertices = true;
+	requestLayout();
 }
 
 void RichText::setFillColor(int ID, sf::Color color) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		if (it->second->getType() == Stylizer::FillColor) {
-			static_cast<StarterStylizer<sf::Color>*>(it->second)->setValue(color);
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-		}
-	}
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::FillColor, false, true, 0, color, 0.f }))
+		requestLayout();
 }
 
 void RichText::setFillColor(int ID, bool activated) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		if (it->second->getType() == Stylizer::FillColor) {
-			static_cast<StarterStylizer<sf::Color>*>(it->second)->activated = activated;
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-		}
-	}
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::FillColor, true, activated, 0, sf::Color(), 0.f }))
+		requestLayout();
 }
 
 void RichText::setOutlineThickness(float thickness) {
 	m_style.outlineThicknesses.front() = thickness;
 	m_updateStartLine = 0;
-	m_shouldUpdateVertices = true;
+	requestLayout();
 
 }
 
 void RichText::setOutlineThickness(int ID, float thickness) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		if (it->second->getType() == Stylizer::OutlineThickness) {
-			static_cast<StarterStylizer<float>*>(it->second)->setValue(thickness);
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-		}
-	}
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::OutlineThickness, false, true, 0, sf::Color(), thickness }))
+		requestLayout();
 }
 
 void RichText::setOutlineThickness(int ID, bool activated) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		if (it->second->getType() == Stylizer::OutlineThickness) {
-			static_cast<StarterStylizer<float>*>(it->second)->activated = activated;
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-		}
-	}
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::OutlineThickness, true, activated, 0, sf::Color(), 0.f }))
+		requestLayout();
 }
 
 void RichText::setOutlineColor(sf::Color color) {
 	m_style.outlineColors.front() = color;
 	m_updateStartLine = 0;
-	m_shouldUpdateVertices = true;
+	requestLayout();
 }
 
 void RichText::setOutlineColor(int ID, sf::Color color) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		if (it->second->getType() == Stylizer::OutlineColor) {
-			static_cast<StarterStylizer<sf::Color>*>(it->second)->setValue(color);
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-		}
-	}
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::OutlineColor, false, true, 0, color, 0.f }))
+		requestLayout();
 }
 
 void RichText::setOutlineColor(int ID, bool activated) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		if (it->second->getType() == Stylizer::OutlineColor) {
-			static_cast<StarterStylizer<sf::Color>*>(it->second)->activated = activated;
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-		}
-	}
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::OutlineColor, true, activated, 0, sf::Color(), 0.f }))
+		requestLayout();
 }
 
 
 void RichText::setLetterSpacingFactor(float factor) {
 	m_style.letterSpacingFactors.front() = factor;
 	m_updateStartLine = 0;
-	m_shouldUpdateVertices = true;
+	requestLayout();
 }
 
 void RichText::setLetterSpacingFactor(int ID, float factor) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		if (it->second->getType() == Stylizer::LetterSpacing) {
-			static_cast<StarterStylizer<float>*>(it->second)->setValue(factor);
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-		}
-	}
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::LetterSpacing, false, true, 0, sf::Color(), factor }))
+		requestLayout();
 }
 
 void RichText::setLetterSpacingFactor(int ID, bool activated) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		if (it->second->getType() == Stylizer::LetterSpacing) {
-			static_cast<StarterStylizer<float>*>(it->second)->activated = activated;
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-		}
-	}
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::LetterSpacing, true, activated, 0, sf::Color(), 0.f }))
+		requestLayout();
 }
 
 void RichText::setLineSpacingFactor(float factor) {
 	m_style.lineSpacingFactors.front() = factor;
 	m_updateStartLine = 0;
-	m_shouldUpdateVertices = true;
+	requestLayout();
 }
 
 void RichText::setLineSpacingFactor(int ID, float factor) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		if (it->second->getType() == Stylizer::LineSpacing) {
-			static_cast<StarterStylizer<float>*>(it->second)->setValue(factor);
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
-		}
-	}
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::LineSpacing, false, true, 0, sf::Color(), factor }))
+		requestLayout();
 }
 
 void RichText::setLineSpacingFactor(int ID, bool activated) {
-	for (auto it = m_modifiableStylizers.find(ID); it != m_modifiableStylizers.end() && it->first == ID; it++) {
-		if (it->second->getType() == Stylizer::LineSpacing) {
-			static_cast<StarterStylizer<float>*>(it->second)->activated = activated;
-			m_updateStartLine = std::min(m_updateStartLine, it->second->line);
-			m_shouldUpdateVertices = true;
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::LineSpacing, true, activated, 0, sf::Color(), 0.f }))
+		requestLayout();
+}
+
+void RichText::setCharacterSize(int ID, uint size) {
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::CharacterSize, false, true, 0, sf::Color(), static_cast<float>(size) }))
+		requestLayout();
+}
+
+void RichText::setCharacterSize(int ID, bool activated) {
+	if (applyChange(editDocument(), Batch::Change { ID, Stylizer::CharacterSize, true, activated, 0, sf::Color(), 0.f }))
+		requestLayout();
+}
+
+bool RichText::applyChange(Document& document, Batch::Change const& change) {
+	auto found = document.modifiableStylizers.find(change.ID);
+	if (found == document.modifiableStylizers.end())
+		return false;
+
+	bool changed = false;
+	for (Stylizer* stylizer : found->second) {
+		Stylizer::StyleProperty type = stylizer->getType();
+		sf::Uint32 flag = 0;
+		switch (type) {
+		case Stylizer::Bold: flag = sf::Text::Bold; break;
+		case Stylizer::Italic: flag = sf::Text::Italic; break;
+		case Stylizer::Underlined: flag = sf::Text::Underlined; break;
+		case Stylizer::StrikeThrough: flag = sf::Text::StrikeThrough; break;
+		default: break;
+		}
+		if (change.property == Stylizer::None ? flag == 0 || (change.setsActivation && !(change.style & flag)) : type != change.property)
+			continue;
+
+		switch (type) {
+		case Stylizer::Bold:
+		case Stylizer::Italic:
+		case Stylizer::Underlined:
+		case Stylizer::StrikeThrough:
+			if (change.setsActivation)
+				static_cast<StarterStylizer<bool>*>(stylizer)->activated = change.activated;
+			else
+				static_cast<StarterStylizer<bool>*>(stylizer)->setValue(change.style & flag);
+			break;
+		case Stylizer::FillColor:
+		case Stylizer::OutlineColor:
+			if (change.setsActivation)
+				static_cast<StarterStylizer<sf::Color>*>(stylizer)->activated = change.activated;
+			else
+				static_cast<StarterStylizer<sf::Color>*>(stylizer)->setValue(change.color);
+			break;
+		default:
+			if (change.setsActivation)
+				static_cast<StarterStylizer<float>*>(stylizer)->activated = change.activated;
+			else
+				static_cast<StarterStylizer<float>*>(stylizer)->setValue(change.number);
+			break;
 		}
+
+		//Colours don't move anything, so their glyphs can be recolored where they are
+		if (type == Stylizer::FillColor || type == Stylizer::OutlineColor)
+			m_recolorStartLine = std::min(m_recolorStartLine, getStylizerLine(stylizer));
+		else
+			m_updateStartLine = std::min(m_updateStartLine, getStylizerLine(stylizer));
+		changed = true;
+	}
+	return changed;
+}
+
+void RichText::apply(Batch const& batch) {
+	if (batch.m_changes.empty())
+		return;
+	Document& document = editDocument();
+	bool changed = false;
+	for (Batch::Change const& change : batch.m_changes)
+		changed |= applyChange(document, change);
+	if (changed)
+		requestLayout();
+}
+
+struct IDNames {
+	static IDNames& instance() {
+		static IDNames names;
+		return names;
 	}
+	std::mutex mutex;
+	std::unordered_map<std::string, int> IDs;
+	std::vector<std::string> names; //By ID, from the lowest
+};
+
+int RichText::getID(std::string const& name) {
+	IDNames& names = IDNames::instance();
+	std::lock_guard<std::mutex> lock(names.mutex);
+	auto found = names.IDs.find(name);
+	if (found != names.IDs.end())
+		return found->second;
+	int ID = std::numeric_limits<int>::min() + static_cast<int>(names.names.size());
+	names.IDs.emplace(name, ID);
+	names.names.push_back(name);
+	return ID;
+}
+
+bool RichText::findIDName(int ID, std::string& name) {
+	IDNames& names = IDNames::instance();
+	std::lock_guard<std::mutex> lock(names.mutex);
+	size_t index = static_cast<size_t>(static_cast<sf::Int64>(ID) - std::numeric_limits<int>::min());
+	if (index >= names.names.size())
+		return false;
+	name = names.names[index];
+	return true;
 }
 
+void RichText::Batch::setStyle(int ID, sf::Uint32 style) { m_changes.push_back(Change { ID, Stylizer::None, false, true, style, sf::Color(), 0.f }); }
+void RichText::Batch::setStyle(int ID, sf::Uint32 style, bool activated) { m_changes.push_back(Change { ID, Stylizer::None, true, activated, style, sf::Color(), 0.f }); }
+void RichText::Batch::setFillColor(int ID, sf::Color color) { m_changes.push_back(Change { ID, Stylizer::FillColor, false, true, 0, color, 0.f }); }
+void RichText::Batch::setFillColor(int ID, bool activated) { m_changes.push_back(Change { ID, Stylizer::FillColor, true, activated, 0, sf::Color(), 0.f }); }
+void RichText::Batch::setOutlineThickness(int ID, float thickness) { m_changes.push_back(Change { ID, Stylizer::OutlineThickness, false, true, 0, sf::Color(), thickness }); }
+void RichText::Batch::setOutlineThickness(int ID, bool activated) { m_changes.push_back(Change { ID, Stylizer::OutlineThickness, true, activated, 0, sf::Color(), 0.f }); }
+void RichText::Batch::setOutlineColor(int ID, sf::Color color) { m_changes.push_back(Change { ID, Stylizer::OutlineColor, false, true, 0, color, 0.f }); }
+void RichText::Batch::setOutlineColor(int ID, bool activated) { m_changes.push_back(Change { ID, Stylizer::OutlineColor, true, activated, 0, sf::Color(), 0.f }); }
+void RichText::Batch::setLetterSpacingFactor(int ID, float factor) { m_changes.push_back(Change { ID, Stylizer::LetterSpacing, false, true, 0, sf::Color(), factor }); }
+void RichText::Batch::setLetterSpacingFactor(int ID, bool activated) { m_changes.push_back(Change { ID, Stylizer::LetterSpacing, true, activated, 0, sf::Color(), 0.f }); }
+void RichText::Batch::setLineSpacingFactor(int ID, float factor) { m_changes.push_back(Change { ID, Stylizer::LineSpacing, false, true, 0, sf::Color(), factor }); }
+void RichText::Batch::setLineSpacingFactor(int ID, bool activated) { m_changes.push_back(Change { ID, Stylizer::LineSpacing, true, activated, 0, sf::Color(), 0.f }); }
+void RichText::Batch::setCharacterSize(int ID, uint size) { m_changes.push_back(Change { ID, Stylizer::CharacterSize, false, true, 0, sf::Color(), static_cast<float>(size) }); }
+void RichText::Batch::setCharacterSize(int ID, bool activated) { m_changes.push_back(Change { ID, Stylizer::CharacterSize, true, activated, 0, sf::Color(), 0.f }); }
+void RichText::Batch::clear() { m_changes.clear(); }
+bool RichText::Batch::isEmpty() const { return m_changes.empty(); }
+
 uint RichText::getCharacterSize() const { return m_characterSize; }
+GlyphAtlas* RichText::getGlyphAtlas() const { return m_atlas; }
+std::vector<sf::Font const*> const& RichText::getFallbackFonts() const { return m_fallbackFonts; }
+RichTextLayout::MetricsProvider const* RichText::getMetricsProvider() const { return m_metrics; }
 sf::Uint32 RichText::getStyle() const {
 	return (m_style.bolds.front() ? sf::Text::Bold : 0)
 			+ (m_style.italics.front() ? sf::Text::Italic : 0)
@@ -467,22 +910,43 @@ float RichText::getLineSpacingFactor() const { return m_style.lineSpacingFactors
 
 void RichText::setHorizontalLimit(float limit) {
 	m_horizontalLimit = limit;
-	m_shouldUpdateVertices = true;
+	requestLayout();
 	m_updateStartLine = 0;
 }
 
 float RichText::getHorizontalLimit() const { return m_horizontalLimit; }
 
+void RichText::setAlignment(RichTextLayout::Alignment alignment) {
+	if (m_alignment == alignment)
+		return;
+	m_alignment = alignment;
+	m_realignLines = true;
+	requestLayout();
+}
+
+RichTextLayout::Alignment RichText::getAlignment() const { return m_alignment; }
+
+void RichText::setTabularDigits(bool tabular) {
+	if (m_tabularDigits == tabular)
+		return;
+	m_tabularDigits = tabular;
+	requestLayout();
+	m_updateStartLine = 0;
+}
+
+bool RichText::getTabularDigits() const { return m_tabularDigits; }
+
 void RichText::setCharacterLimit(size_t limit) {
 	if (m_characterLimit == limit)
 		return;
 
-	if (!(m_characterLimit >= m_totalDisplayableCharacters && limit >= m_totalDisplayableCharacters)) {
+	if (!(m_characterLimit >= m_document->totalDisplayableCharacters && limit >= m_document->totalDisplayableCharacters)) {
 		size_t startLine = 0;
-		while (startLine < m_lineStart_i.size() && m_lineStart_char[startLine] / 6 < limit)
+		std::vector<RichTextLayout::Line> const& lines = getLaidOutGeometry().layout.lines;
+		while (startLine < lines.size() && lines[startLine].firstGlyph < limit)
 			startLine++;
 
-		m_shouldUpdateVertices = true;
+		requestLayout();
 		m_updateStartLine = std::min(m_updateStartLine, (startLine == 0) ? 0 : startLine-1);
 	}
 
@@ -491,161 +955,562 @@ void RichText::setCharacterLimit(size_t limit) {
 
 size_t RichText::getCharacterLimit() const { return m_characterLimit; }
 
-size_t RichText::getMaxEffectiveCharacterLimit() const { return m_totalDisplayableCharacters; }
+size_t RichText::getMaxEffectiveCharacterLimit() const { return m_document->totalDisplayableCharacters; }
 
-sf::FloatRect RichText::findCharacterBounds(size_t index) const {
-	if (!m_font || m_string.getSize() == 0 || index >= m_string.getSize())
-		return sf::FloatRect();
+void RichText::setMaxLines(size_t lines, sf::String const& ellipsis) {
+	lines = std::max<size_t>(lines, 1);
+	if (m_maxLines == lines && m_ellipsis == ellipsis)
+		return;
 
-	float whitespaceWidth = m_font->getGlyph(L' ', m_characterSize, false).advance;
-	float letterSpacing = (whitespaceWidth / 3.f) * (m_style.letterSpacingFactors.front() - 1.f);
-	float lineSpacing = m_font->getLineSpacing(m_characterSize) * m_style.lineSpacingFactors.front();
+	//Lines before the last one both limits show are the same with either
+	size_t shownLines = std::min(m_maxLines, lines);
+	requestLayout();
+	m_updateStartLine = std::min(m_updateStartLine, shownLines-1);
 
-	sf::Vector2f pos(0, lineSpacing - m_characterSize);
-	bool inWord = false;
-	float currentLineWidth = 0;
-	bool intentionalLineBreak = true;
-	float whiteSpaceWidthAtWordStart = 0;
+	m_maxLines = lines;
+	m_ellipsis = ellipsis;
+}
 
-	bool passedTarget = false;
-	bool shouldStop = false;
-	float extraWidth = 0;
+size_t RichText::getMaxLines() const { return m_maxLines; }
+sf::String const& RichText::getEllipsis() const { return m_ellipsis; }
 
-	float characterWidth = 0;
+bool RichText::isTruncated() const {
+	return getLayout().firstHiddenCharacter != std::numeric_limits<size_t>::max();
+}
 
-	auto it = m_stylizers.begin();
-	sf::Uint32 previousChar = 0;
-	size_t i = 0;
-	while (i < m_string.getSize() && !shouldStop) {
-		if (i >= index)
-			passedTarget = true;
+void RichText::setLogCapacity(size_t lines) {
+	m_logCapacity = std::max<size_t>(lines, 1);
+	if (dropLogLines())
+		requestLayout();
+}
 
-		while (it != m_stylizers.end() && it->first <= i) {
-			switch (it->second->stylize(m_style)) {
-			case Stylizer::LetterSpacing:
-				whitespaceWidth = m_font->getGlyph(L' ', m_characterSize, false).advance;
-				letterSpacing = (whitespaceWidth / 3.f) * (m_style.letterSpacingFactors.back() - 1.f);
-				whitespaceWidth += letterSpacing;
-				break;
-			case Stylizer::LineSpacing:
-				lineSpacing = m_font->getLineSpacing(m_characterSize) * m_style.lineSpacingFactors.back();
-				break;
-			default:
-				break;
-			}
-			it++;
-		}
+size_t RichText::getLogCapacity() const { return m_logCapacity; }
 
-		switch (m_string[i]) {
-		case ' ':
-			if (i == index)
-				characterWidth = whitespaceWidth;
-			if (passedTarget) {
-				shouldStop = true;
-				break;
-			}
-			if (inWord) {
-				inWord = false;
-				whiteSpaceWidthAtWordStart = 0;
-				currentLineWidth = pos.x;
-				intentionalLineBreak = false;
-			}
+bool RichText::isStarter(Stylizer const* stylizer) {
+	return dynamic_cast<StarterStylizer<bool> const*>(stylizer) || dynamic_cast<StarterStylizer<sf::Color> const*>(stylizer)
+		|| dynamic_cast<StarterStylizer<float> const*>(stylizer);
+}
 
-			pos.x += whitespaceWidth;
-			if (intentionalLineBreak) {
-				currentLineWidth = pos.x;
-			}
-			else {
-				whiteSpaceWidthAtWordStart += whitespaceWidth;
-			}
-			break;
-		case '\n':
-			if (i == index)
-				characterWidth = whitespaceWidth;
-			if (passedTarget) {
-				shouldStop = true;
-				break;
-			}
-			inWord = false;
-			whiteSpaceWidthAtWordStart = 0;
-			pos.x = 0;
-			pos.y += lineSpacing;
-			currentLineWidth = pos.x;
-			intentionalLineBreak = true;
-			break;
-		case '\t': {
-			float added = whitespaceWidth*8;
-			added -= fmodf(pos.x + added, whitespaceWidth*8);
-			if (i == index)
-				characterWidth = added;
-			if (passedTarget) {
-				shouldStop = true;
-				break;
-			}
-			if (inWord) {
-				inWord = false;
-				whiteSpaceWidthAtWordStart = 0;
-				currentLineWidth = pos.x;
-				intentionalLineBreak = false;
-			}
+bool RichText::dropLogLines() {
+	size_t lines = m_document->lineBreaks + 1;
+	if (m_logCapacity == std::numeric_limits<size_t>::max() || lines <= m_logCapacity || lines - m_logCapacity <= m_logCapacity / 8)
+		return false;
+	//A stopped layout keeps character positions in its state, so lines are dropped once it is complete
+	if (m_layoutInProgress)
+		return false;
+	RICHTEXT_TRACE_SCOPE(trace, "drop log lines", 0, m_document->string.getSize());
+
+	size_t dropped = lines - m_logCapacity;
+	size_t cut = 0;
+	size_t displayable = 0;
+	for (size_t breaks = 0; breaks < dropped; cut++) {
+		sf::Uint32 c = m_document->string[cut];
+		if (c == '\n')
+			breaks++;
+		else if (c != ' ' && c != '\t')
+			displayable++;
+	}
 
-			pos.x += added;
-			if (intentionalLineBreak) {
-				currentLineWidth = pos.x;
+	Document& document = editDocument();
+	document.string.erase(0, cut);
+	document.totalDisplayableCharacters -= displayable;
+	document.lineBreaks -= dropped;
+
+	//Stylizers before the cut go, but for the starters still open there, which move to its start
+	std::vector<Stylizer*> open[Stylizer::Pulse + 1];
+	std::unordered_set<Stylizer const*> erased;
+	for (auto it = document.stylizers.begin(); it != document.stylizers.end() && it->first < cut; it++) {
+		std::vector<Stylizer*>& stack = open[it->second->getType()];
+		if (isStarter(it->second))
+			stack.push_back(it->second);
+		else {
+			if (!stack.empty()) {
+				erased.insert(stack.back());
+				stack.pop_back();
 			}
-			else {
-				whiteSpaceWidthAtWordStart += added;
-			}
-			break;
+			erased.insert(it->second);
 		}
-		default:
-			float added = m_font->getKerning(previousChar, m_string[i], m_characterSize) + m_font->getGlyph(m_string[i], m_characterSize, m_style.bolds.back()).advance + letterSpacing;
-			pos.x += added;
-			if (i == index)
-				characterWidth = added;
-			if (passedTarget)
-				extraWidth += added;
-
-			if (currentLineWidth > 0 && pos.x > m_horizontalLimit) {
-				pos.x -= currentLineWidth + whiteSpaceWidthAtWordStart;
-				pos.y += lineSpacing;
-				currentLineWidth = 0;
-			}
-			break;
+	}
+	for (auto it = document.modifiableStylizers.begin(); it != document.modifiableStylizers.end();) {
+		std::vector<Stylizer*>& modifiable = it->second;
+		modifiable.erase(std::remove_if(modifiable.begin(), modifiable.end(), [&](Stylizer* stylizer) { return erased.count(stylizer) > 0; }), modifiable.end());
+		it = modifiable.empty() ? document.modifiableStylizers.erase(it) : std::next(it);
+	}
+	RichTextLayout::Stylizers stylizers;
+	std::vector<size_t> keptIndices; //Former index of every stylizer kept
+	for (auto it = document.stylizers.begin(); it != document.stylizers.end(); it++) {
+		if (erased.count(it->second)) {
+			delete it->second;
+			continue;
 		}
-
-		previousChar = m_string[i];
-		i++;
+		keptIndices.push_back(it->second->index);
+		it->second->index = stylizers.size();
+		stylizers.emplace_hint(stylizers.end(), it->first < cut ? 0 : it->first - cut, it->second);
 	}
-
-	m_style.rewind();
-	return sf::FloatRect(pos.x - extraWidth, pos.y, characterWidth, lineSpacing);
+	document.stylizers.swap(stylizers);
+
+	//Variables the cut goes through stay as plain text
+	std::vector<Document::Variable> variables;
+	for (Document::Variable variable : document.variables) {
+		if (variable.start < cut)
+			continue;
+		variable.start -= cut;
+		variable.firstStylizer = std::lower_bound(keptIndices.begin(), keptIndices.end(), variable.firstStylizer) - keptIndices.begin();
+		variables.push_back(variable);
+	}
+	document.variables.swap(variables);
+
+	//The lines kept move up by whole pixels, so that their vertices stay rounded, to where they would be laid out from the top
+	std::shared_ptr<Geometry> published = std::atomic_load(&m_preparedGeometry);
+	RichTextLayout::Result const& layout = published ? published->layout : m_geometry->layout;
+	auto before = [](RichTextLayout::Line const& line, size_t character) { return line.firstCharacter < character; };
+	size_t endLine = std::lower_bound(layout.lines.begin(), layout.lines.end(), cut, before) - layout.lines.begin();
+	if (endLine == layout.lines.size() || layout.lines[endLine].firstCharacter != cut || layout.firstHiddenCharacter != std::numeric_limits<size_t>::max()
+			|| m_characterLimit != std::numeric_limits<size_t>::max()) {
+		m_updateStartLine = 0; //The lines dropped weren't all laid out
+		return true;
+	}
+	RichTextLayout::Line const& first = layout.lines.front();
+	RichTextLayout::Line const& end = layout.lines[endLine];
+	float lift = std::round((end.verticalPosition - end.sizeShift) - (first.verticalPosition - first.sizeShift));
+
+	//Stylizers sighted are the first ones, and the ones kept keep their order
+	auto rebaseStylizerLines = [&](std::vector<size_t>& stylizerLines) {
+		std::vector<size_t> rebased;
+		for (size_t index : keptIndices) {
+			if (index >= stylizerLines.size())
+				break;
+			rebased.push_back(stylizerLines[index]);
+		}
+		stylizerLines.swap(rebased);
+	};
+	if (published) { //Published geometry is never modified: the render thread builds the vertices of the lines kept again
+		std::shared_ptr<Geometry> back = std::make_shared<Geometry>();
+		back->layout = published->layout;
+		back->layout.eraseFront(endLine, lift);
+		rebaseStylizerLines(back->layout.stylizerLines);
+#ifdef RICHTEXT_PERFORMANCE_COUNTERS
+		back->preparedCounters = published->preparedCounters;
+#endif
+		std::atomic_store(&m_preparedGeometry, back);
+	}
+	else {
+		if (m_geometry.use_count() > 1)
+			m_geometry = std::make_shared<Geometry>(*m_geometry);
+		m_geometry->eraseFront(endLine, lift);
+		rebaseStylizerLines(m_geometry->layout.stylizerLines);
+		m_geometryVersion++;
+	}
+	if (m_updateStartLine != std::numeric_limits<size_t>::max())
+		m_updateStartLine = m_updateStartLine > endLine ? m_updateStartLine - endLine : 0;
+	if (m_recolorStartLine != std::numeric_limits<size_t>::max())
+		m_recolorStartLine = m_recolorStartLine > endLine ? m_recolorStartLine - endLine : 0;
+	//Lines aligned to the widest one move if it was dropped
+	if (m_alignment != RichTextLayout::Left && !(m_horizontalLimit < std::numeric_limits<float>::infinity()))
+		m_realignLines = true;
+	return true;
 }
 
-sf::FloatRect RichText::getLocalBounds() const {
-	updateVertices();
-	return m_bounds;
-}
+void RichText::setAnimationParameters(AnimationParameters const& parameters) { m_animationParameters = parameters; }
+RichText::AnimationParameters const& RichText::getAnimationParameters() const { return m_animationParameters; }
+bool RichText::isAnimated() const { return m_document->hasAnimationTags; }
 
-sf::FloatRect RichText::getGlobalBounds() const {
-	return getTransform().transformRect(getLocalBounds());
+sf::Uint32 hashGlyphTick(sf::Uint32 glyph, sf::Uint32 tick) {
+	sf::Uint32 h = glyph * 0x9E3779B1u ^ tick * 0x85EBCA77u;
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+	return h;
 }
 
-void RichText::initializeLineStarts() {
-	if (!m_font)
+void RichText::animate(float time) {
+	RICHTEXT_TIME_PHASE(animateNanoseconds);
+	updateVertices();
+	if (m_geometry->animatedRuns.empty())
+		return;
+	if (m_geometry.use_count() > 1)
+		m_geometry = std::make_shared<Geometry>(*m_geometry);
+	Geometry& geometry = *m_geometry;
+	AnimationParameters const& p = m_animationParameters;
+	m_geometryVersion++;
+
+	//The wave of glyph g is sin(wavePhase - g * waveSpacing): expanded, it only takes the cosine and sine of g * waveSpacing, which are
+	//tabled once per spacing
+	float wavePhase = time * p.waveSpeed;
+	float waveSin = p.waveAmplitude * std::sin(wavePhase);
+	float waveCos = p.waveAmplitude * std::cos(wavePhase);
+	size_t glyphEnd = 0;
+	for (Geometry::AnimatedRun const& run : geometry.animatedRuns)
+		glyphEnd = std::max(glyphEnd, run.charStart / 6 + run.glyphCount);
+	size_t tabled = m_waveSpacing == p.waveSpacing ? m_waveCosines.size() : 0;
+	if (tabled < glyphEnd) {
+		m_waveCosines.resize(glyphEnd);
+		m_waveSines.resize(glyphEnd);
+		for (size_t g = tabled; g < glyphEnd; g++) {
+			m_waveCosines[g] = std::cos(static_cast<float>(g) * p.waveSpacing);
+			m_waveSines[g] = std::sin(static_cast<float>(g) * p.waveSpacing);
+		}
+		m_waveSpacing = p.waveSpacing;
+	}
+	sf::Uint32 shakeTick = static_cast<sf::Uint32>(std::floor(time * p.shakeRate));
+	float pulseAlpha = 1.f - p.pulseDepth * (0.5f + 0.5f * std::sin(time * p.pulseSpeed));
+
+	for (Geometry::AnimatedRun const& run : geometry.animatedRuns) {
+		//Offsets are computed per glyph in flat arrays first, by loops of plain arithmetic; they're then spread over the vertices
+		size_t n = run.glyphCount;
+		size_t firstGlyph = run.charStart / 6;
+		m_animationOffsets.assign(n * 2, 0.f);
+		float* dx = m_animationOffsets.data();
+		float* dy = dx + n;
+
+		if (run.effects & RichTextLayout::StyleRun::Wave) {
+			float const* cosines = m_waveCosines.data() + firstGlyph;
+			float const* sines = m_waveSines.data() + firstGlyph;
+			for (size_t k = 0; k < n; k++)
+				dy[k] += waveSin * cosines[k] - waveCos * sines[k];
+		}
+		if (run.effects & RichTextLayout::StyleRun::Shake) {
+			for (size_t k = 0; k < n; k++) {
+				sf::Uint32 h = hashGlyphTick(static_cast<sf::Uint32>(firstGlyph + k), shakeTick);
+				dx[k] += p.shakeAmplitude * ((h & 0xFFFF) / 32767.5f - 1.f);
+				dy[k] += p.shakeAmplitude * ((h >> 16) / 32767.5f - 1.f);
+			}
+		}
+
+		//The base holds 6 char vertices per glyph, followed by its 6 outline vertices if any
+		size_t stride = run.hasOutline ? 12 : 6;
+		bool pulse = run.effects & RichTextLayout::StyleRun::Pulse;
+		for (size_t copy = 0; copy < stride / 6; copy++) {
+			sf::Vertex* vertices = copy == 0 ? &geometry.charVertices[run.charStart] : &geometry.charOutlineVertices[run.outlineStart];
+			sf::Vector2f const* basePositions = geometry.animationBasePositions.data() + run.baseStart + copy*6;
+			for (size_t k = 0; k < n; k++) {
+				sf::Vector2f offset(dx[k], dy[k]);
+				for (size_t j = 0; j < 6; j++)
+					vertices[k*6 + j].position = basePositions[k*stride + j] + offset;
+			}
+			if (pulse) {
+				sf::Color const* baseColors = geometry.animationBaseColors.data() + run.baseStart + copy*6;
+				for (size_t k = 0; k < n; k++) {
+					for (size_t j = 0; j < 6; j++) {
+						sf::Color color = baseColors[k*stride + j];
+						color.a = static_cast<sf::Uint8>(color.a * pulseAlpha);
+						vertices[k*6 + j].color = color;
+					}
+				}
+			}
+		}
+	}
+}
+
+sf::FloatRect RichText::getLocalBounds() const {
+	std::shared_ptr<Geometry> prepared = std::atomic_load(&m_preparedGeometry);
+	if (prepared)
+		return prepared->layout.bounds;
+	updateVertices();
+	return m_geometry->layout.bounds;
+}
+
+sf::FloatRect RichText::getGlobalBounds() const {
+	return getTransform().transformRect(getLocalBounds());
+}
+
+size_t RichText::getColdGlyphMisses() const { return m_coldGlyphMisses; }
+
+//FNV-1a, fed with the raw bytes of the hashed values
+void hashBytes(sf::Uint64& hash, void const* data, size_t size) {
+	unsigned char const* bytes = static_cast<unsigned char const*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+}
+
+template<class T>
+void hashValue(sf::Uint64& hash, T const& value) {
+	hashBytes(hash, &value, sizeof(T));
+}
+
+template<>
+void hashValue<bool>(sf::Uint64& hash, bool const& value) {
+	hashValue<unsigned char>(hash, value ? 1 : 0);
+}
+
+template<>
+void hashValue<sf::Color>(sf::Uint64& hash, sf::Color const& value) {
+	sf::Uint8 const bytes[4] { value.r, value.g, value.b, value.a };
+	hashBytes(hash, bytes, 4);
+}
+
+//Remembers which glyphs were already requested from a font, so that layouts can tell when sf::Font had to rasterize one. Every font has its own
+//registry and lock, which only threads using the same font contend for; finding the registry of a font takes a global lock, when an instance changes fonts
+class RichText::GlyphRegistry {
+public:
+	static std::shared_ptr<GlyphRegistry> of(sf::Font const& font) {
+		static std::mutex mutex;
+		static std::unordered_map<sf::Font const*, std::shared_ptr<GlyphRegistry>> registries;
+		std::lock_guard<std::mutex> lock(mutex);
+		std::shared_ptr<GlyphRegistry>& registry = registries[&font];
+		if (!registry || registry->m_family != font.getInfo().family) //Another font at the address of a released one
+			registry = std::make_shared<GlyphRegistry>(font.getInfo().family);
+		return registry;
+	}
+
+	explicit GlyphRegistry(std::string const& family) : m_family(family) {}
+
+	bool markWarm(sf::Uint32 codePoint, uint characterSize, bool bold, float outlineThickness) { //Returns true if the glyph was cold
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_warmGlyphs.size() >= capacity)
+			m_warmGlyphs.clear(); //Forgotten glyphs are reported cold once more
+		return m_warmGlyphs.insert(GlyphKey { codePoint, characterSize, bold, outlineThickness }).second;
+	}
+
+private:
+	static constexpr size_t capacity = 1 << 16;
+
+	struct GlyphKey {
+		sf::Uint32 codePoint;
+		uint characterSize;
+		bool bold;
+		float outlineThickness;
+		bool operator==(GlyphKey const& other) const {
+			return codePoint == other.codePoint && characterSize == other.characterSize && bold == other.bold && outlineThickness == other.outlineThickness;
+		}
+	};
+
+	struct GlyphKeyHasher {
+		size_t operator()(GlyphKey const& key) const {
+			sf::Uint64 hash = 14695981039346656037ull;
+			hashValue(hash, key.codePoint);
+			hashValue(hash, key.characterSize);
+			hashValue(hash, key.bold);
+			hashValue(hash, key.outlineThickness);
+			return static_cast<size_t>(hash);
+		}
+	};
+
+	std::string m_family;
+	std::unordered_set<GlyphKey, GlyphKeyHasher> m_warmGlyphs;
+	std::mutex m_mutex;
+};
+
+void RichText::updateGlyphRegistries() {
+	m_glyphRegistries.clear();
+	if (!m_font)
+		return;
+	m_glyphRegistries.push_back(GlyphRegistry::of(*m_font));
+	for (sf::Font const* font : m_fallbackFonts)
+		m_glyphRegistries.push_back(GlyphRegistry::of(*font));
+}
+
+sf::Glyph const& RichText::getGlyph(sf::Uint32 codePoint, bool bold, float outlineThickness, unsigned int font, unsigned int characterSize) const {
+	if (characterSize == 0)
+		characterSize = m_characterSize;
+	if (m_atlas) {
+		unsigned int shelf;
+		bool cold;
+		sf::Glyph const& glyph = m_atlas->getGlyph(codePoint, characterSize, bold, outlineThickness, &shelf, &cold);
+		if (cold) {
+			m_coldGlyphMisses++;
+			RICHTEXT_COUNT(glyphCacheMisses, 1);
+		}
+		if (shelf != GlyphAtlas::NoShelf) {
+			if (shelf >= m_atlasShelves.size())
+				m_atlasShelves.resize(shelf+1, 0);
+			m_atlasShelves[shelf] = m_atlas->getShelfGeneration(shelf);
+		}
+		return glyph;
+	}
+
+	if (font > m_fallbackFonts.size())
+		font = 0;
+	if (font < m_glyphRegistries.size() && m_glyphRegistries[font]->markWarm(codePoint, characterSize, bold, outlineThickness)) {
+		m_coldGlyphMisses++;
+		RICHTEXT_COUNT(glyphCacheMisses, 1);
+	}
+	return getChainFont(font).getGlyph(codePoint, characterSize, bold, outlineThickness);
+}
+
+//Metrics of the font (or atlas) of an instance, through getGlyph() so that layouts keep track of cold glyphs and atlas shelves
+class RichText::InstanceMetrics : public RichTextLayout::MetricsProvider {
+public:
+	InstanceMetrics(RichText const& text) : m_text(text) {}
+
+	virtual sf::Glyph getGlyph(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness) const {
+		return m_text.getGlyph(codePoint, bold, outlineThickness, m_text.findFont(codePoint), characterSize);
+	}
+	virtual float getKerning(sf::Uint32 first, sf::Uint32 second, unsigned int characterSize) const {
+		unsigned int font = m_text.findFont(first);
+		return font == m_text.findFont(second) ? m_text.getChainFont(font).getKerning(first, second, characterSize) : 0.f;
+	}
+	virtual float getLineSpacing(unsigned int characterSize) const { return m_text.m_font->getLineSpacing(characterSize); }
+	virtual float getUnderlinePosition(unsigned int characterSize) const { return m_text.m_font->getUnderlinePosition(characterSize); }
+	virtual float getUnderlineThickness(unsigned int characterSize) const { return m_text.m_font->getUnderlineThickness(characterSize); }
+	virtual unsigned int getFont(sf::Uint32 codePoint) const { return m_text.findFont(codePoint); }
+
+private:
+	RichText const& m_text;
+};
+
+RichTextLayout::Settings RichText::getLayoutSettings(RichTextLayout::MetricsProvider const& instanceMetrics) const {
+	RichTextLayout::Settings settings;
+	settings.metrics = m_metrics ? m_metrics : &instanceMetrics;
+	settings.characterSize = m_characterSize;
+	settings.horizontalLimit = m_horizontalLimit;
+	settings.alignment = m_alignment;
+	settings.characterLimit = m_characterLimit;
+	settings.maxLines = m_maxLines;
+	settings.ellipsis = m_ellipsis;
+	settings.tabularDigits = m_tabularDigits;
+	settings.outlineThicknessStep = m_atlas ? m_atlas->getOutlineThicknessStep() : 0.f;
+	if (m_layoutLineBudget != 0)
+		settings.lineBudget = m_layoutLineBudget;
+	if (m_layoutTimeBudget > 0.f)
+		settings.timeBudget = m_layoutTimeBudget;
+	return settings;
+}
+
+sf::FloatRect RichText::findCharacterBounds(size_t index) const {
+	if ((!m_font && !m_metrics) || m_document->string.getSize() == 0 || index >= m_document->string.getSize())
+		return sf::FloatRect();
+	RICHTEXT_TIME_PHASE(characterBoundsNanoseconds);
+	RICHTEXT_TRACE_SCOPE(trace, "findCharacterBounds", 0, 0);
+
+	//A layout engine of its own, so that queries don't write to the instance and can run while it is prepared
+	//Aligned lines, the line limit and lines grown by size tags need the layout
+	RichTextLayout engine;
+	InstanceMetrics instanceMetrics(*this);
+	bool sized = std::any_of(m_document->stylizers.begin(), m_document->stylizers.end(),
+		[](RichTextLayout::Stylizers::value_type const& stylizer) { return stylizer.second->getType() == Stylizer::CharacterSize; });
+	RichTextLayout::Result const* layout = nullptr;
+	if (m_alignment != RichTextLayout::Left || m_maxLines != std::numeric_limits<size_t>::max() || sized) {
+		if (!isPrepared())
+			updateVertices();
+		layout = &getLaidOutGeometry().layout;
+	}
+	sf::FloatRect bounds = engine.findCharacterBounds(m_document->string, m_document->stylizers, m_style, getLayoutSettings(instanceMetrics), index, sized ? layout : nullptr);
+	if (layout) {
+		if (index >= layout->firstHiddenCharacter)
+			bounds = sf::FloatRect(); //Left out by the line limit
+		else
+			bounds.left += RichTextLayout::getAlignmentMovement(m_document->string, *layout, index);
+	}
+
+	RICHTEXT_COUNT(stylizersReplayed, engine.getStatistics().stylizersReplayed);
+	RICHTEXT_COUNT(characterBoundsScanned, engine.getStatistics().charactersScanned);
+	RICHTEXT_TRACE_ARGUMENT(trace, characters, engine.getStatistics().charactersScanned);
+	return bounds;
+}
+
+RichText::Measurement RichText::measure(float maxWidth) const {
+	if ((!m_font && !m_metrics) || m_document->string.getSize() == 0)
+		return Measurement();
+	for (auto const& remembered : m_measurements) {
+		if (remembered.first == maxWidth)
+			return remembered.second;
+	}
+	RICHTEXT_TIME_PHASE(measureNanoseconds);
+	RICHTEXT_COUNT(measures, 1);
+	RICHTEXT_TRACE_SCOPE(trace, "measure", 0, m_document->string.getSize());
+
+	//Laid out whole, whatever the layout budget, by an engine that doesn't write to the instance's layout
+	InstanceMetrics instanceMetrics(*this);
+	RichTextLayout::Settings settings = getLayoutSettings(instanceMetrics);
+	settings.horizontalLimit = maxWidth;
+	settings.lineBudget = std::numeric_limits<size_t>::max();
+	settings.timeBudget = std::numeric_limits<float>::infinity();
+	settings.keepGlyphs = false;
+	RichTextLayout::Result result;
+	m_measureLayout.layout(m_document->string, m_document->stylizers, m_style, settings, result);
+	RICHTEXT_COUNT(stylizersReplayed, m_measureLayout.getStatistics().stylizersReplayed);
+	RICHTEXT_TRACE_ARGUMENT(trace, characters, m_measureLayout.getStatistics().charactersScanned);
+
+	Measurement measurement;
+	sf::FloatRect const& bounds = result.bounds;
+	measurement.size = sf::Vector2f(bounds.width, bounds.height);
+	measurement.lineCount = result.lines.size();
+	measurement.baseline = result.lines.front().verticalPosition - bounds.top;
+
+	size_t const rememberedWidths = 4;
+	if (m_measurements.size() == rememberedWidths)
+		m_measurements.pop_back();
+	m_measurements.insert(m_measurements.begin(), std::make_pair(maxWidth, measurement));
+	return measurement;
+}
+
+RichTextLayout::Result const& RichText::getLayout() const {
+	std::shared_ptr<Geometry> prepared = std::atomic_load(&m_preparedGeometry);
+	if (prepared)
+		return prepared->layout; //Kept alive by m_preparedGeometry until the next prepare()
+	updateVertices();
+	return m_geometry->layout;
+}
+
+void RichText::prewarm(sf::Font const& font, sf::String const& charset, std::vector<uint> const& sizes, std::vector<sf::Uint32> const& styles, std::vector<float> const& outlineThicknesses) {
+	std::shared_ptr<GlyphRegistry> registry = GlyphRegistry::of(font);
+	for (uint size : sizes) {
+		font.getTexture(size);
+		for (sf::Uint32 style : styles) {
+			bool bold = style & sf::Text::Bold;
+			for (float thickness : outlineThicknesses) {
+				for (size_t i = 0; i < charset.getSize(); i++) {
+					registry->markWarm(charset[i], size, bold, thickness);
+					font.getGlyph(charset[i], size, bold, thickness);
+				}
+			}
+		}
+	}
+}
+
+void RichText::prewarm() const {
+	prewarm(0);
+}
+
+void RichText::prewarm(size_t from) const {
+	if (!m_font)
+		return;
+
+	//The glyphs every layout needs regardless of the content
+	getGlyph(L' ', false);
+	getGlyph(L'x', false);
+	if (m_maxLines != std::numeric_limits<size_t>::max()) {
+		for (size_t i = 0; i < m_ellipsis.getSize(); i++) {
+			getGlyph(m_ellipsis[i], false, 0.f, findFont(m_ellipsis[i]));
+			getGlyph(m_ellipsis[i], true, 0.f, findFont(m_ellipsis[i]));
+		}
+	}
+
+	VariableStyle style = m_style; //Not m_style itself, which a prepare() on another thread may be reading
+	auto it = m_document->stylizers.begin();
+	for (size_t i = 0; i < m_document->string.getSize(); i++) {
+		while (it != m_document->stylizers.end() && it->first <= i) {
+			it->second->stylize(style);
+			it++;
+		}
+		if (i < from || m_document->string[i] == ' ' || m_document->string[i] == '\t' || m_document->string[i] == '\n')
+			continue;
+
+		unsigned int font = findFont(m_document->string[i]);
+		unsigned int size = style.getCharacterSize(m_characterSize);
+		getGlyph(m_document->string[i], style.bolds.back(), 0.f, font, size);
+		if (style.outlineThicknesses.back() != 0.f)
+			getGlyph(m_document->string[i], style.bolds.back(), style.outlineThicknesses.back(), font, size);
+	}
+}
+
+void RichText::setPrewarmOnParse(bool prewarmOnParse) { m_prewarmOnParse = prewarmOnParse; }
+bool RichText::getPrewarmOnParse() const { return m_prewarmOnParse; }
+
+void RichText::initializeLineStarts() {
+	if (isPrepared()) { //Keep drawing the published layout, with vertices rebuilt from the current settings
+		m_adoptedGeometry.reset();
 		return;
-	m_lineStart_i.clear();
-	m_lineStart_i.push_back(0);
-	m_lineStart_verticalPos.clear();
-	m_lineStart_verticalPos.push_back(m_font->getLineSpacing(m_characterSize) * m_style.lineSpacingFactors.front());
-	m_lineStart_char.clear();
-	m_lineStart_char.push_back(0);
-	m_lineStart_charOutline.clear();
-	m_lineStart_charOutline.emplace(0, 0);
-	m_lineStart_line.clear();
-	m_lineStart_line.emplace(0, 0);
-	m_lineStart_lineOutline.clear();
-	m_lineStart_lineOutline.emplace(0, 0);
+	}
+	m_geometry = std::make_shared<Geometry>(); //Never edit in place: the previous geometry may be shared; the first layout adds the first line
+}
+
+RichText::Geometry const& RichText::getLaidOutGeometry() const {
+	std::shared_ptr<Geometry> prepared = std::atomic_load(&m_preparedGeometry);
+	return prepared ? *prepared : *m_geometry; //Kept alive by m_preparedGeometry until the next prepare()
 }
 
 void addGlyphQuad(sf::VertexArray& vertices, sf::Vector2f position, sf::Color const& color, sf::Glyph const& glyph, float italicShear, float outlineThickness = 0) {
@@ -672,581 +1537,1553 @@ void addGlyphQuad(sf::VertexArray& vertices, sf::Vector2f position, sf::Color co
 	vertices.append(sf::Vertex(sf::Vector2f(position.x + right - italicShear * bottom - outlineThickness, position.y + bottom - outlineThickness), color, sf::Vector2f(u2, v2)));
 }
 
-void addLine(sf::VertexArray& vertices, sf::Vector2f origin, float lineLength, const sf::Color& color, float thickness, float outlineThickness = 0)
-{
-	float top = std::floor(origin.y - (thickness / 2) + 0.5f);
-	float bottom = top + std::floor(thickness + 0.5f);
+void addDecorationQuad(sf::VertexArray& vertices, RichTextLayout::Decoration const& decoration) {
+	sf::Vertex bottomLeft(sf::Vector2f(decoration.left, decoration.bottom), decoration.color, sf::Vector2f(1, 1));
+	sf::Vertex topRight(sf::Vector2f(decoration.right, decoration.top), decoration.color, sf::Vector2f(1, 1));
 
-	sf::Vertex bottomLeft(sf::Vector2f(origin.x - outlineThickness, bottom + outlineThickness), color, sf::Vector2f(1, 1));
-	sf::Vertex topRight(sf::Vector2f(origin.x + lineLength + outlineThickness, top - outlineThickness), color, sf::Vector2f(1, 1));
-
-	vertices.append(sf::Vertex(sf::Vector2f(origin.x - outlineThickness, top - outlineThickness), color, sf::Vector2f(1, 1)));
+	vertices.append(sf::Vertex(sf::Vector2f(decoration.left, decoration.top), decoration.color, sf::Vector2f(1, 1)));
 	vertices.append(topRight);
 	vertices.append(bottomLeft);
 	vertices.append(bottomLeft);
 	vertices.append(topRight);
-	vertices.append(sf::Vertex(sf::Vector2f(origin.x + lineLength + outlineThickness, bottom + outlineThickness), color, sf::Vector2f(1, 1)));
+	vertices.append(sf::Vertex(sf::Vector2f(decoration.right, decoration.bottom), decoration.color, sf::Vector2f(1, 1)));
 }
 
-void resizeLineStartMap(std::map<size_t, size_t>& map, size_t const& firstLineToErase) {
-	auto it = map.begin();
-	while (it != map.end() && it->first < firstLineToErase) {
-		it++;
+void roundNewVertices(sf::VertexArray& va, size_t newVerticesStart, float shift = 0.f) { //Then moves them by the whole pixels of shift
+	size_t len = va.getVertexCount();
+	for (size_t i = newVerticesStart; i < len; i++) {
+		va[i].position.x = roundf(va[i].position.x) + shift;
+		va[i].position.y = roundf(va[i].position.y);
 	}
-	map.erase(it, map.end());
 }
 
-size_t const& getLastVerticesIndexBeforeLine(std::map<size_t, size_t> const& map, size_t const& startLine) {
-	auto it = map.lower_bound(startLine);
-	if (it == map.end()) {
-		return (--it)->second;
+RichText::Geometry::Geometry() :
+	charVertices(sf::Triangles),
+	charOutlineVertices(sf::Triangles),
+	lineVertices(sf::Triangles),
+	lineOutlineVertices(sf::Triangles)
+{
+}
+
+void copyVerticesBefore(sf::VertexArray const& source, sf::VertexArray& destination, size_t end) {
+	destination.resize(end);
+	for (size_t i = 0; i < end; i++)
+		destination[i] = source[i];
+}
+
+RichText::Geometry::Geometry(Geometry const& other, size_t startLine) :
+	layout(other.layout, startLine),
+	charVertices(sf::Triangles),
+	charOutlineVertices(sf::Triangles),
+	lineVertices(sf::Triangles),
+	lineOutlineVertices(sf::Triangles),
+	lineStart_charOutline(other.lineStart_charOutline.begin(), other.lineStart_charOutline.begin() + std::min(other.lineStart_charOutline.size(), startLine+1))
+{
+	//charVertices are empty in compact storage
+	copyVerticesBefore(other.charVertices, charVertices, std::min(other.charVertices.getVertexCount(), layout.glyphs.size() * 6));
+	copyVerticesBefore(other.charOutlineVertices, charOutlineVertices, std::min(other.charOutlineVertices.getVertexCount(), lineStart_charOutline.empty() ? 0 : lineStart_charOutline.back()));
+	copyVerticesBefore(other.lineVertices, lineVertices, std::min(other.lineVertices.getVertexCount(), layout.decorations.size() * 6));
+	copyVerticesBefore(other.lineOutlineVertices, lineOutlineVertices, std::min(other.lineOutlineVertices.getVertexCount(), layout.outlineDecorations.size() * 6));
+
+	animatedRuns = other.animatedRuns;
+	animationBasePositions = other.animationBasePositions;
+	animationBaseColors = other.animationBaseColors;
+	truncateAnimations(charVertices.getVertexCount());
+}
+
+void RichText::Geometry::truncate(size_t startLine) {
+	layout.truncate(startLine);
+	lineStart_charOutline.resize(std::min(lineStart_charOutline.size(), startLine+1));
+
+	charVertices.resize(std::min(charVertices.getVertexCount(), layout.glyphs.size() * 6));
+	charOutlineVertices.resize(std::min(charOutlineVertices.getVertexCount(), lineStart_charOutline.empty() ? 0 : lineStart_charOutline.back()));
+	lineVertices.resize(std::min(lineVertices.getVertexCount(), layout.decorations.size() * 6));
+	lineOutlineVertices.resize(std::min(lineOutlineVertices.getVertexCount(), layout.outlineDecorations.size() * 6));
+	truncateAnimations(charVertices.getVertexCount());
+}
+
+void RichText::Geometry::truncateAnimations(size_t charVerticesKept) {
+	while (!animatedRuns.empty() && animatedRuns.back().charStart >= charVerticesKept)
+		animatedRuns.pop_back();
+	size_t baseSize = 0;
+	if (!animatedRuns.empty()) {
+		AnimatedRun& run = animatedRuns.back();
+		run.glyphCount = std::min(run.glyphCount, (charVerticesKept - run.charStart) / 6);
+		baseSize = run.baseStart + run.glyphCount * (run.hasOutline ? 12 : 6);
 	}
-	return it->second;
+	animationBasePositions.resize(baseSize);
+	animationBaseColors.resize(baseSize);
 }
 
-void roundNewVertices(sf::VertexArray& va, size_t newVerticesStart) {
-	size_t len = va.getVertexCount();
-	for (size_t i = newVerticesStart; i < len; i++) {
-		va[i].position.x = roundf(va[i].position.x);
-		va[i].position.y = roundf(va[i].position.y);
+void eraseVerticesBefore(sf::VertexArray& vertices, size_t start, float lift) { //Moving the rest up by lift
+	size_t count = vertices.getVertexCount();
+	start = std::min(start, count);
+	for (size_t i = start; i < count; i++) {
+		vertices[i - start] = vertices[i];
+		vertices[i - start].position.y -= lift;
 	}
+	vertices.resize(count - start);
 }
 
-void RichText::updateVertices() const {
-	if (!m_font)
+void RichText::Geometry::eraseFront(size_t endLine, float lift) {
+	if (endLine == 0 || endLine >= layout.lines.size())
 		return;
+	RichTextLayout::Line const& end = layout.lines[endLine];
+	size_t charVerticesErased = std::min(charVertices.getVertexCount(), end.firstGlyph * 6);
+	size_t outlineVerticesErased = std::min(charOutlineVertices.getVertexCount(), endLine < lineStart_charOutline.size() ? lineStart_charOutline[endLine] : charOutlineVertices.getVertexCount());
+	eraseVerticesBefore(charVertices, charVerticesErased, lift);
+	eraseVerticesBefore(charOutlineVertices, outlineVerticesErased, lift);
+	eraseVerticesBefore(lineVertices, end.firstDecoration * 6, lift);
+	eraseVerticesBefore(lineOutlineVertices, end.firstOutlineDecoration * 6, lift);
+	lineStart_charOutline.erase(lineStart_charOutline.begin(), lineStart_charOutline.begin() + std::min(lineStart_charOutline.size(), endLine));
+	for (size_t& start : lineStart_charOutline)
+		start -= outlineVerticesErased;
+	layout.eraseFront(endLine, lift);
+
+	//Animated runs may go on from the lines erased, in which case they lose their first glyphs
+	size_t runsErased = 0;
+	size_t baseErased = 0;
+	for (AnimatedRun& run : animatedRuns) {
+		size_t baseStride = run.hasOutline ? 12 : 6;
+		size_t glyphsErased = run.charStart < charVerticesErased ? std::min(run.glyphCount, (charVerticesErased - run.charStart) / 6) : 0;
+		if (glyphsErased == run.glyphCount) {
+			runsErased++;
+			baseErased = run.baseStart + run.glyphCount * baseStride;
+			continue;
+		}
+		if (glyphsErased > 0)
+			baseErased = run.baseStart + glyphsErased * baseStride;
+		run.charStart = run.charStart + glyphsErased * 6 - charVerticesErased;
+		if (run.hasOutline)
+			run.outlineStart = run.outlineStart + glyphsErased * 6 - outlineVerticesErased;
+		else
+			run.outlineStart = run.outlineStart > outlineVerticesErased ? run.outlineStart - outlineVerticesErased : 0;
+		run.baseStart = run.baseStart + glyphsErased * baseStride - baseErased;
+		run.glyphCount -= glyphsErased;
+	}
+	animatedRuns.erase(animatedRuns.begin(), animatedRuns.begin() + runsErased);
+	animationBasePositions.erase(animationBasePositions.begin(), animationBasePositions.begin() + baseErased);
+	animationBaseColors.erase(animationBaseColors.begin(), animationBaseColors.begin() + baseErased);
+	for (sf::Vector2f& position : animationBasePositions)
+		position.y -= lift;
+}
 
-	if (!m_shouldUpdateVertices)
-		return;
+void RichText::Geometry::captureAnimationBase(size_t firstRun) {
+	for (size_t r = firstRun; r < animatedRuns.size(); r++) {
+		AnimatedRun const& run = animatedRuns[r];
+		for (size_t k = 0; k < run.glyphCount; k++) {
+			for (size_t j = 0; j < 6; j++) {
+				sf::Vertex const& v = charVertices[run.charStart + k*6 + j];
+				animationBasePositions.push_back(v.position);
+				animationBaseColors.push_back(v.color);
+			}
+			if (run.hasOutline) {
+				for (size_t j = 0; j < 6; j++) {
+					sf::Vertex const& v = charOutlineVertices[run.outlineStart + k*6 + j];
+					animationBasePositions.push_back(v.position);
+					animationBaseColors.push_back(v.color);
+				}
+			}
+		}
+	}
+}
 
-	//Updating from a certain line:
-	//Don't update if the starting line is after all explored lines
-	if (m_updateStartLine >= m_lineStart_i.size()) {
-		m_updateStartLine = std::numeric_limits<size_t>::max();
-		return;
+const size_t mapNodeSize = 4 * sizeof(void*) + 2 * sizeof(size_t); //Approximation of a std::map node
+
+size_t RichText::Geometry::getMemoryUsage() const {
+	return sizeof(Geometry) + layout.getMemoryUsage()
+		+ (charVertices.getVertexCount() + charOutlineVertices.getVertexCount() + lineVertices.getVertexCount() + lineOutlineVertices.getVertexCount()) * sizeof(sf::Vertex)
+		+ lineStart_charOutline.size() * sizeof(size_t)
+		+ animatedRuns.size() * sizeof(AnimatedRun) + animationBasePositions.size() * (sizeof(sf::Vector2f) + sizeof(sf::Color));
+}
+
+bool RichText::LayoutKey::operator==(LayoutKey const& other) const {
+	if (hash != other.hash || fonts != other.fonts || metrics != other.metrics || characterSize != other.characterSize || horizontalLimit != other.horizontalLimit
+		|| alignment != other.alignment || maxLines != other.maxLines || compactStorage != other.compactStorage)
+		return false;
+	if (document == other.document)
+		return true;
+	if (document->string != other.document->string || document->stylizers.size() != other.document->stylizers.size())
+		return false;
+	for (auto it = document->stylizers.begin(), otherIt = other.document->stylizers.begin(); it != document->stylizers.end(); it++, otherIt++) {
+		if (it->first != otherIt->first || it->second->hash() != otherIt->second->hash())
+			return false;
 	}
+	return true;
+}
 
-	//First, make all the lines after the starting line unexplored:
-	m_lineStart_i.resize(m_updateStartLine+1);
-	m_lineStart_verticalPos.resize(m_updateStartLine+1);
-	m_lineStart_char.resize(m_updateStartLine+1);
-	resizeLineStartMap(m_lineStart_line, m_updateStartLine+1);
-	resizeLineStartMap(m_lineStart_charOutline, m_updateStartLine+1);
-	resizeLineStartMap(m_lineStart_lineOutline, m_updateStartLine+1);
-
-	//Discard the vertex arrays' information starting from the starting line.
-	//We keep the indices so that they can be used at the end of the program for pixel alignment of all new vertices
-	size_t startOfNewCharVertices = m_lineStart_char[m_updateStartLine];
-	m_charVertices.resize(startOfNewCharVertices);
-	size_t startOfNewCharOutlineVertices = getLastVerticesIndexBeforeLine(m_lineStart_charOutline, m_updateStartLine);
-	m_charOutlineVertices.resize(startOfNewCharOutlineVertices);
-	size_t startOfNewLineVertices = getLastVerticesIndexBeforeLine(m_lineStart_line, m_updateStartLine);
-	m_lineVertices.resize(startOfNewLineVertices);
-	size_t startOfNewLineOutlineVertices = getLastVerticesIndexBeforeLine(m_lineStart_lineOutline, m_updateStartLine);
-	m_lineOutlineVertices.resize(startOfNewLineOutlineVertices);
-
-	//Populate the starting variables with the line start info
-	size_t i = m_lineStart_i[m_updateStartLine];
-	sf::Vector2f pos(0, m_lineStart_verticalPos[m_updateStartLine]);
-	size_t i_displayOnly = m_charVertices.getVertexCount() / 6;
-
-	//Populate the complex variables with the default style values
-	m_style.rewind();
-	float whitespaceWidth = m_font->getGlyph(L' ', m_characterSize, false).advance;
-	float letterSpacing = (whitespaceWidth / 3.f) * (m_style.letterSpacingFactors.front() - 1.f);
-	whitespaceWidth += letterSpacing;
-	float lineSpacing = m_font->getLineSpacing(m_characterSize) * m_style.lineSpacingFactors.front();
-	float lineThickness = m_font->getUnderlineThickness(m_characterSize);
-
-	sf::Vector2f underlineStart(pos.x, pos.y + m_font->getUnderlinePosition(m_characterSize));
-	sf::Vector2f underlineOutlineStart = underlineStart;
-	sf::FloatRect xBounds = m_font->getGlyph(L'x', m_characterSize, false).bounds;
-	sf::Vector2f strikeThroughStart(pos.x, pos.y + xBounds.top + xBounds.height * 0.4f);
-	sf::Vector2f strikeThroughOutlineStart = strikeThroughStart;
-	float italicShear = m_style.italics.back() ? 0.209f : 0.f;
-	bool hasOutline = m_style.outlineThicknesses.front() != 0.f;
-
-	//Now, update the style (and complex variables) by iterating through the stylizers up to the starting line
-	auto it = m_stylizers.begin();
-	while (it != m_stylizers.end() && it->first <= i) {
-		switch (it->second->stylize(m_style)) {
-		case Stylizer::Italic:
-			italicShear = m_style.italics.back() ? 0.209f : 0.f;
+struct LayoutKeyHasher {
+	template<class Key>
+	size_t operator()(Key const& key) const { return static_cast<size_t>(key.hash); }
+};
+
+class RichText::LayoutCache {
+public:
+	static LayoutCache& instance() {
+		static LayoutCache cache;
+		return cache;
+	}
+
+	std::shared_ptr<Geometry> find(LayoutKey const& key) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_index.find(key);
+		if (it == m_index.end()) {
+			m_stats.misses++;
+			return nullptr;
+		}
+		m_stats.hits++;
+		m_entries.splice(m_entries.begin(), m_entries, it->second);
+		return it->second->second;
+	}
+
+	void insert(LayoutKey const& key, std::shared_ptr<Geometry> const& geometry) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		size_t size = getMemoryUsage(key, *geometry);
+		if (size > m_stats.memoryCap || m_index.count(key))
+			return;
+		m_entries.emplace_front(key, geometry);
+		m_index.emplace(key, m_entries.begin());
+		m_stats.memoryUsage += size;
+		evict();
+	}
+
+	void setMemoryCap(size_t bytes) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stats.memoryCap = bytes;
+		evict();
+	}
+
+	void clear() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_entries.clear();
+		m_index.clear();
+		m_stats.memoryUsage = 0;
+	}
+
+	LayoutCacheStats getStats() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		LayoutCacheStats stats = m_stats;
+		stats.entries = m_entries.size();
+		return stats;
+	}
+
+	std::atomic<bool> enabled { false };
+
+private:
+	LayoutCache() {
+		m_stats.memoryCap = 32 * 1024 * 1024;
+	}
+
+	void evict() { //Drops least recently used entries until the memory cap is respected; instances still using them keep them alive
+		while (m_stats.memoryUsage > m_stats.memoryCap && !m_entries.empty()) {
+			m_stats.memoryUsage -= getMemoryUsage(m_entries.back().first, *m_entries.back().second);
+			m_index.erase(m_entries.back().first);
+			m_entries.pop_back();
+			m_stats.evictions++;
+		}
+	}
+
+	static size_t getMemoryUsage(LayoutKey const& key, Geometry const& geometry) { //The key keeps the document alive, for comparisons
+		return geometry.getMemoryUsage() + key.document->string.getSize() * sizeof(sf::Uint32)
+			+ key.document->stylizers.size() * (mapNodeSize + sizeof(StarterStylizer<sf::Color>));
+	}
+
+	typedef std::list<std::pair<LayoutKey, std::shared_ptr<Geometry>>> EntryList; //Most recently used first
+
+	std::mutex m_mutex;
+	EntryList m_entries;
+	std::unordered_map<LayoutKey, EntryList::iterator, LayoutKeyHasher> m_index;
+	LayoutCacheStats m_stats;
+};
+
+bool RichText::isLayoutCacheable() const {
+	//Atlas glyphs can be evicted under each instance, and animated geometry is rewritten by each instance
+	return LayoutCache::instance().enabled && m_characterLimit >= m_document->totalDisplayableCharacters && !m_atlas && !m_document->hasAnimationTags;
+}
+
+RichText::LayoutKey RichText::computeLayoutKey() const {
+	sf::Uint64 hash = 14695981039346656037ull;
+	for (size_t i = 0; i < m_document->string.getSize(); i++)
+		hashValue(hash, m_document->string[i]);
+	for (auto it = m_document->stylizers.begin(); it != m_document->stylizers.end(); it++) {
+		hashValue(hash, it->first);
+		hashValue(hash, it->second->hash());
+	}
+	hashStyleSettings(hash);
+	for (std::shared_ptr<GlyphRegistry> const& font : m_glyphRegistries)
+		hashValue(hash, font.get());
+
+	return LayoutKey { hash, m_document, m_glyphRegistries, m_metrics, m_characterSize, m_horizontalLimit, m_alignment, m_maxLines, m_compactStorage };
+}
+
+void RichText::hashStyleSettings(sf::Uint64& hash) const {
+	hashValue(hash, m_style.bolds.front());
+	hashValue(hash, m_style.italics.front());
+	hashValue(hash, m_style.underlineds.front());
+	hashValue(hash, m_style.strikeThroughs.front());
+	hashValue(hash, m_style.fillColors.front());
+	hashValue(hash, m_style.outlineThicknesses.front());
+	hashValue(hash, m_style.outlineColors.front());
+	hashValue(hash, m_style.letterSpacingFactors.front());
+	hashValue(hash, m_style.lineSpacingFactors.front());
+	hashValue(hash, m_tabularDigits);
+	if (m_maxLines != std::numeric_limits<size_t>::max()) {
+		for (size_t i = 0; i < m_ellipsis.getSize(); i++)
+			hashValue(hash, m_ellipsis[i]);
+	}
+}
+
+void RichText::setLayoutCacheEnabled(bool enabled) {
+	LayoutCache::instance().enabled = enabled;
+	if (!enabled)
+		LayoutCache::instance().clear();
+}
+
+bool RichText::isLayoutCacheEnabled() { return LayoutCache::instance().enabled; }
+void RichText::setLayoutCacheMemoryCap(size_t bytes) { LayoutCache::instance().setMemoryCap(bytes); }
+RichText::LayoutCacheStats RichText::getLayoutCacheStats() { return LayoutCache::instance().getStats(); }
+void RichText::clearLayoutCache() { LayoutCache::instance().clear(); }
+
+template<class T>
+void writeSnapshotValue(std::ofstream& file, T const& value) {
+	file.write(reinterpret_cast<char const*>(&value), sizeof(T));
+}
+
+template<class T>
+void writeSnapshotArray(std::ofstream& file, T const* values, size_t count) {
+	writeSnapshotValue(file, sf::Uint64(count));
+	file.write(reinterpret_cast<char const*>(values), count * sizeof(T));
+}
+
+//Reads a snapshot loaded in one go, failing rather than reading past its end
+class RichText::SnapshotReader {
+public:
+	SnapshotReader(std::vector<char> const& data) : m_at(data.data()), m_end(data.data() + data.size()) {}
+
+	template<class T>
+	bool read(T& value) {
+		if (getRemaining() < sizeof(T))
+			return false;
+		std::memcpy(&value, m_at, sizeof(T));
+		m_at += sizeof(T);
+		return true;
+	}
+
+	template<class T>
+	bool readArray(std::vector<T>& values) {
+		sf::Uint64 count;
+		if (!read(count) || count > getRemaining() / sizeof(T))
+			return false;
+		values.resize(static_cast<size_t>(count));
+		if (count > 0)
+			std::memcpy(values.data(), m_at, values.size() * sizeof(T));
+		m_at += values.size() * sizeof(T);
+		return true;
+	}
+
+	size_t getRemaining() const { return static_cast<size_t>(m_end - m_at); }
+
+private:
+	char const* m_at;
+	char const* m_end;
+};
+
+template<class T>
+void RichText::writeStylizer(std::ofstream& file, Stylizer const* stylizer) {
+	StarterStylizer<T> const* starter = dynamic_cast<StarterStylizer<T> const*>(stylizer);
+	writeSnapshotValue(file, sf::Uint8(starter ? 1 : 0));
+	if (starter) {
+		writeSnapshotValue(file, sf::Uint8(starter->activated));
+		writeSnapshotValue(file, starter->getValue()); //Kept by inactive stylizers too, for when they are activated again
+	}
+}
+
+template<class T>
+RichText::Stylizer* RichText::readStylizer(SnapshotReader& reader, Stylizer::StyleProperty type) {
+	sf::Uint8 starter, activated;
+	T value;
+	if (!reader.read(starter))
+		return nullptr;
+	if (!starter)
+		return new EnderStylizer<T>(type);
+	if (!reader.read(activated) || !reader.read(value))
+		return nullptr;
+	StarterStylizer<T>* stylizer = new StarterStylizer<T>(type, value);
+	stylizer->activated = activated != 0;
+	return stylizer;
+}
+
+sf::Uint64 RichText::Document::hashMarkup(sf::String const& markup) {
+	sf::Uint64 hash = 14695981039346656037ull;
+	for (size_t i = 0; i < markup.getSize(); i++)
+		hashValue(hash, markup[i]);
+	return hash;
+}
+
+//Covers what the layout of the markup depends on, the fonts through their metrics for a sample of glyphs
+sf::Uint64 RichText::computeSnapshotKey(sf::String const& markup) const {
+	sf::Uint64 hash = Document::hashMarkup(markup);
+	hashStyleSettings(hash);
+	hashValue(hash, m_characterSize);
+	hashValue(hash, m_horizontalLimit);
+	hashValue(hash, m_alignment);
+	hashValue(hash, sf::Uint64(m_characterLimit));
+	hashValue(hash, sf::Uint64(m_maxLines));
+	hashValue(hash, m_atlas ? m_atlas->getOutlineThicknessStep() : 0.f);
+	//The layout is saved as it is in memory
+	hashValue(hash, sf::Uint32(sizeof(size_t)));
+	hashValue(hash, sf::Uint32(sizeof(RichTextLayout::PlacedGlyph)));
+	hashValue(hash, sf::Uint32(sizeof(RichTextLayout::StyleRun)));
+	hashValue(hash, sf::Uint32(sizeof(RichTextLayout::Decoration)));
+	hashValue(hash, sf::Uint32(sizeof(RichTextLayout::Line)));
+
+	InstanceMetrics instanceMetrics(*this);
+	RichTextLayout::MetricsProvider const& metrics = *getLayoutSettings(instanceMetrics).metrics;
+	if (m_font) {
+		std::string const& family = m_font->getInfo().family;
+		for (char c : family)
+			hashValue(hash, c);
+	}
+	hashValue(hash, sf::Uint32(m_fallbackFonts.size()));
+	hashValue(hash, metrics.getLineSpacing(m_characterSize));
+	hashValue(hash, metrics.getUnderlinePosition(m_characterSize));
+	hashValue(hash, metrics.getUnderlineThickness(m_characterSize));
+	for (sf::Uint32 codePoint = 0x20; codePoint < 0x7F; codePoint++) {
+		for (bool bold : { false, true }) {
+			sf::Glyph glyph = metrics.getGlyph(codePoint, m_characterSize, bold, 0.f);
+			hashValue(hash, glyph.advance);
+			hashValue(hash, glyph.bounds);
+		}
+	}
+	char const* kernedPairs = "AVAWAYLTLVLYPAToTaTyVaVoWaYaYo";
+	for (size_t k = 0; kernedPairs[k] && kernedPairs[k+1]; k += 2)
+		hashValue(hash, metrics.getKerning(kernedPairs[k], kernedPairs[k+1], m_characterSize));
+	return hash;
+}
+
+//In the native byte order and layout: a header, the key, the parsed string, its stylizers and their IDs, its variables, then the layout
+bool RichText::saveSnapshot(std::string const& filename, sf::String const& markup) const {
+	if (!m_font && !m_metrics)
+		return false;
+	if (!isPrepared())
+		updateVertices();
+	//Prepared instances publish the layout of their document once prepared since its last change
+	if (m_shouldUpdateVertices || !isLayoutComplete())
+		return false;
+	RichTextLayout::Result const& layout = getLaidOutGeometry().layout;
+	Document const& document = *m_document;
+
+	std::ofstream file(filename, std::ios::binary);
+	if (!file)
+		return false;
+
+	file.write("RTLS", 4);
+	writeSnapshotValue(file, sf::Uint32(2));
+	writeSnapshotValue(file, computeSnapshotKey(markup));
+
+	writeSnapshotArray(file, document.string.getData(), document.string.getSize());
+	writeSnapshotValue(file, sf::Uint64(document.totalDisplayableCharacters));
+	writeSnapshotValue(file, sf::Uint8(document.hasAnimationTags));
+	writeSnapshotValue(file, sf::Uint64(document.stylizers.size()));
+	for (auto it = document.stylizers.begin(); it != document.stylizers.end(); it++) {
+		writeSnapshotValue(file, sf::Uint64(it->first));
+		writeSnapshotValue(file, sf::Uint64(it->second->index));
+		writeSnapshotValue(file, sf::Uint8(it->second->getType()));
+		switch (it->second->getType()) {
+		case Stylizer::FillColor:
+		case Stylizer::OutlineColor:
+			writeStylizer<sf::Color>(file, it->second);
 			break;
 		case Stylizer::OutlineThickness:
-			hasOutline = m_style.outlineThicknesses.back() != 0.f;
-			break;
 		case Stylizer::LetterSpacing:
-			whitespaceWidth = m_font->getGlyph(L' ', m_characterSize, false).advance;
-			letterSpacing = (whitespaceWidth / 3.f) * (m_style.letterSpacingFactors.back() - 1.f);
-			whitespaceWidth += letterSpacing;
-			break;
 		case Stylizer::LineSpacing:
-			lineSpacing = m_font->getLineSpacing(m_characterSize) * m_style.lineSpacingFactors.back();
+		case Stylizer::CharacterSize:
+			writeStylizer<float>(file, it->second);
 			break;
 		default:
+			writeStylizer<bool>(file, it->second);
 			break;
 		}
-		it++;
+	}
+	//IDs given to names are only the same in processes that named them in the same order, so the names are saved instead
+	writeSnapshotValue(file, sf::Uint64(document.modifiableStylizers.size()));
+	for (auto const& modifiable : document.modifiableStylizers) {
+		std::string name;
+		bool named = findIDName(modifiable.first, name);
+		writeSnapshotValue(file, sf::Uint8(named));
+		if (named)
+			writeSnapshotArray(file, name.data(), name.size());
+		else
+			writeSnapshotValue(file, sf::Int32(modifiable.first));
+		writeSnapshotValue(file, sf::Uint64(modifiable.second.size()));
+		for (Stylizer const* stylizer : modifiable.second)
+			writeSnapshotValue(file, sf::Uint64(stylizer->index));
+	}
+	writeSnapshotValue(file, sf::Uint64(document.variables.size()));
+	for (Document::Variable const& variable : document.variables) {
+		writeSnapshotArray(file, variable.name.data(), variable.name.size());
+		writeSnapshotValue(file, sf::Uint64(variable.start));
+		writeSnapshotValue(file, sf::Uint64(variable.length));
+		writeSnapshotValue(file, sf::Uint64(variable.firstStylizer));
 	}
 
-	sf::VertexArray wordCharVertices = sf::VertexArray(sf::Triangles);
-	sf::VertexArray wordLineVertices  = sf::VertexArray(sf::Triangles);
-	sf::VertexArray wordCharOutlineVertices  = sf::VertexArray(sf::Triangles);
-	sf::VertexArray wordLineOutlineVertices  = sf::VertexArray(sf::Triangles);
+	writeSnapshotArray(file, layout.glyphs.data(), layout.glyphs.size());
+	writeSnapshotArray(file, layout.runs.data(), layout.runs.size());
+	writeSnapshotArray(file, layout.decorations.data(), layout.decorations.size());
+	writeSnapshotArray(file, layout.outlineDecorations.data(), layout.outlineDecorations.size());
+	writeSnapshotArray(file, layout.lines.data(), layout.lines.size());
+	writeSnapshotArray(file, layout.stylizerLines.data(), layout.stylizerLines.size());
+	writeSnapshotValue(file, layout.bounds);
+	writeSnapshotValue(file, sf::Uint64(layout.firstHiddenCharacter));
+	return static_cast<bool>(file);
+}
 
-	float lineSpacingAtWordStart = lineSpacing;
-	float outlineThicknessAtWordStart = m_style.outlineThicknesses.back();
-	float whitespaceWidthAtWordStart = 0;
-	size_t whitespacesAtWordStart = 0;
-	size_t i_atWordStart = 0;
+bool RichText::loadSnapshot(std::string const& filename, sf::String const& markup) {
+	RICHTEXT_TRACE_SCOPE(trace, "load snapshot", 0, markup.getSize());
+	//The whole file is read at once, then taken apart in memory
+	std::vector<char> data;
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	std::streamoff size = file ? static_cast<std::streamoff>(file.tellg()) : 0;
+	if (size > 0) {
+		data.resize(static_cast<size_t>(size));
+		file.seekg(0);
+		file.read(data.data(), size);
+	}
 
-	float currentLineWidth = 0.f;
-	bool intentionalLineBreak = true; //When true, whitespace before the first word of a line can push it to line wrapping; becomes false after a line wrap (the whitespace "disappears").
+	std::shared_ptr<Document> document = std::make_shared<Document>();
+	std::shared_ptr<Geometry> geometry = std::make_shared<Geometry>();
+	auto read = [&]() -> bool {
+		SnapshotReader reader(data);
+		char magic[4];
+		sf::Uint32 version;
+		sf::Uint64 key;
+		if ((!m_font && !m_metrics) || !file || !reader.read(magic) || std::string(magic, 4) != "RTLS" || !reader.read(version) || version != 2
+				|| !reader.read(key) || key != computeSnapshotKey(markup))
+			return false;
+
+		std::vector<sf::Uint32> string;
+		sf::Uint64 displayable, count;
+		sf::Uint8 hasAnimationTags;
+		if (!reader.readArray(string) || !reader.read(displayable) || !reader.read(hasAnimationTags) || !reader.read(count) || count > reader.getRemaining())
+			return false;
+		document->string = sf::String::fromUtf32(string.begin(), string.end());
+		document->totalDisplayableCharacters = static_cast<size_t>(displayable);
+		document->hasAnimationTags = hasAnimationTags != 0;
+		document->lineBreaks = std::count(string.begin(), string.end(), static_cast<sf::Uint32>('\n'));
+		std::vector<Stylizer*> byIndex(static_cast<size_t>(count), nullptr);
+		for (sf::Uint64 k = 0; k < count; k++) {
+			sf::Uint64 position, index;
+			sf::Uint8 type;
+			if (!reader.read(position) || !reader.read(index) || !reader.read(type) || index >= count || byIndex[index] || type == Stylizer::None || type > Stylizer::Pulse)
+				return false;
+			Stylizer* stylizer;
+			switch (type) {
+			case Stylizer::FillColor:
+			case Stylizer::OutlineColor:
+				stylizer = readStylizer<sf::Color>(reader, static_cast<Stylizer::StyleProperty>(type));
+				break;
+			case Stylizer::OutlineThickness:
+			case Stylizer::LetterSpacing:
+			case Stylizer::LineSpacing:
+			case Stylizer::CharacterSize:
+				stylizer = readStylizer<float>(reader, static_cast<Stylizer::StyleProperty>(type));
+				break;
+			default:
+				stylizer = readStylizer<bool>(reader, static_cast<Stylizer::StyleProperty>(type));
+				break;
+			}
+			if (!stylizer)
+				return false;
+			stylizer->index = static_cast<size_t>(index);
+			byIndex[stylizer->index] = stylizer;
+			document->stylizers.emplace_hint(document->stylizers.end(), static_cast<size_t>(position), stylizer);
+		}
 
-	size_t currentLine = m_updateStartLine;
-	m_updateStartLine = std::numeric_limits<size_t>::max();
+		if (!reader.read(count))
+			return false;
+		for (sf::Uint64 k = 0; k < count; k++) {
+			sf::Uint8 named;
+			int ID;
+			if (!reader.read(named))
+				return false;
+			if (named) {
+				std::vector<char> name;
+				if (!reader.readArray(name))
+					return false;
+				ID = getID(std::string(name.begin(), name.end()));
+			}
+			else {
+				sf::Int32 number;
+				if (!reader.read(number) || number < 0)
+					return false;
+				ID = number;
+			}
+			sf::Uint64 stylizerCount;
+			if (!reader.read(stylizerCount) || stylizerCount > reader.getRemaining())
+				return false;
+			std::vector<Stylizer*>& stylizers = document->modifiableStylizers[ID];
+			for (sf::Uint64 s = 0; s < stylizerCount; s++) {
+				sf::Uint64 index;
+				if (!reader.read(index) || index >= byIndex.size())
+					return false;
+				stylizers.push_back(byIndex[index]);
+			}
+		}
 
-	bool reachedCharacterLimit = false;
+		//The values were inserted by the parser: the snapshot holds them, and only stands for the markup while they're still the same
+		if (!reader.read(count) || count > reader.getRemaining())
+			return false;
+		for (sf::Uint64 k = 0; k < count; k++) {
+			std::vector<char> name;
+			sf::Uint64 start, length, firstStylizer;
+			if (!reader.readArray(name) || !reader.read(start) || !reader.read(length) || !reader.read(firstStylizer)
+					|| start > document->string.getSize() || length > document->string.getSize() - start || firstStylizer > byIndex.size())
+				return false;
+			Document::Variable variable { std::string(name.begin(), name.end()), static_cast<size_t>(start), static_cast<size_t>(length), static_cast<size_t>(firstStylizer) };
+			if (document->string.substring(variable.start, variable.length) != getVariable(variable.name))
+				return false;
+			document->variables.push_back(variable);
+		}
 
-	const std::function<void()> addWordToText = [&]() {
-		for (size_t i = 0; i < wordCharVertices.getVertexCount(); i++)
-			m_charVertices.append(wordCharVertices[i]);
-		for (size_t i = 0; i < wordLineVertices.getVertexCount(); i+=6) {
-			for (size_t j = i; j < i+6; j++)
-				m_lineVertices.append(wordLineVertices[j]);
+		RichTextLayout::Result& layout = geometry->layout;
+		sf::Uint64 firstHiddenCharacter;
+		if (!reader.readArray(layout.glyphs) || !reader.readArray(layout.runs) || !reader.readArray(layout.decorations) || !reader.readArray(layout.outlineDecorations)
+				|| !reader.readArray(layout.lines) || !reader.readArray(layout.stylizerLines) || !reader.read(layout.bounds) || !reader.read(firstHiddenCharacter)
+				|| reader.getRemaining() != 0 || layout.lines.empty())
+			return false;
+		layout.firstHiddenCharacter = static_cast<size_t>(firstHiddenCharacter);
+		for (RichTextLayout::PlacedGlyph const& glyph : layout.glyphs) {
+			if (glyph.run >= layout.runs.size())
+				return false;
 		}
-		for (size_t i = 0; i < wordCharOutlineVertices.getVertexCount(); i++)
-			m_charOutlineVertices.append(wordCharOutlineVertices[i]);
-		for (size_t i = 0; i < wordLineOutlineVertices.getVertexCount(); i+=6) {
-			for (size_t j = i; j < i+6; j++)
-				m_lineOutlineVertices.append(wordLineOutlineVertices[j]);
+		for (RichTextLayout::Line const& line : layout.lines) {
+			if (line.firstGlyph > layout.glyphs.size() || line.firstDecoration > layout.decorations.size() || line.firstOutlineDecoration > layout.outlineDecorations.size())
+				return false;
 		}
+		return true;
 	};
+	if (!read()) {
+		parseString(markup);
+		return false;
+	}
 
-	const std::function<void()> resetWord = [&]() {
-		wordCharVertices.clear();
-		wordLineVertices.clear();
-		wordCharOutlineVertices.clear();
-		wordLineOutlineVertices.clear();
-
-		currentLineWidth = pos.x;
-		lineSpacingAtWordStart = lineSpacing;
-		outlineThicknessAtWordStart = m_style.outlineThicknesses.back();
-		whitespaceWidthAtWordStart = 0;
-		whitespacesAtWordStart = 0;
-		i_atWordStart = i;
-	};
+	document->markupHash = Document::hashMarkup(markup);
+	document->markupLength = markup.getSize();
+	document->isParsedMarkup = true;
+	m_document = document;
+	m_measurements.clear();
+	m_layoutInProgress = false;
+	m_realignLines = false;
+	m_updateStartLine = std::numeric_limits<size_t>::max();
+	m_recolorStartLine = std::numeric_limits<size_t>::max();
+	m_shouldUpdateVertices = false;
 
-	const std::function<void()> setLineStarts = [&]() {
-		m_lineStart_i.push_back(i_atWordStart + whitespacesAtWordStart);
-		m_lineStart_verticalPos.push_back(pos.y);
-
-		m_lineStart_char.push_back(m_charVertices.getVertexCount());
-		if (m_lineStart_charOutline.rbegin()->second != m_charOutlineVertices.getVertexCount()) //If any char outlines were added since the last line logged in the map
-			m_lineStart_charOutline.emplace(currentLine, m_charOutlineVertices.getVertexCount());
-		if (m_lineStart_line.rbegin()->second != m_lineVertices.getVertexCount())
-			m_lineStart_line.emplace(currentLine, m_lineVertices.getVertexCount());
-		if (m_lineStart_lineOutline.rbegin()->second != m_lineOutlineVertices.getVertexCount())
-			m_lineStart_lineOutline.emplace(currentLine, m_lineOutlineVertices.getVertexCount());
-	};
+	//Prepared instances publish it, for the render thread to build its vertices when adopting it
+	if (std::shared_ptr<Geometry> published = std::atomic_load(&m_preparedGeometry)) {
+#ifdef RICHTEXT_PERFORMANCE_COUNTERS
+		geometry->preparedCounters = published->preparedCounters;
+#endif
+		std::atomic_store(&m_preparedGeometry, geometry);
+		return true;
+	}
+	m_geometry = geometry;
+	m_coldGlyphMisses = 0;
+	if (m_atlas) {
+		m_atlas->beginUse();
+		m_atlasShelves.clear();
+	}
+	if (m_font)
+		buildVertices(0);
+	m_geometryVersion++;
+	return true;
+}
 
-	sf::Uint32 previousChar = 0;
-	size_t len = m_string.getSize();
+void RichText::addGlyphQuads(RichTextLayout::PlacedGlyph const& glyph, float shift, sf::VertexArray& charVertices, sf::VertexArray& charOutlineVertices) const {
+	RichTextLayout::StyleRun const& run = m_geometry->layout.runs[glyph.run];
+	size_t charStart = charVertices.getVertexCount();
+	addGlyphQuad(charVertices, glyph.position, run.fillColor, getGlyph(glyph.codePoint, run.bold, 0.f, run.font, run.characterSize), run.italicShear);
+	roundNewVertices(charVertices, charStart, shift);
+	if (run.outlineThickness != 0.f) {
+		size_t outlineStart = charOutlineVertices.getVertexCount();
+		addGlyphQuad(charOutlineVertices, glyph.position, run.outlineColor, getGlyph(glyph.codePoint, run.bold, run.outlineThickness, run.font, run.characterSize), run.italicShear, run.outlineThickness);
+		roundNewVertices(charOutlineVertices, outlineStart, shift);
+	}
+}
 
-	while (i < len) {
-		if (i_displayOnly == m_characterLimit) {
-			if (m_style.underlineds.back()) {
-				addLine(wordLineVertices, underlineStart, pos.x - underlineStart.x, m_style.fillColors.back(), lineThickness);
-				if (hasOutline) {
-					addLine(wordLineOutlineVertices, underlineOutlineStart, pos.x - underlineOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
-				}
-			}
-			if (m_style.strikeThroughs.back()) {
-				addLine(wordLineVertices, strikeThroughStart, pos.x - strikeThroughStart.x, m_style.fillColors.back(), lineThickness);
-				if (hasOutline) {
-					addLine(wordLineOutlineVertices, strikeThroughOutlineStart, pos.x - strikeThroughOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
-				}
-			}
+void RichText::updateVisibleVertices(sf::RenderTarget const& target, sf::Transform const& transform) const {
+	RichTextLayout::Result const& layout = m_geometry->layout;
+
+	//Lines whose baseline is in view, with a margin for the ascent, descent and outline of their glyphs
+	sf::View const& view = target.getView();
+	sf::FloatRect visible = transform.getInverse().transformRect(sf::FloatRect(view.getCenter() - view.getSize() / 2.f, view.getSize()));
+	float margin = m_characterSize * 2.f;
+	for (RichTextLayout::StyleRun const& run : layout.runs)
+		margin = std::max(margin, std::max<unsigned int>(m_characterSize, run.characterSize) * 2.f + std::abs(run.outlineThickness));
+
+	auto above = [](RichTextLayout::Line const& line, float y) { return line.verticalPosition < y; };
+	auto below = [](float y, RichTextLayout::Line const& line) { return y < line.verticalPosition; };
+	size_t firstLine = std::lower_bound(layout.lines.begin(), layout.lines.end(), visible.top - margin, above) - layout.lines.begin();
+	size_t endLine = std::upper_bound(layout.lines.begin() + firstLine, layout.lines.end(), visible.top + visible.height + margin, below) - layout.lines.begin();
+	size_t firstGlyph = firstLine < layout.lines.size() ? layout.lines[firstLine].firstGlyph : layout.glyphs.size();
+	size_t endGlyph = endLine < layout.lines.size() ? layout.lines[endLine].firstGlyph : layout.glyphs.size();
+
+	if (m_visibleVersion == m_geometryVersion && m_visibleFirstGlyph == firstGlyph && m_visibleEndGlyph == endGlyph)
+		return;
+	m_visibleVersion = m_geometryVersion;
+	m_visibleFirstGlyph = firstGlyph;
+	m_visibleEndGlyph = endGlyph;
+
+	m_visibleCharVertices.clear();
+	m_visibleCharOutlineVertices.clear();
+	for (size_t line = firstLine; line < endLine; line++) {
+		RichTextLayout::getGlyphShifts(m_document->string, layout, line, m_glyphShifts);
+		for (size_t i = layout.lines[line].firstGlyph; i < layout.lines[line].firstGlyph + m_glyphShifts.size(); i++)
+			addGlyphQuads(layout.glyphs[i], m_glyphShifts[i - layout.lines[line].firstGlyph], m_visibleCharVertices, m_visibleCharOutlineVertices);
+	}
+	RICHTEXT_COUNT(verticesGenerated, m_visibleCharVertices.getVertexCount() + m_visibleCharOutlineVertices.getVertexCount());
+}
+
+bool RichText::checkAtlasEvictions() const {
+	if (!m_atlas || m_atlas->getGeneration() == m_atlasGeneration)
+		return false;
+	m_atlasGeneration = m_atlas->getGeneration();
+
+	for (size_t shelf = 0; shelf < m_atlasShelves.size(); shelf++) {
+		if (m_atlasShelves[shelf] != 0 && m_atlasShelves[shelf] != m_atlas->getShelfGeneration(shelf))
+			return true;
+	}
+	return false;
+}
+
+void RichText::prepare() {
+	if (!m_font && !m_metrics)
+		return;
+
+	std::shared_ptr<Geometry> published = std::atomic_load(&m_preparedGeometry);
+	if (published && !m_shouldUpdateVertices && !m_layoutInProgress)
+		return;
+	//Published geometry is never modified, so colour changes are laid out like the others
+	m_updateStartLine = std::min(m_updateStartLine, m_recolorStartLine);
+	m_recolorStartLine = std::numeric_limits<size_t>::max();
+	size_t startLine = published && !published->layout.lines.empty() ? m_updateStartLine : 0;
+	bool realign = m_realignLines && startLine > 0;
+	m_realignLines = false;
+	//A progressive layout continues from the line it stopped at, unless a change requires laying out again from an explored line
+	bool resuming = published && m_layoutInProgress && !published->layout.lines.empty() && (!m_shouldUpdateVertices || startLine >= published->layout.lines.size());
+	if (resuming)
+		startLine = published->layout.lines.size() - 1;
+	else if (published && !published->layout.lines.empty() && startLine >= published->layout.lines.size()) {
+		m_updateStartLine = std::numeric_limits<size_t>::max();
+		if (!realign)
+			return;
+
+		//Nothing to lay out again: the new alignment only moves the lines
+		RICHTEXT_TRACE_SCOPE(trace, "prepare alignment", 0, published->layout.glyphs.size());
+		std::shared_ptr<Geometry> back = std::make_shared<Geometry>();
+		back->layout = published->layout;
+#ifdef RICHTEXT_PERFORMANCE_COUNTERS
+		back->preparedCounters = published->preparedCounters;
+#endif
+		InstanceMetrics instanceMetrics(*this);
+		m_layout.align(m_document->string, getLayoutSettings(instanceMetrics), back->layout);
+		if (m_layout.getFirstMovedLine() == back->layout.lines.size())
+			return;
+		back->preparedFrom = published.get();
+		back->preparedFromLine = m_layout.getFirstMovedLine();
+		std::atomic_store(&m_preparedGeometry, back);
+		return;
+	}
+
+	//The back buffer starts with the lines kept from the published layout, which the render thread only ever reads
+	std::shared_ptr<Geometry> back = std::make_shared<Geometry>();
+
+	//Counted into the back buffer, which may be on a worker thread while the render thread counts into the instance
+#ifdef RICHTEXT_PERFORMANCE_COUNTERS
+	if (published)
+		back->preparedCounters = published->preparedCounters;
+	unsigned int countersDepth = 1; //Never the outermost phase: the render thread adds the counts to the global counters when merging them
+#endif
+	RICHTEXT_TIME_PHASE_TO(back->preparedCounters, countersDepth, layoutNanoseconds);
+	RICHTEXT_COUNT_TO(back->preparedCounters, layouts, 1);
+	RICHTEXT_COUNT_TO(back->preparedCounters, fullLayouts, startLine == 0 ? 1 : 0);
+	RICHTEXT_SET_TO(back->preparedCounters, lastLayoutStartLine, startLine);
+	RICHTEXT_TRACE_SCOPE(trace, "prepare", startLine, m_document->string.getSize());
+
+	if (resuming)
+		back->layout = published->layout; //Whole, for the style runs of the word in progress
+	else if (startLine > 0)
+		back->layout = RichTextLayout::Result(published->layout, startLine);
+	back->preparedFrom = published.get();
+	back->preparedFromLine = startLine;
+
+	InstanceMetrics instanceMetrics(*this);
+	if (resuming)
+		m_layoutInProgress = !m_layout.resume(m_document->string, m_document->stylizers, getLayoutSettings(instanceMetrics), back->layout);
+	else
+		m_layoutInProgress = !m_layout.layout(m_document->string, m_document->stylizers, m_style, getLayoutSettings(instanceMetrics), back->layout, startLine);
+	RICHTEXT_COUNT_TO(back->preparedCounters, stylizersReplayed, m_layout.getStatistics().stylizersReplayed);
+	RICHTEXT_COUNT_TO(back->preparedCounters, linesLaidOut, back->layout.lines.size() - startLine);
+	RICHTEXT_TRACE_ARGUMENT(trace, characters, m_layout.getStatistics().charactersScanned);
+	back->layoutInProgress = m_layoutInProgress;
+
+	//Lines kept from the published layout may have moved, with the alignment or the widest line; the render thread builds them again
+	size_t firstMovedLine = m_layout.getFirstMovedLine();
+	if (realign) {
+		m_layout.align(m_document->string, getLayoutSettings(instanceMetrics), back->layout);
+		firstMovedLine = std::min(firstMovedLine, m_layout.getFirstMovedLine());
+	}
+	back->preparedFromLine = std::min(startLine, firstMovedLine);
+
+	std::atomic_store(&m_preparedGeometry, back);
+	m_updateStartLine = std::numeric_limits<size_t>::max();
+	m_shouldUpdateVertices = false;
+}
+
+bool RichText::isPrepared() const { return std::atomic_load(&m_preparedGeometry) != nullptr; }
+
+void RichText::setLayoutBudget(size_t lines, float time) {
+	m_layoutLineBudget = lines;
+	m_layoutTimeBudget = time;
+}
+
+size_t RichText::getLayoutLineBudget() const { return m_layoutLineBudget; }
+float RichText::getLayoutTimeBudget() const { return m_layoutTimeBudget; }
+
+bool RichText::isLayoutComplete() const {
+	std::shared_ptr<Geometry> prepared = std::atomic_load(&m_preparedGeometry);
+	return prepared ? !prepared->layoutInProgress : !m_layoutInProgress;
+}
+
+float RichText::getLayoutProgress() const {
+	std::shared_ptr<Geometry> prepared = std::atomic_load(&m_preparedGeometry);
+	Geometry const& geometry = prepared ? *prepared : *m_geometry;
+	size_t length = m_document->string.getSize();
+	if (!(prepared ? prepared->layoutInProgress : m_layoutInProgress) || length == 0 || geometry.layout.lines.empty())
+		return 1.f;
+	return static_cast<float>(geometry.layout.lines.back().firstCharacter) / length;
+}
+
+void RichText::setScheduler(RichTextScheduler* scheduler) {
+	if (std::shared_ptr<RichTextScheduler::Registry> previous = m_scheduler.registry.lock())
+		previous->remove(this);
+	m_scheduler.registry.reset();
+	if (!scheduler)
+		return;
+
+	//Publishes the current layout, so that nothing is laid out lazily until the scheduler gets to the instance
+	if (!isPrepared()) {
+		std::shared_ptr<Geometry> published = std::make_shared<Geometry>();
+		published->layout = m_geometry->layout;
+		published->layoutInProgress = m_layoutInProgress;
+		std::atomic_store(&m_preparedGeometry, published);
+	}
+	m_scheduler.registry = scheduler->m_registry;
+	if (m_shouldUpdateVertices)
+		scheduler->m_registry->submit(this);
+}
+
+RichTextScheduler* RichText::getScheduler() const {
+	std::shared_ptr<RichTextScheduler::Registry> scheduler = m_scheduler.registry.lock();
+	return scheduler ? scheduler->scheduler : nullptr;
+}
+
+void RichText::requestLayout() {
+	m_shouldUpdateVertices = true;
+	m_measurements.clear();
+	if (std::shared_ptr<RichTextScheduler::Registry> scheduler = m_scheduler.registry.lock())
+		scheduler->submit(this);
+}
+
+void RichText::adoptPreparedGeometry(std::shared_ptr<Geometry> const& prepared) const {
+#ifdef RICHTEXT_PERFORMANCE_COUNTERS
+	mergePreparedCounters(*prepared);
+#endif
+	bool evicted = checkAtlasEvictions();
+	if (prepared == m_adoptedGeometry && !evicted)
+		return;
+	RICHTEXT_TRACE_SCOPE(trace, "adopt prepared layout", 0, prepared->layout.glyphs.size());
+
+	//Keep the vertices of the lines the prepared layout kept from the adopted one
+	size_t startLine = (!evicted && m_adoptedGeometry && prepared->preparedFrom == m_adoptedGeometry.get()) ? prepared->preparedFromLine : 0;
+	if (startLine == 0)
+		m_geometry = std::make_shared<Geometry>();
+	else if (m_geometry.use_count() > 1)
+		m_geometry = std::make_shared<Geometry>(*m_geometry, startLine);
+	else
+		m_geometry->truncate(startLine);
+	m_geometry->layout = prepared->layout; //A copy, so that the prepared layout stays untouched while vertices are built and animated
+	m_adoptedGeometry = prepared;
+
+	m_coldGlyphMisses = 0;
+	if (m_atlas) {
+		m_atlas->beginUse();
+		if (startLine == 0)
+			m_atlasShelves.clear();
+	}
+	if (m_font)
+		buildVertices(startLine);
+	m_geometryVersion++;
+}
+
+void RichText::updateVertices() const {
+	std::shared_ptr<Geometry> prepared = std::atomic_load(&m_preparedGeometry);
+	if (prepared) {
+		adoptPreparedGeometry(prepared);
+		return;
+	}
+
+	if (!m_font && !m_metrics)
+		return;
 
-			reachedCharacterLimit = true;
+	if (checkAtlasEvictions()) {
+		m_shouldUpdateVertices = true;
+		m_updateStartLine = 0;
+	}
+
+	if (!m_shouldUpdateVertices && !m_layoutInProgress)
+		return;
+
+	//A new alignment moves the lines laid out, before the ones to lay out again are laid out with it
+	if (m_realignLines) {
+		m_realignLines = false;
+		if (m_updateStartLine != 0)
+			realignLines();
+	}
+
+	//When nothing else changed, glyphs whose colour changed are recolored where they are; otherwise they are laid out with the rest
+	if (m_recolorStartLine != std::numeric_limits<size_t>::max()) {
+		size_t recolorStartLine = m_recolorStartLine;
+		m_recolorStartLine = std::numeric_limits<size_t>::max();
+		if (m_updateStartLine == std::numeric_limits<size_t>::max() && !m_layoutInProgress && recolor(recolorStartLine)) {
+			m_shouldUpdateVertices = false;
+			return;
 		}
+		m_updateStartLine = std::min(m_updateStartLine, recolorStartLine);
+	}
 
-		if (it != m_stylizers.end() && it->first == i) { //If stylizers exist at i
-			bool shouldUpdateUnderline = false, shouldUpdateUnderlineOutline = false, shouldUpdateStrikeThrough = false, shouldUpdateStrikeThroughOutline = false;
-			bool wasUnderlined = m_style.underlineds.back();
-			bool wasStrikeThrough = m_style.strikeThroughs.back();
-			bool hadOutline = hasOutline;
-			float oldLineThickness = lineThickness;
-			sf::Color oldFillColor = m_style.fillColors.back();
-			float oldOutlineThickness = m_style.outlineThicknesses.back();
-			sf::Color oldOutlineColor = m_style.outlineColors.back();
-
-			while (it != m_stylizers.end() && it->first == i) { //Modify the style; the return type gives info on whether or not the modification changed the style visually
-				it->second->line = currentLine;
-				switch (it->second->stylize(m_style)) {
-				case Stylizer::Italic:
-					italicShear = m_style.italics.back() ? 0.209f : 0.f;
-					break;
-				case Stylizer::Underlined:
-					shouldUpdateUnderline = true;
-					shouldUpdateUnderlineOutline = true;
-					break;
-				case Stylizer::StrikeThrough:
-					shouldUpdateStrikeThrough = true;
-					shouldUpdateStrikeThroughOutline = true;
-					break;
-				case Stylizer::FillColor:
-					shouldUpdateUnderline = true;
-					shouldUpdateStrikeThrough = true;
-					break;
-				case Stylizer::OutlineThickness:
-					shouldUpdateUnderlineOutline = true;
-					shouldUpdateStrikeThroughOutline = true;
-					hasOutline = m_style.outlineThicknesses.back() != 0.f;
-					break;
-				case Stylizer::OutlineColor:
-					shouldUpdateUnderlineOutline = true;
-					shouldUpdateStrikeThroughOutline = true;
-					break;
-				case Stylizer::LetterSpacing:
-					whitespaceWidth = m_font->getGlyph(L' ', m_characterSize, false).advance;
-					letterSpacing = (whitespaceWidth / 3.f) * (m_style.letterSpacingFactors.back() - 1.f);
-					whitespaceWidth += letterSpacing;
-					break;
-				case Stylizer::LineSpacing:
-					lineSpacing = m_font->getLineSpacing(m_characterSize) * m_style.lineSpacingFactors.back();
-					break;
-				default:
-					break;
-				}
-				it++;
-			}
+	//A progressive layout continues from the line it stopped at, unless a change requires laying out again from an explored line
+	if (m_layoutInProgress && !m_geometry->layout.lines.empty() && (!m_shouldUpdateVertices || m_updateStartLine >= m_geometry->layout.lines.size())) {
+		resumeLayout();
+		return;
+	}
 
-			if (!reachedCharacterLimit) {
-				if (shouldUpdateUnderline) {
-					if (wasUnderlined)
-						addLine(wordLineVertices, underlineStart, pos.x - underlineStart.x, oldFillColor, oldLineThickness);
-					if (m_style.underlineds.back())
-						underlineStart.x = pos.x;
-				}
-				if (shouldUpdateStrikeThrough) {
-					if (wasStrikeThrough)
-						addLine(wordLineVertices, strikeThroughStart, pos.x - strikeThroughStart.x, oldFillColor, oldLineThickness);
-					if (m_style.strikeThroughs.back())
-						strikeThroughStart.x = pos.x;
-				}
-				if (shouldUpdateUnderlineOutline) {
-					if (hadOutline && wasUnderlined)
-						addLine(wordLineOutlineVertices, underlineOutlineStart, pos.x - underlineOutlineStart.x, oldOutlineColor, oldLineThickness, oldOutlineThickness);
-					if (hasOutline && m_style.underlineds.back())
-						underlineOutlineStart.x = pos.x;
-				}
-				if (shouldUpdateStrikeThroughOutline) {
-					if (hadOutline && wasStrikeThrough)
-						addLine(wordLineOutlineVertices, strikeThroughOutlineStart, pos.x - strikeThroughOutlineStart.x, oldOutlineColor, oldLineThickness, oldOutlineThickness);
-					if (hasOutline && m_style.strikeThroughs.back())
-						strikeThroughOutlineStart.x = pos.x;
-				}
-			}
+	//Updating from a certain line:
+	//Don't update if the starting line is after all explored lines
+	if (!m_geometry->layout.lines.empty() && m_updateStartLine >= m_geometry->layout.lines.size()) {
+		m_updateStartLine = std::numeric_limits<size_t>::max();
+		return;
+	}
+
+	RICHTEXT_TIME_PHASE(layoutNanoseconds);
+	RICHTEXT_COUNT(layouts, 1);
+	RICHTEXT_COUNT(fullLayouts, m_updateStartLine == 0 ? 1 : 0);
+	RICHTEXT_SET(lastLayoutStartLine, m_updateStartLine);
+	RICHTEXT_TRACE_SCOPE(layoutTrace, "layout", m_updateStartLine, m_document->string.getSize());
+
+	m_coldGlyphMisses = 0;
+	if (m_atlas) {
+		m_atlas->beginUse();
+		if (m_updateStartLine == 0)
+			m_atlasShelves.clear();
+	}
 
+	//A full layout of content that was already laid out elsewhere can be taken from the layout cache
+	bool cacheable = m_updateStartLine == 0 && isLayoutCacheable();
+	LayoutKey cacheKey;
+	if (cacheable) {
+		cacheKey = computeLayoutKey();
+		std::shared_ptr<Geometry> cached = LayoutCache::instance().find(cacheKey);
+		if (cached) {
+			m_geometry = cached;
+			m_layoutInProgress = false;
+			m_updateStartLine = std::numeric_limits<size_t>::max();
+			m_shouldUpdateVertices = false;
+			m_geometryVersion++;
+			return;
 		}
+	}
 
-		sf::Uint32 currentChar = m_string[i];
+	//Make all the lines after the starting line unexplored, copying the kept lines first if the geometry is shared
+	if (m_geometry.use_count() > 1)
+		m_geometry = std::make_shared<Geometry>(*m_geometry, m_updateStartLine);
+	else
+		m_geometry->truncate(m_updateStartLine);
+	RichTextLayout::Result& layout = m_geometry->layout;
+	size_t startLine = layout.lines.empty() ? 0 : m_updateStartLine;
+	m_updateStartLine = std::numeric_limits<size_t>::max();
 
-		bool shouldStop = false;
+	RICHTEXT_TRACE_SCOPE(placementTrace, "place glyphs", startLine, layout.lines.empty() ? 0 : layout.lines[startLine].firstCharacter);
+	InstanceMetrics instanceMetrics(*this);
+	m_style.rewind();
+	m_layoutInProgress = !m_layout.layout(m_document->string, m_document->stylizers, m_style, getLayoutSettings(instanceMetrics), layout, startLine);
+	RICHTEXT_COUNT(stylizersReplayed, m_layout.getStatistics().stylizersReplayed);
+	RICHTEXT_TRACE_ARGUMENT(placementTrace, characters, m_layout.getStatistics().charactersScanned);
+	RICHTEXT_TRACE_END(placementTrace);
+
+	if (m_font) {
+		RICHTEXT_TRACE_SCOPE(verticesTrace, "build vertices", startLine, layout.glyphs.size() - layout.lines[startLine].firstGlyph);
+		moveAlignedVertices();
+		buildVertices(startLine);
+		RICHTEXT_TRACE_END(verticesTrace);
+	}
 
-		switch (currentChar) {
-		case ' ': {
-			if (reachedCharacterLimit) {
-				shouldStop = true;
-				break;
-			}
-			if (wordCharVertices.getVertexCount() > 0) {
-				addWordToText();
-				resetWord();
-				intentionalLineBreak = false;
-			}
+	if (cacheable && !m_layoutInProgress)
+		LayoutCache::instance().insert(cacheKey, m_geometry);
 
-			pos.x += whitespaceWidth;
-			if (intentionalLineBreak) {
-				currentLineWidth = pos.x;
-			}
-			else {
-				whitespaceWidthAtWordStart += whitespaceWidth;
-				whitespacesAtWordStart++;
-			}
-			break;
+	RICHTEXT_COUNT(linesLaidOut, layout.lines.size() - m_counters.lastLayoutStartLine);
+
+	m_shouldUpdateVertices = false;
+	m_geometryVersion++;
+}
+
+bool RichText::replaceVariableGlyphs(size_t start, sf::String const& replaced) {
+	//Only a layout that is up to date, and not published by prepare(), is written to
+	if (isPrepared() || m_shouldUpdateVertices || m_layoutInProgress || (!m_font && !m_metrics) || m_geometry->layout.lines.empty())
+		return false;
+	RICHTEXT_TIME_PHASE(layoutNanoseconds);
+	if (m_geometry.use_count() > 1)
+		m_geometry = std::make_shared<Geometry>(*m_geometry);
+	Geometry& geometry = *m_geometry;
+	RichTextLayout::Result& layout = geometry.layout;
+	if (m_atlas)
+		m_atlas->beginUse();
+	InstanceMetrics instanceMetrics(*this);
+	size_t firstGlyph = RichTextLayout::replaceGlyphs(m_document->string, replaced, start, getLayoutSettings(instanceMetrics), layout);
+	if (firstGlyph == std::numeric_limits<size_t>::max())
+		return false;
+	size_t endGlyph = firstGlyph;
+	for (size_t k = 0; k < replaced.getSize(); k++) {
+		if (replaced[k] != ' ' && replaced[k] != '\t' && replaced[k] != '\n')
+			endGlyph++;
+	}
+
+	//Compact instances build their quads from the glyphs when drawing
+	if (m_font && !m_compactStorage && endGlyph > firstGlyph) {
+		auto after = [](size_t glyph, RichTextLayout::Line const& line) { return glyph < line.firstGlyph; };
+		size_t line = std::upper_bound(layout.lines.begin(), layout.lines.end(), firstGlyph, after) - layout.lines.begin() - 1;
+		RichTextLayout::getGlyphShifts(m_document->string, layout, line, m_glyphShifts);
+		size_t outlineVertex = geometry.lineStart_charOutline[line];
+		for (size_t g = layout.lines[line].firstGlyph; g < firstGlyph; g++) {
+			if (layout.runs[layout.glyphs[g].run].outlineThickness != 0.f)
+				outlineVertex += 6;
 		}
-		case '\t': {
-			if (reachedCharacterLimit) {
-				shouldStop = true;
-				break;
-			}
-			float added = whitespaceWidth*8;
-			added -= fmodf(pos.x + added, whitespaceWidth*8);
-			if (wordCharVertices.getVertexCount() > 0) {
-				addWordToText();
-				resetWord();
-				intentionalLineBreak = false;
+		sf::VertexArray charVertices(sf::Triangles), charOutlineVertices(sf::Triangles);
+		for (size_t g = firstGlyph; g < endGlyph; g++) {
+			charVertices.clear();
+			charOutlineVertices.clear();
+			addGlyphQuads(layout.glyphs[g], m_glyphShifts[g - layout.lines[line].firstGlyph], charVertices, charOutlineVertices);
+			for (size_t j = 0; j < 6; j++)
+				geometry.charVertices[g*6 + j] = charVertices[j];
+			if (charOutlineVertices.getVertexCount() > 0) {
+				for (size_t j = 0; j < 6; j++)
+					geometry.charOutlineVertices[outlineVertex + j] = charOutlineVertices[j];
+				outlineVertex += 6;
 			}
+		}
 
-			pos.x += added;
-			if (intentionalLineBreak) {
-				currentLineWidth = pos.x;
-			}
-			else {
-				whitespaceWidthAtWordStart += added;
-				whitespacesAtWordStart++;
+		//The animation base follows; the vertices are animated again by the next animate()
+		for (Geometry::AnimatedRun const& run : geometry.animatedRuns) {
+			size_t glyphVertices = run.hasOutline ? 12 : 6;
+			for (size_t k = 0; k < run.glyphCount; k++) {
+				size_t g = run.charStart/6 + k;
+				if (g < firstGlyph || g >= endGlyph)
+					continue;
+				size_t base = run.baseStart + k * glyphVertices;
+				for (size_t j = 0; j < 6; j++) {
+					geometry.animationBasePositions[base + j] = geometry.charVertices[g*6 + j].position;
+					if (run.hasOutline)
+						geometry.animationBasePositions[base + 6 + j] = geometry.charOutlineVertices[run.outlineStart + k*6 + j].position;
+				}
 			}
-			break;
 		}
-		case '\n': {
-			if (reachedCharacterLimit) {
-				shouldStop = true;
-				break;
-			}
+	}
 
-			addWordToText();
-			resetWord();
+	RICHTEXT_COUNT(variablesReplaced, 1);
+	m_measurements.clear();
+	m_geometryVersion++;
+	return true;
+}
 
-			if (m_style.underlineds.back()) {
-				addLine(m_lineVertices, underlineStart, pos.x - underlineStart.x, m_style.fillColors.back(), lineThickness);
-				if (hasOutline) {
-					addLine(m_lineOutlineVertices, underlineOutlineStart, pos.x - underlineOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
-				}
+bool RichText::recolor(size_t startLine) const {
+	RichTextLayout::Result const& current = m_geometry->layout;
+	if (startLine >= current.lines.size())
+		return true;
+	if (current.decorations.size() > current.lines[startLine].firstDecoration || current.outlineDecorations.size() > current.lines[startLine].firstOutlineDecoration
+			|| current.firstHiddenCharacter != std::numeric_limits<size_t>::max())
+		return false;
+
+	RICHTEXT_TIME_PHASE(layoutNanoseconds);
+	RICHTEXT_TRACE_SCOPE(trace, "recolor", startLine, m_document->string.getSize());
+	if (m_geometry.use_count() > 1)
+		m_geometry = std::make_shared<Geometry>(*m_geometry);
+	Geometry& geometry = *m_geometry;
+	RichTextLayout::Result& layout = geometry.layout;
+	m_style.rewind();
+	m_layout.recolor(m_document->string, m_document->stylizers, m_style, layout, startLine);
+	RICHTEXT_COUNT(stylizersReplayed, m_layout.getStatistics().stylizersReplayed);
+	RICHTEXT_TRACE_ARGUMENT(trace, characters, m_layout.getStatistics().charactersScanned);
+
+	//Compact instances build their quads from the runs when drawing
+	if (m_font && !m_compactStorage) {
+		size_t outlineVertex = geometry.lineStart_charOutline[startLine];
+		for (size_t g = layout.lines[startLine].firstGlyph; g < layout.glyphs.size(); g++) {
+			RichTextLayout::StyleRun const& run = layout.runs[layout.glyphs[g].run];
+			for (size_t j = 0; j < 6; j++)
+				geometry.charVertices[g*6 + j].color = run.fillColor;
+			if (run.outlineThickness != 0.f) {
+				for (size_t j = 0; j < 6; j++)
+					geometry.charOutlineVertices[outlineVertex + j].color = run.outlineColor;
+				outlineVertex += 6;
 			}
-			if (m_style.strikeThroughs.back()) {
-				addLine(m_lineVertices, strikeThroughStart, pos.x - strikeThroughStart.x, m_style.fillColors.back(), lineThickness);
-				if (hasOutline) {
-					addLine(m_lineOutlineVertices, strikeThroughOutlineStart, pos.x - strikeThroughOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
+		}
+
+		//The animation base follows, its positions being the ones laid out rather than the animated ones in the vertices
+		for (Geometry::AnimatedRun const& animatedRun : geometry.animatedRuns) {
+			size_t base = animatedRun.baseStart;
+			for (size_t k = 0; k < animatedRun.glyphCount; k++) {
+				RichTextLayout::StyleRun const& run = layout.runs[layout.glyphs[animatedRun.charStart/6 + k].run];
+				for (size_t j = 0; j < 6; j++)
+					geometry.animationBaseColors[base++] = run.fillColor;
+				if (animatedRun.hasOutline) {
+					for (size_t j = 0; j < 6; j++)
+						geometry.animationBaseColors[base++] = run.outlineColor;
 				}
 			}
-			pos.x = 0;
-			pos.y += lineSpacing;
+		}
+	}
 
-			underlineStart.x = 0;
-			underlineStart.y += lineSpacing;
-			underlineOutlineStart = underlineStart;
-			strikeThroughStart.x = 0;
-			strikeThroughStart.y += lineSpacing;
-			strikeThroughOutlineStart = strikeThroughStart;
+	m_geometryVersion++;
+	return true;
+}
 
-			currentLineWidth = 0;
-			currentLine++;
-			whitespacesAtWordStart++;
+void RichText::resumeLayout() const {
+	//The line a layout stopped at is still empty, but the word in progress may use style runs after the last glyph's, so everything is kept
+	size_t startLine = m_geometry->layout.lines.size() - 1;
+	if (m_geometry.use_count() > 1)
+		m_geometry = std::make_shared<Geometry>(*m_geometry);
+
+	RICHTEXT_TIME_PHASE(layoutNanoseconds);
+	RICHTEXT_COUNT(layouts, 1);
+	RICHTEXT_SET(lastLayoutStartLine, startLine);
+	RICHTEXT_TRACE_SCOPE(trace, "resume layout", startLine, m_document->string.getSize());
+
+	if (m_atlas)
+		m_atlas->beginUse();
+	RichTextLayout::Result& layout = m_geometry->layout;
+	InstanceMetrics instanceMetrics(*this);
+	m_layoutInProgress = !m_layout.resume(m_document->string, m_document->stylizers, getLayoutSettings(instanceMetrics), layout);
+	RICHTEXT_COUNT(stylizersReplayed, m_layout.getStatistics().stylizersReplayed);
+	RICHTEXT_TRACE_ARGUMENT(trace, characters, m_layout.getStatistics().charactersScanned);
+
+	if (m_font) {
+		moveAlignedVertices();
+		buildVertices(startLine);
+	}
+	RICHTEXT_COUNT(linesLaidOut, layout.lines.size() - startLine);
 
-			setLineStarts();
+	m_updateStartLine = std::numeric_limits<size_t>::max();
+	m_shouldUpdateVertices = false;
+	m_geometryVersion++;
+}
 
-			intentionalLineBreak = true;
-			break;
-		}
-		default: {
-			pos.x += m_font->getKerning(previousChar, m_string[i], m_characterSize);
+void RichText::realignLines() const {
+	if (m_geometry->layout.lines.empty())
+		return;
+	RICHTEXT_TRACE_SCOPE(trace, "align", 0, m_geometry->layout.glyphs.size());
+	if (m_geometry.use_count() > 1)
+		m_geometry = std::make_shared<Geometry>(*m_geometry);
+	InstanceMetrics instanceMetrics(*this);
+	m_layout.align(m_document->string, getLayoutSettings(instanceMetrics), m_geometry->layout);
+	if (m_layout.getFirstMovedLine() == m_geometry->layout.lines.size())
+		return;
+	if (m_font)
+		moveAlignedVertices();
+	m_geometryVersion++;
+}
 
-			sf::Glyph const& g = m_font->getGlyph(m_string[i], m_characterSize, m_style.bolds.back());
-			if (!reachedCharacterLimit) {
-				addGlyphQuad(wordCharVertices, pos, m_style.fillColors.back(), g, italicShear);
+void RichText::moveAlignedVertices() const {
+	Geometry& geometry = *m_geometry;
+	RichTextLayout::Result const& layout = geometry.layout;
+	std::vector<float> const& movements = m_layout.getGlyphMovements();
+	size_t firstLine = m_layout.getFirstMovedLine();
+	if (firstLine >= layout.lines.size() || firstLine >= geometry.lineStart_charOutline.size())
+		return;
+	size_t firstGlyph = layout.lines[firstLine].firstGlyph;
+	size_t endGlyph = firstGlyph + movements.size();
+
+	//Glyph quads and their animation base move with their glyph
+	if (!m_compactStorage) {
+		size_t outlineVertex = geometry.lineStart_charOutline[firstLine];
+		for (size_t g = firstGlyph; g < endGlyph; g++) {
+			float movement = movements[g - firstGlyph];
+			bool hasOutline = layout.runs[layout.glyphs[g].run].outlineThickness != 0.f;
+			for (size_t j = 0; j < 6; j++) {
+				geometry.charVertices[g*6 + j].position.x += movement;
 				if (hasOutline)
-					addGlyphQuad(wordCharOutlineVertices, pos, m_style.outlineColors.back(), m_font->getGlyph(m_string[i], m_characterSize, m_style.bolds.back(), m_style.outlineThicknesses.back()), italicShear, m_style.outlineThicknesses.back());
+					geometry.charOutlineVertices[outlineVertex + j].position.x += movement;
 			}
-			pos.x += g.advance + letterSpacing;
-			i_displayOnly++;
-
-			//Move the word down a line if it became too long
-			if (currentLineWidth != 0.f && pos.x > m_horizontalLimit) {
-				float extendedLineWidth = currentLineWidth + whitespaceWidthAtWordStart;
-				sf::Vector2f wordMovement(-extendedLineWidth, lineSpacingAtWordStart);
-
-				//If a line was in progress and started before the word, finish it before moving on
-				if (!reachedCharacterLimit) {
-					if (m_style.underlineds.back()) {
-						if (underlineStart.x < currentLineWidth) {
-							addLine(m_lineVertices, underlineStart, currentLineWidth - underlineStart.x, m_style.fillColors.back(), lineThickness);
-							underlineStart.x = extendedLineWidth;
-						}
-						if (hasOutline && underlineOutlineStart.x < currentLineWidth) {
-							addLine(m_lineOutlineVertices, underlineOutlineStart, currentLineWidth - underlineOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
-							underlineOutlineStart.x = extendedLineWidth;
-						}
-					}
-					if (m_style.strikeThroughs.back()) {
-						if (strikeThroughStart.x < currentLineWidth) {
-							addLine(m_lineVertices, strikeThroughStart, currentLineWidth - strikeThroughStart.x, m_style.fillColors.back(), lineThickness);
-							strikeThroughStart.x = extendedLineWidth;
-						}
-						if (hasOutline && strikeThroughOutlineStart.x < currentLineWidth) {
-							addLine(m_lineOutlineVertices, strikeThroughOutlineStart, currentLineWidth - strikeThroughOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
-							strikeThroughOutlineStart.x = extendedLineWidth;
-						}
-					}
-				}
+			if (hasOutline)
+				outlineVertex += 6;
+		}
 
-				//If any finished line in the word stemmed from before it, cut it in half at the start of the word (one half will stay, the other will move with the word)
-				for (size_t i = 0; i < wordLineVertices.getVertexCount(); i += 6) {
-					if (wordLineVertices[i].position.x <= currentLineWidth) {
-						for (size_t j = 0; j < 6; j++) {
-							sf::Vertex v = wordLineVertices[i+j];
-							if (j == 1 || j == 4 || j == 5) //Shorten the end of the first half, which will stay on the line
-								v.position.x = roundf(currentLineWidth);
-							else
-								wordLineVertices[i+j].position.x = extendedLineWidth; //Push the beginning of the second, which will go down with the word afterwards
-							m_lineVertices.append(v);
-						}
-					}
+		for (Geometry::AnimatedRun const& run : geometry.animatedRuns) {
+			size_t base = run.baseStart;
+			size_t glyphVertices = run.hasOutline ? 12 : 6;
+			for (size_t k = 0; k < run.glyphCount; k++, base += glyphVertices) {
+				size_t g = run.charStart/6 + k;
+				if (g < firstGlyph || g >= endGlyph)
+					continue;
+				for (size_t j = 0; j < glyphVertices; j++)
+					geometry.animationBasePositions[base + j].x += movements[g - firstGlyph];
+			}
+		}
+	}
 
-					for (size_t j = i; j < i+6; j++) {
-						wordLineVertices[j].position += wordMovement;
-					}
-				}
-				for (size_t i = 0; i < wordLineOutlineVertices.getVertexCount(); i += 6) {
-					if (wordLineOutlineVertices[i].position.x + outlineThicknessAtWordStart <= currentLineWidth) {
-						for (size_t j = 0; j < 6; j++) {
-							sf::Vertex v = wordLineOutlineVertices[i+j];
-
-							if (j == 1 || j == 4 || j == 5)
-								v.position.x = roundf(currentLineWidth + outlineThicknessAtWordStart);
-							else
-								wordLineOutlineVertices[i+j].position.x = extendedLineWidth - outlineThicknessAtWordStart;
-							m_lineOutlineVertices.append(v);
-						}
-					}
+	//Decorations may have been stretched over the gaps of justified lines rather than moved, so they take the ends of the layout
+	for (std::pair<std::vector<RichTextLayout::Decoration> const*, sf::VertexArray*> decorations : { std::make_pair(&layout.decorations, &geometry.lineVertices), std::make_pair(&layout.outlineDecorations, &geometry.lineOutlineVertices) }) {
+		size_t first = decorations.first == &layout.decorations ? layout.lines[firstLine].firstDecoration : layout.lines[firstLine].firstOutlineDecoration;
+		sf::VertexArray& vertices = *decorations.second;
+		for (size_t k = first; k < vertices.getVertexCount() / 6; k++) {
+			RichTextLayout::Decoration const& decoration = (*decorations.first)[k];
+			float ends[6] = { decoration.left, decoration.right, decoration.left, decoration.left, decoration.right, decoration.right }; //In the order of addDecorationQuad()
+			for (size_t j = 0; j < 6; j++)
+				vertices[k*6 + j].position.x = ends[j];
+		}
+	}
+}
 
-					for (size_t j = i; j < i+6; j++) {
-						wordLineOutlineVertices[j].position += wordMovement;
-					}
+void RichText::buildVertices(size_t startLine) const {
+	Geometry& geometry = *m_geometry;
+	RichTextLayout::Result const& layout = geometry.layout;
+
+	//We keep the indices so that the new vertices can be counted at the end
+	size_t startOfNewCharOutlineVertices = geometry.charOutlineVertices.getVertexCount();
+	size_t startOfNewLineVertices = geometry.lineVertices.getVertexCount();
+	size_t startOfNewLineOutlineVertices = geometry.lineOutlineVertices.getVertexCount();
+
+	size_t firstNewAnimatedRun = geometry.animatedRuns.size();
+	geometry.lineStart_charOutline.resize(startLine+1, startOfNewCharOutlineVertices);
+
+	for (size_t line = startLine; line < layout.lines.size(); line++) {
+		if (line > startLine)
+			geometry.lineStart_charOutline.push_back(geometry.charOutlineVertices.getVertexCount());
+		if (m_compactStorage)
+			continue; //The quads of the glyphs in view are built when drawing
+
+		size_t endGlyph = line+1 < layout.lines.size() ? layout.lines[line+1].firstGlyph : layout.glyphs.size();
+		RichTextLayout::getGlyphShifts(m_document->string, layout, line, m_glyphShifts);
+		for (size_t g = layout.lines[line].firstGlyph; g < endGlyph; g++) {
+			RichTextLayout::StyleRun const& run = layout.runs[layout.glyphs[g].run];
+			if (run.effects) {
+				size_t charVertex = geometry.charVertices.getVertexCount();
+				size_t outlineVertex = geometry.charOutlineVertices.getVertexCount();
+				bool hasOutline = run.outlineThickness != 0.f;
+				Geometry::AnimatedRun* animatedRun = geometry.animatedRuns.empty() ? nullptr : &geometry.animatedRuns.back();
+				if (animatedRun && geometry.animatedRuns.size() > firstNewAnimatedRun && animatedRun->effects == run.effects && animatedRun->hasOutline == hasOutline
+						&& animatedRun->charStart + animatedRun->glyphCount*6 == charVertex && (!hasOutline || animatedRun->outlineStart + animatedRun->glyphCount*6 == outlineVertex))
+					animatedRun->glyphCount++;
+				else {
+					size_t baseStart = animatedRun ? animatedRun->baseStart + animatedRun->glyphCount * (animatedRun->hasOutline ? 12 : 6) : 0;
+					geometry.animatedRuns.push_back(Geometry::AnimatedRun { charVertex, outlineVertex, 1, baseStart, run.effects, hasOutline });
 				}
+			}
+			addGlyphQuads(layout.glyphs[g], m_glyphShifts[g - layout.lines[line].firstGlyph], geometry.charVertices, geometry.charOutlineVertices);
+		}
+	}
 
-				for (size_t i = 0; i < wordCharVertices.getVertexCount(); i++) {
-					wordCharVertices[i].position += wordMovement;
-				}
-				for (size_t i = 0; i < wordCharOutlineVertices.getVertexCount(); i++) {
-					wordCharOutlineVertices[i].position += wordMovement;
-				}
+	for (size_t k = startOfNewLineVertices / 6; k < layout.decorations.size(); k++)
+		addDecorationQuad(geometry.lineVertices, layout.decorations[k]);
+	for (size_t k = startOfNewLineOutlineVertices / 6; k < layout.outlineDecorations.size(); k++)
+		addDecorationQuad(geometry.lineOutlineVertices, layout.outlineDecorations[k]);
 
-				pos += wordMovement;
-				underlineStart += wordMovement;
-				underlineOutlineStart += wordMovement;
-				strikeThroughStart += wordMovement;
-				strikeThroughOutlineStart += wordMovement;
+	geometry.captureAnimationBase(firstNewAnimatedRun);
 
-				currentLineWidth = 0;
-				currentLine++;
+	//Published layouts may have no line yet
+	RICHTEXT_COUNT(verticesGenerated, (m_compactStorage || startLine >= layout.lines.size() ? 0 : (layout.glyphs.size() - layout.lines[startLine].firstGlyph) * 6)
+		+ geometry.charOutlineVertices.getVertexCount() - startOfNewCharOutlineVertices
+		+ geometry.lineVertices.getVertexCount() - startOfNewLineVertices + geometry.lineOutlineVertices.getVertexCount() - startOfNewLineOutlineVertices);
+}
+
+void RichText::draw(sf::RenderTarget& target, sf::RenderStates states) const {
+	if (!m_font)
+		return;
+	RICHTEXT_TIME_PHASE(drawNanoseconds);
+	RICHTEXT_TRACE_SCOPE(trace, "draw", 0, m_document->string.getSize());
 
-				setLineStarts();
+	states.transform *= getTransform();
 
-				if (reachedCharacterLimit)
-					shouldStop = true;
-			}
+	if (std::shared_ptr<RichTextScheduler::Registry> scheduler = m_scheduler.registry.lock())
+		scheduler->markDrawn(this);
+	updateVertices();
 
-			break;
-		}
+	if (m_compactStorage)
+		updateVisibleVertices(target, states.transform); //Before flushing the atlas, which may receive new glyphs
+
+	if (m_atlas) {
+		m_atlas->flush();
+		for (size_t shelf = 0; shelf < m_atlasShelves.size(); shelf++) {
+			if (m_atlasShelves[shelf] != 0)
+				m_atlas->touch(shelf);
 		}
+		states.texture = &m_atlas->getTexture();
+	}
+	else
+		states.texture = &m_font->getTexture(m_characterSize);
 
-		if (shouldStop)
-			break;
+	if (m_renderCacheMode != NeverCache && !m_compactStorage && drawFromRenderCache(target, states))
+		return;
 
-		previousChar = m_string[i];
-		i++;
+	drawGeometry(target, states);
+}
+
+void RichText::drawGeometry(sf::RenderTarget& target, sf::RenderStates const& states) const {
+	Geometry const& geometry = *m_geometry;
+	sf::VertexArray const& charVertices = m_compactStorage ? m_visibleCharVertices : geometry.charVertices;
+	sf::VertexArray const& charOutlineVertices = m_compactStorage ? m_visibleCharOutlineVertices : geometry.charOutlineVertices;
+	bool splitByFont = splitVerticesByFont();
+
+	//Glyphs of each font and size are drawn with the texture of their font at their size, decorations with the main font's
+	sf::RenderStates fontStates = states;
+	if (!splitByFont && charOutlineVertices.getVertexCount() > 0)
+		target.draw(charOutlineVertices, states);
+	for (size_t batch = 0; batch < m_fontCharOutlineVertices.size(); batch++) {
+		fontStates.texture = &getChainFont(m_fontBatches[batch].first).getTexture(m_fontBatches[batch].second);
+		if (m_fontCharOutlineVertices[batch].getVertexCount() > 0)
+			target.draw(m_fontCharOutlineVertices[batch], fontStates);
 	}
+	if (geometry.lineOutlineVertices.getVertexCount() > 0)
+		target.draw(geometry.lineOutlineVertices, states);
+	if (!splitByFont && charVertices.getVertexCount() > 0)
+		target.draw(charVertices, states);
+	for (size_t batch = 0; batch < m_fontCharVertices.size(); batch++) {
+		fontStates.texture = &getChainFont(m_fontBatches[batch].first).getTexture(m_fontBatches[batch].second);
+		if (m_fontCharVertices[batch].getVertexCount() > 0)
+			target.draw(m_fontCharVertices[batch], fontStates);
+	}
+	if (geometry.lineVertices.getVertexCount() > 0)
+		target.draw(geometry.lineVertices, states);
+}
 
-	if (!reachedCharacterLimit) {
-		float excessWhiteSpace = wordCharVertices.getVertexCount() == 0 ? whitespaceWidthAtWordStart : 0;
-		if (m_style.underlineds.back()) {
-			addLine(wordLineVertices, underlineStart, pos.x - underlineStart.x - excessWhiteSpace, m_style.fillColors.back(), lineThickness);
-			if (hasOutline)
-				addLine(wordLineOutlineVertices, underlineOutlineStart, pos.x - underlineOutlineStart.x - excessWhiteSpace, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
+bool RichText::splitVerticesByFont() const {
+	Geometry const& geometry = *m_geometry;
+	RichTextLayout::Result const& layout = geometry.layout;
+	size_t firstGlyph = m_compactStorage ? m_visibleFirstGlyph : 0;
+	size_t endGlyph = m_compactStorage ? m_visibleEndGlyph : layout.glyphs.size();
+	if (m_fontSplitVersion == m_geometryVersion && m_fontSplitFirstGlyph == firstGlyph && m_fontSplitEndGlyph == endGlyph)
+		return !m_fontCharVertices.empty();
+	m_fontSplitVersion = m_geometryVersion;
+	m_fontSplitFirstGlyph = firstGlyph;
+	m_fontSplitEndGlyph = endGlyph;
+
+	m_fontCharVertices.clear();
+	m_fontCharOutlineVertices.clear();
+	m_fontBatches.clear();
+	auto batchOf = [this](RichTextLayout::StyleRun const& run) {
+		return std::make_pair(run.font <= m_fallbackFonts.size() ? static_cast<unsigned int>(run.font) : 0u, static_cast<unsigned int>(run.characterSize));
+	};
+	auto elsewhere = [&](RichTextLayout::StyleRun const& run) { return batchOf(run) != std::make_pair(0u, m_characterSize); };
+	if (m_atlas || std::none_of(layout.runs.begin(), layout.runs.end(), elsewhere)) //An atlas holds every size on its texture
+		return false;
+
+	//The quads are in glyph order, outline quads only for the glyphs of runs with an outline
+	RICHTEXT_TRACE_SCOPE(trace, "split by font", 0, endGlyph - firstGlyph);
+	sf::VertexArray const& charVertices = m_compactStorage ? m_visibleCharVertices : geometry.charVertices;
+	sf::VertexArray const& charOutlineVertices = m_compactStorage ? m_visibleCharOutlineVertices : geometry.charOutlineVertices;
+	size_t outlineVertex = 0;
+	sf::Uint32 lastRun = std::numeric_limits<sf::Uint32>::max();
+	size_t batch = 0;
+	for (size_t g = firstGlyph; g < endGlyph && (g - firstGlyph)*6 < charVertices.getVertexCount(); g++) {
+		RichTextLayout::StyleRun const& run = layout.runs[layout.glyphs[g].run];
+		if (layout.glyphs[g].run != lastRun) {
+			lastRun = layout.glyphs[g].run;
+			batch = std::find(m_fontBatches.begin(), m_fontBatches.end(), batchOf(run)) - m_fontBatches.begin();
+			if (batch == m_fontBatches.size()) {
+				m_fontBatches.push_back(batchOf(run));
+				m_fontCharVertices.emplace_back(sf::Triangles);
+				m_fontCharOutlineVertices.emplace_back(sf::Triangles);
+			}
 		}
-		if (m_style.strikeThroughs.back()) {
-			addLine(wordLineVertices, strikeThroughStart, pos.x - strikeThroughStart.x - excessWhiteSpace, m_style.fillColors.back(), lineThickness);
-			if (hasOutline)
-				addLine(wordLineOutlineVertices, strikeThroughOutlineStart, pos.x - strikeThroughOutlineStart.x - excessWhiteSpace, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
+		for (size_t j = 0; j < 6; j++)
+			m_fontCharVertices[batch].append(charVertices[(g - firstGlyph)*6 + j]);
+		if (run.outlineThickness != 0.f && outlineVertex < charOutlineVertices.getVertexCount()) {
+			for (size_t j = 0; j < 6; j++)
+				m_fontCharOutlineVertices[batch].append(charOutlineVertices[outlineVertex++]);
 		}
 	}
+	return true;
+}
 
-	addWordToText();
+std::atomic<size_t> renderCacheMemoryUsage(0);
+std::atomic<size_t> renderCacheMemoryCap(64 * 1024 * 1024);
 
-	roundNewVertices(m_charVertices, startOfNewCharVertices);
-	roundNewVertices(m_charOutlineVertices, startOfNewCharOutlineVertices);
-	roundNewVertices(m_lineVertices, startOfNewLineVertices);
-	roundNewVertices(m_lineOutlineVertices, startOfNewLineOutlineVertices);
+bool RichText::drawFromRenderCache(sf::RenderTarget& target, sf::RenderStates const& states) const {
+	if (m_renderCacheVersion != m_geometryVersion) {
+		m_renderCache.reset();
+		m_renderCacheVersion = m_geometryVersion;
+		m_unchangedFrames = 0;
+	}
+	else
+		m_unchangedFrames++;
+
+	//The cached texture holds premultiplied colors, which only blend correctly in place of regular alpha blending
+	if (states.shader || !(states.blendMode == sf::BlendAlpha))
+		return false;
+
+	if (!m_renderCache) {
+		if (m_renderCacheMode == AutomaticCache && (m_unchangedFrames < m_renderCacheFrames || m_geometry->layout.glyphs.size() < m_renderCacheMinimumGlyphs))
+			return false;
+
+		sf::FloatRect const& bounds = m_geometry->layout.bounds;
+		if (bounds.width <= 0 || bounds.height <= 0)
+			return false;
+		unsigned int width = static_cast<unsigned int>(std::ceil(bounds.width));
+		unsigned int height = static_cast<unsigned int>(std::ceil(bounds.height));
+		size_t bytes = static_cast<size_t>(width) * height * 4;
+		if (renderCacheMemoryUsage + bytes > renderCacheMemoryCap)
+			return false;
+
+		std::shared_ptr<sf::RenderTexture> cache(new sf::RenderTexture(), [bytes](sf::RenderTexture* texture) {
+			renderCacheMemoryUsage -= bytes;
+			delete texture;
+		});
+		renderCacheMemoryUsage += bytes;
+		if (!cache->create(width, height))
+			return false;
+
+		sf::RenderStates cacheStates(states.texture);
+		cacheStates.transform.translate(-bounds.left, -bounds.top);
+		cacheStates.blendMode = sf::BlendMode(sf::BlendMode::SrcAlpha, sf::BlendMode::OneMinusSrcAlpha, sf::BlendMode::Add,
+											  sf::BlendMode::One, sf::BlendMode::OneMinusSrcAlpha, sf::BlendMode::Add);
+		cache->clear(sf::Color::Transparent);
+		drawGeometry(*cache, cacheStates);
+		cache->display();
+		m_renderCache = cache;
+	}
 
-	//Compute bounds; in a square of 6 vertices, the first one is the upper left and the last one the bottom right
-	float minX = std::numeric_limits<float>::infinity(), minY = std::numeric_limits<float>::infinity(),
-		  maxX = std::numeric_limits<float>::lowest(),	 maxY = std::numeric_limits<float>::lowest();
+	sf::Sprite quad(m_renderCache->getTexture());
+	quad.setPosition(m_geometry->layout.bounds.left, m_geometry->layout.bounds.top);
+	sf::RenderStates quadStates(states);
+	quadStates.texture = nullptr;
+	quadStates.blendMode = sf::BlendMode(sf::BlendMode::One, sf::BlendMode::OneMinusSrcAlpha);
+	target.draw(quad, quadStates);
+	return true;
+}
 
-	sf::VertexArray const* arrays[4] { &m_charVertices, &m_lineVertices, &m_charOutlineVertices, &m_lineOutlineVertices };
-	for (size_t i = 0; i < 4; i++) {
-		sf::VertexArray const& a = *arrays[i];
-		for (size_t j = 0; j < a.getVertexCount(); j+=6) {
-			minX = fminf(minX, a[j].position.x);
-			minY = fminf(minY, a[j].position.y);
-			maxX = fmaxf(maxX, a[j+5].position.x);
-			maxY = fmaxf(maxY, a[j+5].position.y);
-		}
-	}
+void RichText::setRenderCacheMode(RenderCacheMode mode) {
+	m_renderCacheMode = mode;
+	if (mode == NeverCache)
+		m_renderCache.reset();
+}
 
-	m_bounds.top = minY;
-	m_bounds.left = minX;
-	m_bounds.width = maxX - minX;
-	m_bounds.height = maxY - minY;
+RichText::RenderCacheMode RichText::getRenderCacheMode() const { return m_renderCacheMode; }
 
-	m_style.rewind();
+void RichText::setRenderCachePolicy(unsigned int unchangedFrames, size_t minimumGlyphs) {
+	m_renderCacheFrames = unchangedFrames;
+	m_renderCacheMinimumGlyphs = minimumGlyphs;
+}
 
-	m_shouldUpdateVertices = false;
+bool RichText::isRenderCached() const { return m_renderCache && m_renderCacheVersion == m_geometryVersion; }
+void RichText::setRenderCacheMemoryCap(size_t bytes) { renderCacheMemoryCap = bytes; }
+size_t RichText::getRenderCacheMemoryUsage() { return renderCacheMemoryUsage; }
+
+#ifdef RICHTEXT_PERFORMANCE_COUNTERS
+RichText::PerformanceCounters const& RichText::getPerformanceCounters() const {
+	if (std::shared_ptr<Geometry> prepared = std::atomic_load(&m_preparedGeometry))
+		mergePreparedCounters(*prepared);
+	return m_counters;
 }
 
-void RichText::draw(sf::RenderTarget& target, sf::RenderStates states) const {
-	if (!m_font)
+void RichText::resetPerformanceCounters() {
+	if (std::shared_ptr<Geometry> prepared = std::atomic_load(&m_preparedGeometry))
+		mergePreparedCounters(*prepared); //Still added to the global counters
+	m_counters = PerformanceCounters();
+}
+
+void RichText::mergePreparedCounters(Geometry const& prepared) const {
+	//Prepared geometries count every prepare() since the instance was first prepared; what the last merge left out is added
+	PerformanceCounters const& counters = prepared.preparedCounters;
+	if (counters.layouts == m_mergedCounters.layouts && counters.layoutNanoseconds == m_mergedCounters.layoutNanoseconds)
 		return;
+	addCounters(m_counters, counters, m_mergedCounters);
+	if (m_countersDepth == 0) { //Otherwise the phase in progress adds them
+		std::lock_guard<std::mutex> lock(globalCountersMutex);
+		addCounters(globalCounters, counters, m_mergedCounters);
+	}
+	m_mergedCounters = counters;
+}
 
-	states.transform *= getTransform();
-	states.texture = &m_font->getTexture(m_characterSize);
+RichText::PerformanceCounters RichText::getGlobalPerformanceCounters() {
+	std::lock_guard<std::mutex> lock(globalCountersMutex);
+	return globalCounters;
+}
 
-	if (m_shouldUpdateVertices)
-		updateVertices();
+void RichText::resetGlobalPerformanceCounters() {
+	std::lock_guard<std::mutex> lock(globalCountersMutex);
+	globalCounters = PerformanceCounters();
+}
+#else
+RichText::PerformanceCounters const& RichText::getPerformanceCounters() const {
+	static const PerformanceCounters none;
+	return none;
+}
+void RichText::resetPerformanceCounters() {}
+RichText::PerformanceCounters RichText::getGlobalPerformanceCounters() { return PerformanceCounters(); }
+void RichText::resetGlobalPerformanceCounters() {}
+#endif
+
+#ifdef RICHTEXT_TRACING
+bool RichText::saveTrace(std::string const& filename) {
+	std::ofstream file(filename);
+	if (!file)
+		return false;
+
+	file << "{\"traceEvents\":[" << std::fixed << std::setprecision(3);
+	bool first = true;
+	std::lock_guard<std::mutex> lock(traceBuffersMutex);
+	for (std::shared_ptr<TraceBuffer> const& buffer : traceBuffers) {
+		size_t recorded = buffer->recorded.load(std::memory_order_acquire);
+		size_t k = std::max(buffer->cleared, recorded - std::min(recorded, TraceBuffer::capacity));
+		for (; k < recorded; k++) {
+			TraceEvent const& event = buffer->events[k % TraceBuffer::capacity];
+			file << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread
+				 << ",\"ts\":" << event.start / 1000.0 << ",\"dur\":" << event.duration / 1000.0
+				 << ",\"args\":{\"instance\":\"" << event.instance << "\",\"startLine\":" << event.startLine << ",\"characters\":" << event.characters << "}}";
+			first = false;
+		}
+	}
+	file << "\n]}\n";
+	return static_cast<bool>(file);
+}
+
+void RichText::clearTrace() {
+	std::lock_guard<std::mutex> lock(traceBuffersMutex);
+	for (std::shared_ptr<TraceBuffer> const& buffer : traceBuffers)
+		buffer->cleared = buffer->recorded.load(std::memory_order_acquire);
+}
+#else
+bool RichText::saveTrace(std::string const&) { return false; }
+void RichText::clearTrace() {}
+#endif
 
-	if (m_charOutlineVertices.getVertexCount() > 0)
-		target.draw(m_charOutlineVertices, states);
-	if (m_lineOutlineVertices.getVertexCount() > 0)
-		target.draw(m_lineOutlineVertices, states);
-	if (m_charVertices.getVertexCount() > 0)
-		target.draw(m_charVertices, states);
-	if (m_lineVertices.getVertexCount() > 0)
-		target.draw(m_lineVertices, states);
-}
-
-RichText::VariableStyle::VariableStyle() {
-	bolds.push_back(false);
-	italics.push_back(false);
-	underlineds.push_back(false);
-	strikeThroughs.push_back(false);
-	fillColors.push_back(sf::Color::Black);
-	outlineThicknesses.push_back(0.f);
-	outlineColors.push_back(sf::Color::White);
-	letterSpacingFactors.push_back(1.f);
-	lineSpacingFactors.push_back(1.f);
-}
-
-void RichText::VariableStyle::rewind() {
-	while (bolds.size() > 1)
-		bolds.pop_back();
-	while (italics.size() > 1)
-		italics.pop_back();
-	while (underlineds.size() > 1)
-		underlineds.pop_back();
-	while (strikeThroughs.size() > 1)
-		strikeThroughs.pop_back();
-	while (fillColors.size() > 1)
-		fillColors.pop_back();
-	while (outlineThicknesses.size() > 1)
-		outlineThicknesses.pop_back();
-	while (outlineColors.size() > 1)
-		outlineColors.pop_back();
-	while (letterSpacingFactors.size() > 1)
-		letterSpacingFactors.pop_back();
-	while (lineSpacingFactors.size() > 1)
-		lineSpacingFactors.pop_back();
+RichText::MemoryUsage RichText::getMemoryUsage() const {
+	updateVertices();
+
+	MemoryUsage usage;
+	usage.text = m_document->string.getSize() * sizeof(sf::Uint32);
+	usage.stylizers = m_document->stylizers.size() * (mapNodeSize + sizeof(StarterStylizer<sf::Color>));
+	for (auto const& modifiable : m_document->modifiableStylizers)
+		usage.stylizers += mapNodeSize + sizeof(modifiable.second) + modifiable.second.capacity() * sizeof(Stylizer*);
+	usage.geometry = m_geometry->getMemoryUsage();
+	std::shared_ptr<Geometry> prepared = std::atomic_load(&m_preparedGeometry);
+	if (prepared && prepared != m_geometry)
+		usage.geometry += prepared->getMemoryUsage();
+	usage.drawBuffers = (m_visibleCharVertices.getVertexCount() + m_visibleCharOutlineVertices.getVertexCount()) * sizeof(sf::Vertex);
+	for (size_t batch = 0; batch < m_fontCharVertices.size(); batch++)
+		usage.drawBuffers += (m_fontCharVertices[batch].getVertexCount() + m_fontCharOutlineVertices[batch].getVertexCount()) * sizeof(sf::Vertex);
+	if (m_renderCache)
+		usage.renderCache = static_cast<size_t>(m_renderCache->getSize().x) * m_renderCache->getSize().y * 4;
+	usage.total = usage.text + usage.stylizers + usage.geometry + usage.drawBuffers + usage.renderCache;
+	return usage;
 }
 
 template <>
@@ -1260,6 +3097,12 @@ RichText::SpecializedStylizer<bool>::SpecializedStylizer(Stylizer::StyleProperty
 		m_styleMember = &VariableStyle::underlineds; break;
 	case StrikeThrough:
 		m_styleMember = &VariableStyle::strikeThroughs; break;
+	case Wave:
+		m_styleMember = &VariableStyle::waves; break;
+	case Shake:
+		m_styleMember = &VariableStyle::shakes; break;
+	case Pulse:
+		m_styleMember = &VariableStyle::pulses; break;
 	default:
 		break;
 	}
@@ -1274,6 +3117,8 @@ RichText::SpecializedStylizer<float>::SpecializedStylizer(Stylizer::StylePropert
 		m_styleMember = &VariableStyle::letterSpacingFactors; break;
 	case LineSpacing:
 		m_styleMember = &VariableStyle::lineSpacingFactors; break;
+	case CharacterSize:
+		m_styleMember = &VariableStyle::characterSizes; break;
 	default:
 		break;
 	}
@@ -1307,7 +3152,17 @@ RichText::Stylizer::StyleProperty RichText::EnderStylizer<T>::stylize(VariableSt
 }
 
 template<class T>
-RichText::StarterStylizer<T>::StarterStylizer(Stylizer::StyleProperty type) : SpecializedStylizer<T>(type), activated(false) {}
+sf::Uint64 RichText::EnderStylizer<T>::hash() const {
+	sf::Uint64 hash = 14695981039346656037ull;
+	hashValue(hash, this->m_type);
+	return hash;
+}
+
+template<class T>
+RichText::Stylizer* RichText::EnderStylizer<T>::clone() const { return new EnderStylizer<T>(*this); }
+
+template<class T>
+RichText::StarterStylizer<T>::StarterStylizer(Stylizer::StyleProperty type) : SpecializedStylizer<T>(type), activated(false), m_value() {}
 
 template<class T>
 RichText::StarterStylizer<T>::StarterStylizer(Stylizer::StyleProperty type, T value) : SpecializedStylizer<T>(type), activated(true), m_value(value) {}
@@ -1328,8 +3183,24 @@ RichText::Stylizer::StyleProperty RichText::StarterStylizer<T>::stylize(Variable
 	}
 }
 
+template<class T>
+sf::Uint64 RichText::StarterStylizer<T>::hash() const {
+	sf::Uint64 hash = 14695981039346656037ull;
+	hashValue(hash, this->m_type);
+	hashValue(hash, activated);
+	if (activated)
+		hashValue(hash, m_value);
+	return hash;
+}
+
+template<class T>
+RichText::Stylizer* RichText::StarterStylizer<T>::clone() const { return new StarterStylizer<T>(*this); }
+
 template<class T>
 void RichText::StarterStylizer<T>::setValue(T value) {
 	m_value = value;
 	activated = true;
 }
+
+template<class T>
+T const& RichText::StarterStylizer<T>::getValue() const { return m_value; }
@@ -3,20 +3,46 @@
 
 #include <SFML/Graphics.hpp>
 #include <map>
+#include <unordered_map>
 #include <deque>
+#include <memory>
+#include <iosfwd>
+#include "glyphatlas.h"
+#include "richtextlayout.h"
+#include "richtextscheduler.h"
 
 class RichText : public sf::Drawable, public sf::Transformable
 {
 public:
 	RichText();
 	RichText(sf::Font const& font, sf::String const& string, uint characterSize = 20);
+	RichText(RichText const&) = default;
+	RichText(RichText&& other);
+	RichText& operator=(RichText const&) = default;
+	RichText& operator=(RichText&& other);
 	~RichText();
+	//Copies are cheap: they share the parsed string, stylizers and vertices until one of them is modified; a moved-from text is
+	//left empty with its settings
 	
+	//A new text is laid out again from the line where it starts differing from the previous one (in characters or styles); the markup
+	//parsed last, when nothing was modified by ID since, is not parsed again
 	void parseString(sf::String const& s, bool append = false);
 	sf::String const& getParsedString() const;
 	
+	//Text of the <var=name> tags, which the parsed string holds as plain text. A new value isn't parsed: when its glyphs take the room of the
+	//ones they replace (digits do with setTabularDigits()), they're replaced where they are; otherwise the text is laid out again from its line
+	void setVariable(std::string const& name, sf::String const& value);
+	sf::String getVariable(std::string const& name) const; //Empty if never set
+	
 	void setFont(sf::Font const& font);
 	void setCharacterSize(uint size);
+	void setGlyphAtlas(GlyphAtlas* atlas); //Takes the glyphs from the atlas instead of the font's texture; nullptr to stop
+	//Lays out with the metrics of the provider instead of the font's, e.g. a RichTextLayout::MetricsTable so that no GL context is needed
+	//until drawing. Drawing still takes the glyphs from the font, which the provider should describe; nullptr to stop
+	void setMetricsProvider(RichTextLayout::MetricsProvider const* metrics);
+	//Fonts the glyphs missing from the font are taken from, the first one that has a glyph winning; they must outlive the instance.
+	//Glyphs are drawn in one batch per font. Ignored with a glyph atlas; a metrics provider should be captured with the same fallbacks
+	void setFallbackFonts(std::vector<sf::Font const*> const& fonts);
 	
 	void setStyle(sf::Uint32 style);
 	void setStyle(int ID, sf::Uint32 style);
@@ -42,8 +68,57 @@ public:
 	void setLineSpacingFactor(int ID, float factor);
 	void setLineSpacingFactor(int ID, bool activated);
 	
+	//Sizes of <sz> tags, whose glyphs are drawn from the texture of their size: one draw call per size used. Lines move down to fit
+	//glyphs larger than the instance's size
+	void setCharacterSize(int ID, uint size);
+	void setCharacterSize(int ID, bool activated);
+	
+	//Tags may be given a name instead of a number (<c=red,id=warning>), which stands for the ID returned here: the same in every instance,
+	//and negative, while numbers written in tags must be 0 or more
+	static int getID(std::string const& name);
+	
+	//Changes to the tags of many IDs, made by apply() in one go: the lines to lay out again are found once for all of them, and changes
+	//of colours alone only recolor the glyphs already laid out, unless they are underlined or struck through
+	class Batch {
+	public:
+		void setStyle(int ID, sf::Uint32 style);
+		void setStyle(int ID, sf::Uint32 style, bool activated);
+		void setFillColor(int ID, sf::Color color);
+		void setFillColor(int ID, bool activated);
+		void setOutlineThickness(int ID, float thickness);
+		void setOutlineThickness(int ID, bool activated);
+		void setOutlineColor(int ID, sf::Color color);
+		void setOutlineColor(int ID, bool activated);
+		void setLetterSpacingFactor(int ID, float factor);
+		void setLetterSpacingFactor(int ID, bool activated);
+		void setLineSpacingFactor(int ID, float factor);
+		void setLineSpacingFactor(int ID, bool activated);
+		void setCharacterSize(int ID, uint size);
+		void setCharacterSize(int ID, bool activated);
+		
+		void clear();
+		bool isEmpty() const;
+		
+	private:
+		friend class RichText;
+		struct Change {
+			int ID;
+			RichTextLayout::Stylizer::StyleProperty property; //None for the style flags of setStyle()
+			bool setsActivation; //Rather than the value
+			bool activated;
+			sf::Uint32 style; //Flags set, or activated
+			sf::Color color;
+			float number;
+		};
+		std::vector<Change> m_changes;
+	};
+	void apply(Batch const& batch);
+	
 	sf::Font const& getFont() const;
 	uint getCharacterSize() const;
+	GlyphAtlas* getGlyphAtlas() const;
+	std::vector<sf::Font const*> const& getFallbackFonts() const;
+	RichTextLayout::MetricsProvider const* getMetricsProvider() const;
 	sf::Uint32 getStyle() const;
 	sf::Color getFillColor() const;
 	float getOutlineThickness() const;
@@ -54,50 +129,183 @@ public:
 	void setHorizontalLimit(float limit);
 	float getHorizontalLimit() const;
 	
+	//Aligns the lines within the horizontal limit, or within the widest line without one (see RichTextLayout::Alignment).
+	//Changing it only moves the lines laid out, without laying them out again
+	void setAlignment(RichTextLayout::Alignment alignment);
+	RichTextLayout::Alignment getAlignment() const;
+	
+	//Digits 0 to 9 advance by the widest one's advance and aren't kerned, so that numbers with as many digits take the same room
+	void setTabularDigits(bool tabular);
+	bool getTabularDigits() const;
+	
 	void setCharacterLimit(size_t limit);
 	size_t getCharacterLimit() const;
 	size_t getMaxEffectiveCharacterLimit() const;
 	
+	//Shows at most that many lines, ending the last one with the ellipsis when the text goes on past it. The layout stops there, so that
+	//its cost follows the lines shown rather than the length of the text. std::numeric_limits<size_t>::max() shows every line
+	void setMaxLines(size_t lines, sf::String const& ellipsis = "...");
+	size_t getMaxLines() const;
+	sf::String const& getEllipsis() const;
+	bool isTruncated() const; //Whether the line limit left text out
+	
+	//Log mode, for texts appended to line by line: once the text has an eighth more lines (separated by '\n') than that, parseString() drops the
+	//oldest ones down to it in one go. What is kept moves up by whole pixels with its glyphs, vertices and stylizers rather than being laid out
+	//again, and tags still open where it starts stay open. std::numeric_limits<size_t>::max() keeps every line
+	void setLogCapacity(size_t lines);
+	size_t getLogCapacity() const;
+	
 	sf::FloatRect findCharacterBounds(size_t index) const;
+	RichTextLayout::Result const& getLayout() const; //Glyph placements, decorations and lines, as laid out for the vertices; valid until the next layout
+	
+	//Size the local bounds would have with maxWidth as the horizontal limit, found by breaking the lines and measuring the glyphs only:
+	//nothing of the instance is laid out or built. The last few widths measured are remembered until the next change
+	struct Measurement {
+		sf::Vector2f size;
+		size_t lineCount = 0;
+		float baseline = 0.f; //Of the first line, from the top of the bounds
+	};
+	Measurement measure(float maxWidth) const;
+	
+	//Glyphs inside <wave>, <shake> and <pulse> tags are recorded during layout; animate() moves and recolors only them
+	struct AnimationParameters {
+		float waveAmplitude = 4.f; //In pixels
+		float waveSpeed = 6.f; //In radians per second
+		float waveSpacing = 0.6f; //Phase difference between neighbouring glyphs, in radians
+		float shakeAmplitude = 1.5f; //In pixels
+		float shakeRate = 20.f; //New offsets per second
+		float pulseDepth = 0.6f; //Fraction of the opacity lost at the bottom of a pulse
+		float pulseSpeed = 4.f; //In radians per second
+	};
+	
+	void setAnimationParameters(AnimationParameters const& parameters);
+	AnimationParameters const& getAnimationParameters() const;
+	void animate(float time); //Time in seconds; lays out first if needed, but never breaks lines itself
+	bool isAnimated() const;
 
 	sf::FloatRect getLocalBounds() const;
 	sf::FloatRect getGlobalBounds() const;	
 	
-private:
-	sf::Font const* m_font;
-	sf::String m_string;
-	uint m_characterSize;
+	//Lays out into a back buffer, then publishes it atomically. Once an instance was prepared, nothing lays out lazily anymore: draw() only
+	//builds the vertices of the last published layout and the const queries only read it, so prepare() can run on a worker thread while the
+	//render thread draws. Without a metrics provider (see setMetricsProvider()), prepare() uses the font and must stay on the render thread.
+	//Setters must not run concurrently with prepare(), draw() or the const queries; until the next prepare(), draw() shows the last published layout.
+	void prepare();
+	bool isPrepared() const;
 	
-	class VariableStyle {
-	public:
-		VariableStyle();		
-		void rewind();
-		
-		std::deque<bool> bolds;
-		std::deque<bool> italics;
-		std::deque<bool> underlineds;
-		std::deque<bool> strikeThroughs;
-		std::deque<sf::Color> fillColors;
-		std::deque<float> outlineThicknesses;
-		std::deque<sf::Color> outlineColors;
-		std::deque<float> letterSpacingFactors;
-		std::deque<float> lineSpacingFactors;
+	//Progressive layout of long texts: a layout stops at the start of a line once it reached that many new lines, or after that long (in
+	//seconds), and the next one (by draw(), prepare(), or a query that lays out like getLocalBounds()) continues it with the state it stopped
+	//with. Meanwhile the lines laid out so far are drawn and getLocalBounds() covers only them. 0 for no limit
+	void setLayoutBudget(size_t lines, float time = 0.f);
+	size_t getLayoutLineBudget() const;
+	float getLayoutTimeBudget() const;
+	bool isLayoutComplete() const; //False while a progressive layout hasn't reached the end of the text
+	float getLayoutProgress() const; //Fraction of the parsed string laid out so far
+	
+	//Leaves the layouts to the scheduler (see RichTextScheduler): the instance becomes prepared at once, still showing what was laid out so far.
+	//Copies are attached to the same scheduler, while assignments keep the scheduler of the destination. nullptr to stop; the instance stays
+	//prepared and must then be prepared by hand
+	void setScheduler(RichTextScheduler* scheduler);
+	RichTextScheduler* getScheduler() const;
+	
+	//Process-wide cache of laid-out geometry, shared between instances with identical content, font, size and width
+	struct LayoutCacheStats {
+		size_t hits = 0;
+		size_t misses = 0;
+		size_t evictions = 0;
+		size_t entries = 0;
+		size_t memoryUsage = 0; //In bytes
+		size_t memoryCap = 0;
 	};
 	
-	class Stylizer {
-	public:
-		enum StyleProperty { None, Bold, Italic, Underlined, StrikeThrough, FillColor, OutlineThickness, OutlineColor, LetterSpacing, LineSpacing };
-		
-		Stylizer(StyleProperty const& type) : m_type(type) {}
-		virtual ~Stylizer() {}
-		virtual StyleProperty stylize(VariableStyle& vs) const = 0; //Return is not necessarily m_type (stylize() computes if the change to vs was visually noticeable)
-		StyleProperty getType() const { return m_type; }
-		
-		size_t line = std::numeric_limits<size_t>::max(); //At what line was the stylizer last sighted
-		
-	protected:
-		StyleProperty m_type;
+	static void setLayoutCacheEnabled(bool enabled);
+	static bool isLayoutCacheEnabled();
+	static void setLayoutCacheMemoryCap(size_t bytes);
+	static LayoutCacheStats getLayoutCacheStats();
+	static void clearLayoutCache();
+	
+	//Parsed string and layout of a static text, saved to a file that later runs load instead of parsing and laying out the markup again.
+	//The file is keyed by the markup, the font's metrics, the settings the layout depends on (size, width, alignment, limits, style) and the
+	//values of its variables, which must be set before loading: when the key doesn't match, loadSnapshot() parses the markup as usual and returns false.
+	//Vertices are built again when loading, as texture coordinates depend on what the font's texture holds. Files are in the native
+	//byte order and layout of the machine that saved them
+	bool saveSnapshot(std::string const& filename, sf::String const& markup) const; //markup must be what the instance parsed; false until the layout is complete
+	bool loadSnapshot(std::string const& filename, sf::String const& markup);
+	
+	//Rarely changing instances can be rendered once to a texture and then drawn as a single quad until their geometry changes.
+	//In automatic mode, an instance is cached once it has stayed unchanged for a number of frames and has enough glyphs.
+	enum RenderCacheMode { NeverCache, AutomaticCache, AlwaysCache };
+	void setRenderCacheMode(RenderCacheMode mode);
+	RenderCacheMode getRenderCacheMode() const;
+	void setRenderCachePolicy(unsigned int unchangedFrames, size_t minimumGlyphs);
+	bool isRenderCached() const;
+	static void setRenderCacheMemoryCap(size_t bytes); //Total for all instances
+	static size_t getRenderCacheMemoryUsage();
+	
+	//Rasterizes glyphs ahead of time (e.g. during a loading screen) so that layouts don't have to update the font texture mid-frame.
+	//Only the bold flag of styles and the outline thicknesses change the rasterized glyphs.
+	static void prewarm(sf::Font const& font, sf::String const& charset, std::vector<uint> const& sizes, std::vector<sf::Uint32> const& styles = { sf::Text::Regular }, std::vector<float> const& outlineThicknesses = { 0.f });
+	void prewarm() const; //Rasterizes every glyph/style combination the parsed string needs
+	void setPrewarmOnParse(bool prewarmOnParse); //If true, parseString() calls prewarm() on what it parsed
+	bool getPrewarmOnParse() const;
+	size_t getColdGlyphMisses() const; //Glyphs that had to be rasterized during the last layout
+	
+	//Compact storage keeps a 16 bytes record per glyph (pen position, code point and style run) instead of its quads,
+	//and builds the quads of the lines in view only when drawing. Meant for large documents; compact instances are never
+	//animated nor render cached. Enabled by default in builds defining RICHTEXT_COMPACT_STORAGE.
+	void setCompactStorage(bool compact);
+	bool getCompactStorage() const;
+	
+	struct MemoryUsage { //In bytes, approximate
+		size_t text = 0;
+		size_t stylizers = 0;
+		size_t geometry = 0; //Laid out glyphs, lines and line starts; geometry shared through the layout cache is counted by every instance using it
+		size_t drawBuffers = 0; //Quads built for drawing in compact mode, or split by font
+		size_t renderCache = 0;
+		size_t total = 0;
 	};
+	MemoryUsage getMemoryUsage() const;
+	
+	//Work done by instances, to find out what makes a frame slow. Only counted in builds defining RICHTEXT_PERFORMANCE_COUNTERS; always zero otherwise
+	struct PerformanceCounters {
+		size_t parses = 0;
+		size_t charactersParsed = 0; //Tags included
+		size_t layouts = 0;
+		size_t fullLayouts = 0; //Layouts starting from the first line
+		size_t lastLayoutStartLine = 0;
+		size_t linesLaidOut = 0;
+		size_t verticesGenerated = 0;
+		size_t stylizersReplayed = 0; //Stylizers applied by layouts and findCharacterBounds(), including the ones before the first line laid out
+		size_t glyphCacheMisses = 0; //Glyphs that had to be rasterized
+		size_t characterBoundsScanned = 0; //Characters walked by findCharacterBounds()
+		size_t measures = 0; //measure() calls that weren't remembered
+		size_t variablesReplaced = 0; //Values of setVariable() whose glyphs were replaced where they were, without a layout
+		sf::Uint64 parseNanoseconds = 0;
+		sf::Uint64 layoutNanoseconds = 0;
+		sf::Uint64 drawNanoseconds = 0; //Layouts triggered by draw() included
+		sf::Uint64 animateNanoseconds = 0;
+		sf::Uint64 characterBoundsNanoseconds = 0;
+		sf::Uint64 measureNanoseconds = 0;
+	};
+	//prepare() counts into the layout it publishes, even on a worker thread; its counts join the instance's (and the global ones) when the render
+	//thread adopts that layout or reads the counters
+	PerformanceCounters const& getPerformanceCounters() const;
+	void resetPerformanceCounters();
+	static PerformanceCounters getGlobalPerformanceCounters(); //Sum over all instances
+	static void resetGlobalPerformanceCounters();
+	
+	//Timeline of the parse, layout and draw phases of all instances, saved in the Chrome trace event format (chrome://tracing, Perfetto).
+	//Only recorded in builds defining RICHTEXT_TRACING; every thread keeps its last 16384 events. saveTrace() returns false otherwise.
+	//Events recorded while saving may be skipped or torn.
+	static bool saveTrace(std::string const& filename);
+	static void clearTrace();
+	
+private:
+	sf::Font const* m_font;
+	uint m_characterSize;
+	
+	typedef RichTextLayout::VariableStyle VariableStyle;
+	typedef RichTextLayout::Stylizer Stylizer;
 	
 	template<class T>
 	class SpecializedStylizer : public Stylizer {
@@ -112,6 +320,8 @@ private:
 	public:
 		EnderStylizer(Stylizer::StyleProperty type);
 		virtual Stylizer::StyleProperty stylize(VariableStyle& vs) const;
+		virtual sf::Uint64 hash() const;
+		virtual Stylizer* clone() const;
 	};
 	
 	template<class T>
@@ -120,44 +330,240 @@ private:
 		StarterStylizer(Stylizer::StyleProperty type); //Inactive stylizer - will copy current state of the property (stylize() will return None)
 		StarterStylizer(Stylizer::StyleProperty type, T value);
 		virtual Stylizer::StyleProperty stylize(VariableStyle& vs) const;
+		virtual sf::Uint64 hash() const;
+		virtual Stylizer* clone() const;
 		
 		void setValue(T value);
+		T const& getValue() const;
 		bool activated;
 	private:
 		T m_value;
 	};
 	
 	
-	std::multimap<size_t, Stylizer*> m_stylizers; //Stylizers, mapped to the character they activate at
+	//Output of parsing. Shared between copies of an instance, in which case it is cloned before being modified
+	class Document {
+	public:
+		Document() {}
+		Document(Document const& other); //Clones the stylizers
+		Document& operator=(Document const&) = delete;
+		~Document();
+		
+		sf::String string;
+		RichTextLayout::Stylizers stylizers; //Stylizers, mapped to the character they activate at
+		std::unordered_map<int, std::vector<Stylizer*>> modifiableStylizers; //Stylizers accessible by ID
+		size_t totalDisplayableCharacters = 0;
+		size_t lineBreaks = 0;
+		bool hasAnimationTags = false;
+		sf::Uint64 markupHash = 0; //Of what the document was parsed from, which stands for it with its length, while isParsedMarkup
+		size_t markupLength = 0;
+		bool isParsedMarkup = false; //False once modified after parsing
+		static sf::Uint64 hashMarkup(sf::String const& markup);
+		
+		//Text of a <var> tag, in the order of the string
+		struct Variable {
+			std::string name;
+			size_t start;
+			size_t length;
+			size_t firstStylizer; //Index of the first stylizer parsed after it, from which stylizers move with the text after it
+		};
+		std::vector<Variable> variables;
+	};
 	
-	std::multimap<int, Stylizer*> m_modifiableStylizers; //Stylizers accessible by ID
+	std::shared_ptr<Document> m_document;
+	Document& editDocument(); //Unshares the document first
+	void requestLayoutFrom(size_t character); //Lays out again from the line the character is on, or the line before it may take it back to
+	static size_t findFirstDifference(Document const& previous, Document const& document); //Character where they start differing, max if they don't
+	bool applyChange(Document& document, Batch::Change const& change); //Returns true if a stylizer was modified; the layout is left to the caller
 	
 	mutable VariableStyle m_style;
 	
-	mutable sf::VertexArray m_charVertices;
-	mutable sf::VertexArray m_charOutlineVertices;
-	mutable sf::VertexArray m_lineVertices;
-	mutable sf::VertexArray m_lineOutlineVertices;
+	//Output of a layout and its vertices. Can be shared between instances through the layout cache, in which case it is treated as immutable and copied on write
+	class Geometry {
+	public:
+		Geometry();
+		Geometry(Geometry const& other, size_t startLine); //Copies what comes before startLine, and where startLine starts
+		void truncate(size_t startLine); //Discards what comes after the start of startLine
+		void eraseFront(size_t endLine, float lift); //Discards the lines before endLine, moving the rest up by lift
+		size_t getMemoryUsage() const;
+		
+		RichTextLayout::Result layout;
+		Geometry const* preparedFrom = nullptr; //Published geometry whose lines before preparedFromLine were kept, for prepared geometries
+		size_t preparedFromLine = 0;
+		bool layoutInProgress = false; //The layout stopped at its budget, for prepared geometries
+#ifdef RICHTEXT_PERFORMANCE_COUNTERS
+		PerformanceCounters preparedCounters; //Counted by every prepare() that led to it, for prepared geometries; merged by the render thread
+#endif
+		
+		sf::VertexArray charVertices; //Quads of the laid out glyphs, except in compact storage
+		sf::VertexArray charOutlineVertices;
+		sf::VertexArray lineVertices; //Quads of the decorations
+		sf::VertexArray lineOutlineVertices;
+		std::vector<size_t> lineStart_charOutline; //First vertex of every line in charOutlineVertices
+		
+		//Consecutive animated glyphs sharing the same effects; the base of every glyph is its 6 char vertices followed by its 6 outline vertices if any
+		struct AnimatedRun {
+			size_t charStart; //First vertex in charVertices
+			size_t outlineStart; //First vertex in charOutlineVertices
+			size_t glyphCount;
+			size_t baseStart; //First vertex in the animation base arrays
+			sf::Uint8 effects; //RichTextLayout::StyleRun::Effect flags
+			bool hasOutline;
+		};
+		std::vector<AnimatedRun> animatedRuns;
+		std::vector<sf::Vector2f> animationBasePositions;
+		std::vector<sf::Color> animationBaseColors;
+		void truncateAnimations(size_t charVerticesKept);
+		void captureAnimationBase(size_t firstRun); //Copies the vertices of the runs from firstRun onwards, as laid out
+	};
+	
+	mutable std::shared_ptr<Geometry> m_geometry; //Geometry drawn, with its vertices
+	size_t getStylizerLine(Stylizer const* stylizer) const;
 	
-	mutable std::vector<size_t> m_lineStart_i;
-	mutable std::vector<float> m_lineStart_verticalPos;
-	mutable std::vector<size_t> m_lineStart_char;
-	mutable std::map<size_t, size_t> m_lineStart_line;
-	mutable std::map<size_t, size_t> m_lineStart_charOutline;
-	mutable std::map<size_t, size_t> m_lineStart_lineOutline;
+	std::shared_ptr<Geometry> m_preparedGeometry; //Last geometry published by prepare(), only accessed atomically; never modified once published
+	mutable std::shared_ptr<Geometry const> m_adoptedGeometry; //Published geometry whose layout m_geometry was built from
+	void adoptPreparedGeometry(std::shared_ptr<Geometry> const& prepared) const;
+	Geometry const& getLaidOutGeometry() const; //The published geometry of prepared instances
+	
+	//The registry is keyed by address, so the link belongs to the object: copies and moves construct with it (the source keeps it
+	//and unregisters when destroyed), assignments keep the destination's own
+	struct SchedulerLink {
+		SchedulerLink() {}
+		SchedulerLink(SchedulerLink const& other) : registry(other.registry) {}
+		SchedulerLink& operator=(SchedulerLink const&) { return *this; }
+		std::weak_ptr<RichTextScheduler::Registry> registry;
+	};
+	SchedulerLink m_scheduler;
+	void requestLayout(); //Flags the layout as outdated and registers the instance to its scheduler
 	
 	void initializeLineStarts();
+	void clearMovedFrom(); //Gives a moved-from text an empty document and geometry of its own
+	
+	mutable RichTextLayout m_layout;
+	size_t m_layoutLineBudget = 0;
+	float m_layoutTimeBudget = 0.f;
+	mutable bool m_layoutInProgress = false; //The last layout stopped at its budget; m_layout holds its state
+	void resumeLayout() const;
+	
+	mutable RichTextLayout m_measureLayout; //Engine of measure(), kept for its memory
+	mutable std::vector<std::pair<float, Measurement>> m_measurements; //By width, most recent first; cleared by requestLayout()
+	RichTextLayout::MetricsProvider const* m_metrics = nullptr;
+	class InstanceMetrics;
+	RichTextLayout::Settings getLayoutSettings(RichTextLayout::MetricsProvider const& instanceMetrics) const;
+	void buildVertices(size_t startLine) const; //Converts the layout from startLine onwards
+	void moveAlignedVertices() const; //Follows the lines moved by the last layout or alignment of m_layout
+	
+	class GlyphRegistry;
+	std::vector<std::shared_ptr<GlyphRegistry>> m_glyphRegistries; //Of the font, then of the fallbacks
+	void updateGlyphRegistries();
+	//Font glyph lookup that keeps track of cold glyphs; a characterSize of 0 is the instance's
+	sf::Glyph const& getGlyph(sf::Uint32 codePoint, bool bold, float outlineThickness = 0.f, unsigned int font = 0, unsigned int characterSize = 0) const;
+	void prewarm(size_t from) const;
+	bool m_prewarmOnParse = false;
+	mutable size_t m_coldGlyphMisses = 0;
 	
-	size_t m_totalDisplayableCharacters = 0;
+	GlyphAtlas* m_atlas = nullptr;
+	mutable std::vector<sf::Uint64> m_atlasShelves; //Generation of every atlas shelf the layout took glyphs from (0 if unused)
+	mutable sf::Uint64 m_atlasGeneration = 0;
+	bool checkAtlasEvictions() const; //Returns true if some of the glyphs used were evicted since the last check
+	
+	std::vector<sf::Font const*> m_fallbackFonts;
+	std::vector<std::shared_ptr<RichTextLayout::FontCoverage const>> m_fontCoverages; //Of the font, then of the fallbacks; empty without fallbacks
+	void updateFontCoverages();
+	unsigned int findFont(sf::Uint32 codePoint) const; //Index of the font drawing a code point, 0 being the font and the others the fallbacks
+	sf::Font const& getChainFont(unsigned int font) const;
+	mutable std::vector<sf::VertexArray> m_fontCharVertices; //Quads drawn, split by texture when some glyphs come from fallbacks or size tags
+	mutable std::vector<sf::VertexArray> m_fontCharOutlineVertices;
+	mutable std::vector<std::pair<unsigned int, unsigned int>> m_fontBatches; //Font and character size of every split
+	mutable sf::Uint64 m_fontSplitVersion = 0;
+	mutable size_t m_fontSplitFirstGlyph = 0;
+	mutable size_t m_fontSplitEndGlyph = 0;
+	bool splitVerticesByFont() const; //Returns false if every glyph drawn comes from the texture of the font at the instance's size
+	
+	class LayoutCache;
+	struct LayoutKey {
+		sf::Uint64 hash; //Of the document and the style settings; documents with the same hash are compared in full
+		std::shared_ptr<Document const> document;
+		std::vector<std::shared_ptr<GlyphRegistry>> fonts; //Of the font and the fallbacks, which tell fonts apart beyond their addresses
+		RichTextLayout::MetricsProvider const* metrics;
+		uint characterSize;
+		float horizontalLimit;
+		RichTextLayout::Alignment alignment;
+		size_t maxLines;
+		bool compactStorage;
+		bool operator==(LayoutKey const& other) const;
+	};
+	LayoutKey computeLayoutKey() const;
+	bool isLayoutCacheable() const;
+	void hashStyleSettings(sf::Uint64& hash) const; //Of the default style, the digits and the ellipsis, which layouts depend on
+	
+	class SnapshotReader;
+	sf::Uint64 computeSnapshotKey(sf::String const& markup) const;
+	template<class T>
+	static void writeStylizer(std::ofstream& file, Stylizer const* stylizer);
+	template<class T>
+	static Stylizer* readStylizer(SnapshotReader& reader, Stylizer::StyleProperty type); //nullptr if the snapshot is cut short
+	static bool findIDName(int ID, std::string& name); //Whether the ID was given to a name by getID()
 	
 	float m_horizontalLimit = std::numeric_limits<float>::infinity();
+	RichTextLayout::Alignment m_alignment = RichTextLayout::Left;
+	mutable bool m_realignLines = false; //The alignment changed since the last layout
+	void realignLines() const;
 	
 	size_t m_characterLimit = std::numeric_limits<size_t>::max();
+	size_t m_maxLines = std::numeric_limits<size_t>::max();
+	sf::String m_ellipsis = "...";
+	
+	size_t m_logCapacity = std::numeric_limits<size_t>::max();
+	bool dropLogLines(); //Returns true if lines were dropped
+	static bool isStarter(Stylizer const* stylizer);
+	
+	std::unordered_map<std::string, sf::String> m_variables;
+	bool m_tabularDigits = false;
+	bool replaceVariableGlyphs(size_t start, sf::String const& replaced); //In the laid out geometry; returns false if the value needs a layout
+	
+	AnimationParameters m_animationParameters;
+	std::vector<float> m_animationOffsets; //Scratch space of animate()
+	std::vector<float> m_waveCosines; //Of the phase step of every glyph, by glyph index, for m_waveSpacing
+	std::vector<float> m_waveSines;
+	float m_waveSpacing = 0.f;
+	
+	mutable sf::Uint64 m_geometryVersion = 0; //Changes every time the vertices do
+	
+#ifdef RICHTEXT_COMPACT_STORAGE
+	bool m_compactStorage = true;
+#else
+	bool m_compactStorage = false;
+#endif
+	mutable sf::VertexArray m_visibleCharVertices { sf::Triangles }; //Quads of the glyphs in view, in compact mode
+	mutable sf::VertexArray m_visibleCharOutlineVertices { sf::Triangles };
+	mutable size_t m_visibleFirstGlyph = 0;
+	mutable size_t m_visibleEndGlyph = 0;
+	mutable sf::Uint64 m_visibleVersion = 0;
+	void addGlyphQuads(RichTextLayout::PlacedGlyph const& glyph, float shift, sf::VertexArray& charVertices, sf::VertexArray& charOutlineVertices) const; //Shifted by the alignment
+	mutable std::vector<float> m_glyphShifts; //Scratch space of the alignment of a line
+	void updateVisibleVertices(sf::RenderTarget const& target, sf::Transform const& transform) const;
+	
+	RenderCacheMode m_renderCacheMode = NeverCache;
+	unsigned int m_renderCacheFrames = 30;
+	size_t m_renderCacheMinimumGlyphs = 500;
+	mutable std::shared_ptr<sf::RenderTexture> m_renderCache;
+	mutable sf::Uint64 m_renderCacheVersion = 0;
+	mutable unsigned int m_unchangedFrames = 0;
+	bool drawFromRenderCache(sf::RenderTarget& target, sf::RenderStates const& states) const;
+	void drawGeometry(sf::RenderTarget& target, sf::RenderStates const& states) const;
 	
-	mutable sf::FloatRect m_bounds;
+#ifdef RICHTEXT_PERFORMANCE_COUNTERS
+	mutable PerformanceCounters m_counters;
+	mutable unsigned int m_countersDepth = 0; //Phases in progress; the outermost one adds to the global counters
+	mutable PerformanceCounters m_mergedCounters; //preparedCounters of the last prepared geometry merged
+	void mergePreparedCounters(Geometry const& prepared) const;
+#endif
 	
 	mutable bool m_shouldUpdateVertices;
 	mutable size_t m_updateStartLine = 0;
+	mutable size_t m_recolorStartLine = std::numeric_limits<size_t>::max(); //First line whose glyphs changed colour only
+	bool recolor(size_t startLine) const; //Returns false if the lines need a layout instead
 	void updateVertices() const;
 	
 	virtual void draw(sf::RenderTarget& target, sf::RenderStates states) const;
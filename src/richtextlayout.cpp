@@ -0,0 +1,1838 @@
+#include "richtextlayout.h"
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <fstream>
+
+RichTextLayout::VariableStyle::VariableStyle() {
+	bolds.push_back(false);
+	italics.push_back(false);
+	underlineds.push_back(false);
+	strikeThroughs.push_back(false);
+	fillColors.push_back(sf::Color::Black);
+	outlineThicknesses.push_back(0.f);
+	outlineColors.push_back(sf::Color::White);
+	letterSpacingFactors.push_back(1.f);
+	lineSpacingFactors.push_back(1.f);
+	characterSizes.push_back(0.f);
+	waves.push_back(false);
+	shakes.push_back(false);
+	pulses.push_back(false);
+}
+
+void RichTextLayout::VariableStyle::rewind() {
+	while (bolds.size() > 1)
+		bolds.pop_back();
+	while (italics.size() > 1)
+		italics.pop_back();
+	while (underlineds.size() > 1)
+		underlineds.pop_back();
+	while (strikeThroughs.size() > 1)
+		strikeThroughs.pop_back();
+	while (fillColors.size() > 1)
+		fillColors.pop_back();
+	while (outlineThicknesses.size() > 1)
+		outlineThicknesses.pop_back();
+	while (outlineColors.size() > 1)
+		outlineColors.pop_back();
+	while (letterSpacingFactors.size() > 1)
+		letterSpacingFactors.pop_back();
+	while (lineSpacingFactors.size() > 1)
+		lineSpacingFactors.pop_back();
+	while (characterSizes.size() > 1)
+		characterSizes.pop_back();
+	while (waves.size() > 1)
+		waves.pop_back();
+	while (shakes.size() > 1)
+		shakes.pop_back();
+	while (pulses.size() > 1)
+		pulses.pop_back();
+}
+
+unsigned int RichTextLayout::VariableStyle::getCharacterSize(unsigned int characterSize) const {
+	float size = characterSizes.back();
+	return size >= 1.f ? static_cast<unsigned int>(size + 0.5f) : characterSize;
+}
+
+size_t const coverageBlocks = 0x110000 / 256; //Code points end at U+10FFFF
+
+RichTextLayout::FontCoverage::FontCoverage(sf::Font const& font) :
+	m_font(&font),
+	m_blocks(new std::atomic<Bitset const*>[coverageBlocks])
+{
+	for (size_t block = 0; block < coverageBlocks; block++)
+		m_blocks[block].store(nullptr, std::memory_order_relaxed);
+}
+
+bool RichTextLayout::FontCoverage::covers(sf::Uint32 codePoint) const {
+	size_t block = codePoint >> 8;
+	if (block >= coverageBlocks)
+		return false;
+	Bitset const* bits = m_blocks[block].load(std::memory_order_acquire);
+	if (!bits)
+		bits = probe(block);
+	sf::Uint32 bit = codePoint & 0xFF;
+	return ((*bits)[bit >> 6] >> (bit & 63)) & 1;
+}
+
+RichTextLayout::FontCoverage::Bitset const* RichTextLayout::FontCoverage::probe(size_t block) const {
+	static Bitset const empty = {};
+	static Bitset const full = { ~0ull, ~0ull, ~0ull, ~0ull };
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (Bitset const* bits = m_blocks[block].load(std::memory_order_acquire))
+		return bits; //Probed meanwhile by another thread
+
+	Bitset bits = {};
+	for (sf::Uint32 bit = 0; bit < 256; bit++) {
+		if (m_font->hasGlyph(static_cast<sf::Uint32>(block << 8) | bit))
+			bits[bit >> 6] |= 1ull << (bit & 63);
+	}
+	Bitset const* shared = &empty;
+	if (bits == full)
+		shared = &full;
+	else if (bits != empty) {
+		m_bitsets.push_back(bits);
+		shared = &m_bitsets.back();
+	}
+	m_blocks[block].store(shared, std::memory_order_release);
+	return shared;
+}
+
+std::shared_ptr<RichTextLayout::FontCoverage const> RichTextLayout::FontCoverage::of(sf::Font const& font) {
+	static std::mutex mutex;
+	static std::unordered_map<sf::Font const*, std::weak_ptr<FontCoverage const>> coverages;
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<FontCoverage const> coverage = coverages[&font].lock();
+	if (!coverage) {
+		//Tables nobody holds any more may be of released fonts, whose addresses can be reused
+		for (auto it = coverages.begin(); it != coverages.end();) {
+			if (it->second.expired())
+				it = coverages.erase(it);
+			else
+				it++;
+		}
+		coverage = std::make_shared<FontCoverage>(font);
+		coverages[&font] = coverage;
+	}
+	return coverage;
+}
+
+unsigned int RichTextLayout::FontCoverage::findFont(std::vector<std::shared_ptr<FontCoverage const>> const& chain, sf::Uint32 codePoint) {
+	for (size_t font = 0; font < chain.size(); font++) {
+		if (chain[font]->covers(codePoint))
+			return static_cast<unsigned int>(font);
+	}
+	return 0; //The main font draws its replacement glyph
+}
+
+//Line break classes of UAX #14, merged where the pair rules treat them alike: CL stands for every class a line can't start with (CL, CP, EX,
+//IS, SY, NS, IN), GL for GL and WJ, ID for ID, H2, H3 and EB, CM for CM, ZWJ and EM, and SP for whitespace and controls
+enum BreakClass : sf::Uint8 { AL, NU, ID, OP, CL, QU, GL, BA, BB, HY, B2, ZW, CM, SP, BreakClassCount };
+
+struct BreakRange {
+	sf::Uint32 first;
+	sf::Uint32 last;
+	BreakClass breakClass;
+};
+
+//Later ranges override the earlier ones they overlap; code points in none are AL
+BreakRange const breakRanges[] = {
+	{ 0x0000, 0x0020, SP }, { 0x0021, 0x0021, CL }, { 0x0022, 0x0022, QU }, { 0x0027, 0x0027, QU }, { 0x0028, 0x0028, OP }, { 0x0029, 0x0029, CL },
+	{ 0x002C, 0x002C, CL }, { 0x002D, 0x002D, HY }, { 0x002E, 0x002F, CL }, { 0x0030, 0x0039, NU }, { 0x003A, 0x003B, CL }, { 0x003F, 0x003F, CL },
+	{ 0x005B, 0x005B, OP }, { 0x005D, 0x005D, CL }, { 0x007B, 0x007B, OP }, { 0x007C, 0x007C, BA }, { 0x007D, 0x007D, CL }, { 0x007F, 0x009F, SP },
+	{ 0x00A0, 0x00A0, GL }, { 0x00A1, 0x00A1, OP }, { 0x00AB, 0x00AB, QU }, { 0x00AD, 0x00AD, BA }, { 0x00B4, 0x00B4, BB }, { 0x00BB, 0x00BB, QU },
+	{ 0x00BF, 0x00BF, OP }, { 0x02C8, 0x02C8, BB }, { 0x02CC, 0x02CC, BB }, { 0x02DF, 0x02DF, BB }, { 0x0300, 0x036F, CM }, { 0x0483, 0x0489, CM },
+	{ 0x0591, 0x05BD, CM }, { 0x05BE, 0x05BE, BA }, { 0x0610, 0x061A, CM }, { 0x064B, 0x065F, CM }, { 0x0660, 0x0669, NU }, { 0x06F0, 0x06F9, NU },
+	{ 0x093E, 0x094D, CM }, { 0x0964, 0x0965, BA }, { 0x0966, 0x096F, NU }, { 0x0F0B, 0x0F0B, BA }, { 0x1680, 0x1680, BA }, { 0x1AB0, 0x1AFF, CM },
+	{ 0x1DC0, 0x1DFF, CM }, { 0x2000, 0x200A, BA }, { 0x2007, 0x2007, GL }, { 0x200B, 0x200B, ZW }, { 0x200C, 0x200D, CM }, { 0x2010, 0x2010, BA },
+	{ 0x2011, 0x2011, GL }, { 0x2012, 0x2013, BA }, { 0x2014, 0x2014, B2 }, { 0x2018, 0x2019, QU }, { 0x201A, 0x201A, OP }, { 0x201C, 0x201D, QU },
+	{ 0x201E, 0x201E, OP }, { 0x2024, 0x2026, CL }, { 0x2027, 0x2027, BA }, { 0x202F, 0x202F, GL }, { 0x2039, 0x203A, QU }, { 0x203C, 0x203D, CL },
+	{ 0x2044, 0x2044, CL }, { 0x2047, 0x2049, CL }, { 0x2060, 0x2060, GL }, { 0x20D0, 0x20FF, CM },
+	//CJK symbols, kana and ideographs break around every character, except before closing punctuation and small kana
+	{ 0x2E80, 0x31EF, ID }, { 0x3000, 0x3000, BA }, { 0x3001, 0x3002, CL }, { 0x3005, 0x3005, CL }, { 0x3008, 0x301B, OP }, { 0x3009, 0x3009, CL },
+	{ 0x300B, 0x300B, CL }, { 0x300D, 0x300D, CL }, { 0x300F, 0x300F, CL }, { 0x3011, 0x3011, CL }, { 0x3012, 0x3013, ID }, { 0x3015, 0x3015, CL },
+	{ 0x3017, 0x3017, CL }, { 0x3019, 0x3019, CL }, { 0x301B, 0x301C, CL }, { 0x301D, 0x301D, OP }, { 0x301E, 0x301F, CL }, { 0x302A, 0x302F, CM },
+	{ 0x303B, 0x303C, CL }, { 0x3041, 0x3041, CL }, { 0x3043, 0x3043, CL }, { 0x3045, 0x3045, CL }, { 0x3047, 0x3047, CL }, { 0x3049, 0x3049, CL },
+	{ 0x3063, 0x3063, CL }, { 0x3083, 0x3083, CL }, { 0x3085, 0x3085, CL }, { 0x3087, 0x3087, CL }, { 0x308E, 0x308E, CL }, { 0x3095, 0x3096, CL },
+	{ 0x3099, 0x309A, CM }, { 0x309B, 0x309E, CL }, { 0x30A0, 0x30A1, CL }, { 0x30A3, 0x30A3, CL }, { 0x30A5, 0x30A5, CL }, { 0x30A7, 0x30A7, CL },
+	{ 0x30A9, 0x30A9, CL }, { 0x30C3, 0x30C3, CL }, { 0x30E3, 0x30E3, CL }, { 0x30E5, 0x30E5, CL }, { 0x30E7, 0x30E7, CL }, { 0x30EE, 0x30EE, CL },
+	{ 0x30F5, 0x30F6, CL }, { 0x30FB, 0x30FE, CL }, { 0x31F0, 0x31FF, CL }, { 0x3200, 0x4DBF, ID }, { 0x4E00, 0x9FFF, ID }, { 0xA000, 0xA4CF, ID },
+	{ 0xAC00, 0xD7A3, ID }, { 0xF900, 0xFAFF, ID }, { 0xFE00, 0xFE0F, CM }, { 0xFE10, 0xFE19, CL }, { 0xFE20, 0xFE2F, CM }, { 0xFE30, 0xFE4F, ID },
+	{ 0xFEFF, 0xFEFF, GL }, { 0xFF01, 0xFF60, ID }, { 0xFF01, 0xFF01, CL }, { 0xFF08, 0xFF08, OP }, { 0xFF09, 0xFF09, CL }, { 0xFF0C, 0xFF0C, CL },
+	{ 0xFF0E, 0xFF0E, CL }, { 0xFF1A, 0xFF1B, CL }, { 0xFF1F, 0xFF1F, CL }, { 0xFF3B, 0xFF3B, OP }, { 0xFF3D, 0xFF3D, CL }, { 0xFF5B, 0xFF5B, OP },
+	{ 0xFF5D, 0xFF5D, CL }, { 0xFF5F, 0xFF5F, OP }, { 0xFF60, 0xFF61, CL }, { 0xFF62, 0xFF62, OP }, { 0xFF63, 0xFF65, CL }, { 0xFF66, 0xFF9D, ID },
+	{ 0xFF67, 0xFF70, CL }, { 0xFF9E, 0xFF9F, CL },
+	{ 0x1F000, 0x1FAFF, ID }, { 0x1F3FB, 0x1F3FF, CM }, { 0x20000, 0x3FFFD, ID }, { 0xE0001, 0xE007F, CM }, { 0xE0100, 0xE01EF, CM }
+};
+
+//Pair rules LB7 to LB31 over the merged classes
+bool breaksBetween(BreakClass before, BreakClass after) {
+	if (before == SP || after == SP)
+		return false; //The layout breaks at whitespace itself
+	if (before == ZW)
+		return true; //LB8
+	if (after == ZW || after == CM || before == GL || after == GL || after == CL)
+		return false; //LB7, LB9, LB11 to LB13
+	if (before == OP || before == QU || after == QU)
+		return false; //LB14, LB19
+	if (after == BA || after == HY || before == BB || (before == B2 && after == B2) || (before == HY && after == NU))
+		return false; //LB21, LB17, LB25 (a minus sign)
+	if (before == BA || before == HY || before == B2 || after == B2 || after == BB)
+		return true; //LB21, LB31
+	return before == ID || after == ID; //LB28 to LB30 keep letters, digits and brackets together, LB31 breaks around ideographs
+}
+
+//Classes as a two-stage table: every block of 256 code points indexes a block of classes, shared between identical blocks (most are all AL).
+//Pairs of ASCII characters skip it, with the opportunities after each of them as a bitset
+class BreakTable {
+public:
+	BreakTable() {
+		for (size_t before = 0; before < BreakClassCount; before++) {
+			m_pairs[before] = 0;
+			for (size_t after = 0; after < BreakClassCount; after++)
+				m_pairs[before] |= breaksBetween(BreakClass(before), BreakClass(after)) << after;
+		}
+
+		m_blocks.assign(256, AL);
+		m_blockIndices.resize(0x110000 / 256);
+		std::vector<BreakClass> block(256);
+		for (size_t b = 0; b < m_blockIndices.size(); b++) {
+			sf::Uint32 first = static_cast<sf::Uint32>(b << 8), last = first + 255;
+			std::fill(block.begin(), block.end(), AL);
+			for (BreakRange const& range : breakRanges) {
+				for (sf::Uint32 codePoint = std::max(range.first, first); codePoint <= std::min(range.last, last); codePoint++)
+					block[codePoint - first] = range.breakClass;
+			}
+			size_t index = 0;
+			while (index * 256 < m_blocks.size() && !std::equal(block.begin(), block.end(), m_blocks.begin() + index * 256))
+				index++;
+			if (index * 256 == m_blocks.size())
+				m_blocks.insert(m_blocks.end(), block.begin(), block.end());
+			m_blockIndices[b] = static_cast<sf::Uint16>(index);
+		}
+
+		for (sf::Uint32 before = 0; before < 128; before++) {
+			m_ascii[before][0] = m_ascii[before][1] = 0;
+			for (sf::Uint32 after = 0; after < 128; after++) {
+				if (breaksByClass(before, after))
+					m_ascii[before][after >> 6] |= 1ull << (after & 63);
+			}
+		}
+	}
+
+	bool breaks(sf::Uint32 before, sf::Uint32 after) const {
+		if ((before | after) < 128)
+			return (m_ascii[before][after >> 6] >> (after & 63)) & 1;
+		return breaksByClass(before, after);
+	}
+
+private:
+	bool breaksByClass(sf::Uint32 before, sf::Uint32 after) const {
+		return (m_pairs[getClass(before)] >> getClass(after)) & 1;
+	}
+
+	BreakClass getClass(sf::Uint32 codePoint) const {
+		return codePoint < 0x110000 ? m_blocks[m_blockIndices[codePoint >> 8] * 256 + (codePoint & 0xFF)] : AL;
+	}
+
+	sf::Uint16 m_pairs[BreakClassCount]; //Classes a line can break before, after each class
+	std::vector<sf::Uint16> m_blockIndices;
+	std::vector<BreakClass> m_blocks;
+	sf::Uint64 m_ascii[128][2];
+};
+
+bool RichTextLayout::isBreakOpportunity(sf::Uint32 previous, sf::Uint32 next) {
+	static BreakTable const table;
+	return table.breaks(previous, next);
+}
+
+RichTextLayout::FontMetrics::FontMetrics(sf::Font const& font, std::vector<sf::Font const*> const& fallbacks) {
+	m_fonts.push_back(&font);
+	m_fonts.insert(m_fonts.end(), fallbacks.begin(), fallbacks.end());
+	if (!fallbacks.empty()) {
+		for (sf::Font const* chainFont : m_fonts)
+			m_coverages.push_back(FontCoverage::of(*chainFont));
+	}
+}
+
+sf::Glyph RichTextLayout::FontMetrics::getGlyph(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness) const {
+	return m_fonts[getFont(codePoint)]->getGlyph(codePoint, characterSize, bold, outlineThickness);
+}
+
+float RichTextLayout::FontMetrics::getKerning(sf::Uint32 first, sf::Uint32 second, unsigned int characterSize) const {
+	unsigned int font = getFont(first);
+	return font == getFont(second) ? m_fonts[font]->getKerning(first, second, characterSize) : 0.f;
+}
+
+float RichTextLayout::FontMetrics::getLineSpacing(unsigned int characterSize) const { return m_fonts[0]->getLineSpacing(characterSize); }
+float RichTextLayout::FontMetrics::getUnderlinePosition(unsigned int characterSize) const { return m_fonts[0]->getUnderlinePosition(characterSize); }
+float RichTextLayout::FontMetrics::getUnderlineThickness(unsigned int characterSize) const { return m_fonts[0]->getUnderlineThickness(characterSize); }
+unsigned int RichTextLayout::FontMetrics::getFont(sf::Uint32 codePoint) const { return m_coverages.empty() ? 0 : FontCoverage::findFont(m_coverages, codePoint); }
+
+//Code points use 21 bits, sizes 16, outline thicknesses are kept to a sixteenth of a pixel
+sf::Uint64 RichTextLayout::MetricsTable::glyphKey(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness) {
+	sf::Uint64 thickness = static_cast<sf::Uint16>(static_cast<sf::Int16>(std::round(outlineThickness * 16.f)));
+	return (codePoint & 0x1FFFFFull) | (static_cast<sf::Uint64>(characterSize & 0xFFFF) << 21) | (static_cast<sf::Uint64>(bold) << 37) | (thickness << 38);
+}
+
+sf::Uint64 RichTextLayout::MetricsTable::kerningKey(sf::Uint32 first, sf::Uint32 second, unsigned int characterSize) {
+	return (first & 0x1FFFFFull) | (static_cast<sf::Uint64>(second & 0x1FFFFF) << 21) | (static_cast<sf::Uint64>(characterSize & 0xFFFF) << 42);
+}
+
+void RichTextLayout::MetricsTable::capture(sf::Font const& font, sf::String const& charset, std::vector<unsigned int> const& sizes, std::vector<float> const& outlineThicknesses,
+		std::vector<sf::Font const*> const& fallbacks) {
+	FontMetrics chain(font, fallbacks);
+	sf::String characters = charset + L" x"; //Every layout needs them
+	for (size_t i = 0; i < characters.getSize(); i++) {
+		unsigned int chainFont = chain.getFont(characters[i]);
+		if (chainFont != 0)
+			m_fonts[characters[i]] = static_cast<sf::Uint8>(chainFont);
+	}
+	for (unsigned int size : sizes) {
+		m_sizes[size] = SizeMetrics { font.getLineSpacing(size), font.getUnderlinePosition(size), font.getUnderlineThickness(size) };
+		for (int bold = 0; bold < 2; bold++) {
+			for (float thickness : outlineThicknesses) {
+				for (size_t i = 0; i < characters.getSize(); i++)
+					m_glyphs[glyphKey(characters[i], size, bold, thickness)] = chain.getGlyph(characters[i], size, bold, thickness);
+			}
+		}
+		for (size_t i = 0; i < characters.getSize(); i++) {
+			for (size_t j = 0; j < characters.getSize(); j++) {
+				float kerning = chain.getKerning(characters[i], characters[j], size);
+				if (kerning != 0.f)
+					m_kernings[kerningKey(characters[i], characters[j], size)] = kerning;
+			}
+		}
+	}
+}
+
+template<class T>
+void writeValue(std::ofstream& file, T const& value) {
+	file.write(reinterpret_cast<char const*>(&value), sizeof(T));
+}
+
+template<class T>
+bool readValue(std::ifstream& file, T& value) {
+	return static_cast<bool>(file.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+//In the native byte order: a header, the sizes, the glyphs, the kerned pairs and the code points of fallback fonts (since version 2)
+bool RichTextLayout::MetricsTable::saveToFile(std::string const& filename) const {
+	std::ofstream file(filename, std::ios::binary);
+	if (!file)
+		return false;
+
+	file.write("RTMT", 4);
+	writeValue(file, sf::Uint32(2));
+	writeValue(file, sf::Uint64(m_sizes.size()));
+	for (auto const& size : m_sizes) {
+		writeValue(file, sf::Uint32(size.first));
+		writeValue(file, size.second.lineSpacing);
+		writeValue(file, size.second.underlinePosition);
+		writeValue(file, size.second.underlineThickness);
+	}
+	writeValue(file, sf::Uint64(m_glyphs.size()));
+	for (auto const& glyph : m_glyphs) {
+		writeValue(file, glyph.first);
+		writeValue(file, glyph.second.advance);
+		writeValue(file, glyph.second.bounds);
+	}
+	writeValue(file, sf::Uint64(m_kernings.size()));
+	for (auto const& kerning : m_kernings) {
+		writeValue(file, kerning.first);
+		writeValue(file, kerning.second);
+	}
+	writeValue(file, sf::Uint64(m_fonts.size()));
+	for (auto const& font : m_fonts) {
+		writeValue(file, font.first);
+		writeValue(file, font.second);
+	}
+	return static_cast<bool>(file);
+}
+
+bool RichTextLayout::MetricsTable::loadFromFile(std::string const& filename) {
+	std::ifstream file(filename, std::ios::binary);
+	char magic[4];
+	sf::Uint32 version;
+	if (!file || !file.read(magic, 4) || std::string(magic, 4) != "RTMT" || !readValue(file, version) || version < 1 || version > 2)
+		return false;
+
+	MetricsTable table;
+	sf::Uint64 count;
+	if (!readValue(file, count))
+		return false;
+	for (sf::Uint64 i = 0; i < count; i++) {
+		sf::Uint32 size;
+		SizeMetrics metrics;
+		if (!readValue(file, size) || !readValue(file, metrics.lineSpacing) || !readValue(file, metrics.underlinePosition) || !readValue(file, metrics.underlineThickness))
+			return false;
+		table.m_sizes[size] = metrics;
+	}
+	if (!readValue(file, count))
+		return false;
+	for (sf::Uint64 i = 0; i < count; i++) {
+		sf::Uint64 key;
+		sf::Glyph glyph;
+		if (!readValue(file, key) || !readValue(file, glyph.advance) || !readValue(file, glyph.bounds))
+			return false;
+		table.m_glyphs[key] = glyph;
+	}
+	if (!readValue(file, count))
+		return false;
+	for (sf::Uint64 i = 0; i < count; i++) {
+		sf::Uint64 key;
+		float kerning;
+		if (!readValue(file, key) || !readValue(file, kerning))
+			return false;
+		table.m_kernings[key] = kerning;
+	}
+	if (version >= 2) {
+		if (!readValue(file, count))
+			return false;
+		for (sf::Uint64 i = 0; i < count; i++) {
+			sf::Uint32 codePoint;
+			sf::Uint8 font;
+			if (!readValue(file, codePoint) || !readValue(file, font))
+				return false;
+			table.m_fonts[codePoint] = font;
+		}
+	}
+
+	*this = std::move(table);
+	return true;
+}
+
+sf::Glyph RichTextLayout::MetricsTable::getGlyph(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness) const {
+	auto it = m_glyphs.find(glyphKey(codePoint, characterSize, bold, outlineThickness));
+	if (it != m_glyphs.end())
+		return it->second;
+	if (outlineThickness != 0.f) {
+		it = m_glyphs.find(glyphKey(codePoint, characterSize, bold, 0.f));
+		if (it != m_glyphs.end()) { //The outline widens the glyph by its thickness on every side
+			sf::Glyph glyph = it->second;
+			glyph.bounds.left -= outlineThickness;
+			glyph.bounds.top -= outlineThickness;
+			glyph.bounds.width += 2 * outlineThickness;
+			glyph.bounds.height += 2 * outlineThickness;
+			return glyph;
+		}
+	}
+	return sf::Glyph();
+}
+
+float RichTextLayout::MetricsTable::getKerning(sf::Uint32 first, sf::Uint32 second, unsigned int characterSize) const {
+	auto it = m_kernings.find(kerningKey(first, second, characterSize));
+	return it != m_kernings.end() ? it->second : 0.f;
+}
+
+float RichTextLayout::MetricsTable::getLineSpacing(unsigned int characterSize) const {
+	auto it = m_sizes.find(characterSize);
+	return it != m_sizes.end() ? it->second.lineSpacing : 0.f;
+}
+
+float RichTextLayout::MetricsTable::getUnderlinePosition(unsigned int characterSize) const {
+	auto it = m_sizes.find(characterSize);
+	return it != m_sizes.end() ? it->second.underlinePosition : 0.f;
+}
+
+float RichTextLayout::MetricsTable::getUnderlineThickness(unsigned int characterSize) const {
+	auto it = m_sizes.find(characterSize);
+	return it != m_sizes.end() ? it->second.underlineThickness : 0.f;
+}
+
+unsigned int RichTextLayout::MetricsTable::getFont(sf::Uint32 codePoint) const {
+	if (m_fonts.empty())
+		return 0;
+	auto it = m_fonts.find(codePoint);
+	return it != m_fonts.end() ? it->second : 0;
+}
+
+RichTextLayout::TabularDigits::TabularDigits(MetricsProvider const& metrics) : m_metrics(metrics) {}
+
+sf::Glyph RichTextLayout::TabularDigits::getGlyph(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness) const {
+	sf::Glyph glyph = m_metrics.getGlyph(codePoint, characterSize, bold, outlineThickness);
+	if (!isDigit(codePoint))
+		return glyph;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_advances.find(std::make_pair(characterSize, bold));
+	if (it == m_advances.end()) {
+		float widest = 0.f;
+		for (sf::Uint32 digit = '0'; digit <= '9'; digit++)
+			widest = std::max(widest, m_metrics.getGlyph(digit, characterSize, bold, 0.f).advance);
+		it = m_advances.emplace(std::make_pair(characterSize, bold), widest).first;
+	}
+	glyph.advance = it->second;
+	return glyph;
+}
+
+float RichTextLayout::TabularDigits::getKerning(sf::Uint32 first, sf::Uint32 second, unsigned int characterSize) const {
+	return isDigit(first) || isDigit(second) ? 0.f : m_metrics.getKerning(first, second, characterSize);
+}
+
+float RichTextLayout::TabularDigits::getLineSpacing(unsigned int characterSize) const { return m_metrics.getLineSpacing(characterSize); }
+float RichTextLayout::TabularDigits::getUnderlinePosition(unsigned int characterSize) const { return m_metrics.getUnderlinePosition(characterSize); }
+float RichTextLayout::TabularDigits::getUnderlineThickness(unsigned int characterSize) const { return m_metrics.getUnderlineThickness(characterSize); }
+unsigned int RichTextLayout::TabularDigits::getFont(sf::Uint32 codePoint) const { return m_metrics.getFont(codePoint); }
+bool RichTextLayout::TabularDigits::isDigit(sf::Uint32 codePoint) { return codePoint >= '0' && codePoint <= '9'; }
+
+bool RichTextLayout::StyleRun::operator==(StyleRun const& other) const {
+	return fillColor == other.fillColor && outlineColor == other.outlineColor && outlineThickness == other.outlineThickness
+		&& italicShear == other.italicShear && bold == other.bold && effects == other.effects && font == other.font && characterSize == other.characterSize;
+}
+
+RichTextLayout::Result::Result(Result const& other, size_t startLine) :
+	stylizerLines(other.stylizerLines),
+	bounds(other.bounds)
+{
+	if (other.lines.empty())
+		return;
+	Line const& line = other.lines[startLine];
+	glyphs.assign(other.glyphs.begin(), other.glyphs.begin() + line.firstGlyph);
+	runs.assign(other.runs.begin(), other.runs.begin() + (glyphs.empty() ? 0 : glyphs.back().run + 1));
+	decorations.assign(other.decorations.begin(), other.decorations.begin() + line.firstDecoration);
+	outlineDecorations.assign(other.outlineDecorations.begin(), other.outlineDecorations.begin() + line.firstOutlineDecoration);
+	lines.assign(other.lines.begin(), other.lines.begin() + startLine+1);
+}
+
+void RichTextLayout::Result::truncate(size_t startLine) {
+	if (lines.empty())
+		return;
+	lines.resize(startLine+1);
+	firstHiddenCharacter = std::numeric_limits<size_t>::max();
+	glyphs.resize(lines[startLine].firstGlyph);
+	runs.resize(glyphs.empty() ? 0 : glyphs.back().run + 1);
+	decorations.resize(lines[startLine].firstDecoration);
+	outlineDecorations.resize(lines[startLine].firstOutlineDecoration);
+}
+
+void RichTextLayout::Result::eraseFront(size_t endLine, float lift) {
+	if (endLine == 0 || endLine >= lines.size())
+		return;
+	Line const& end = lines[endLine];
+	size_t firstCharacter = end.firstCharacter;
+	size_t firstGlyph = end.firstGlyph;
+	size_t firstRun = firstGlyph < glyphs.size() ? glyphs[firstGlyph].run : runs.size();
+	size_t firstDecoration = end.firstDecoration;
+	size_t firstOutlineDecoration = end.firstOutlineDecoration;
+
+	glyphs.erase(glyphs.begin(), glyphs.begin() + firstGlyph);
+	for (PlacedGlyph& glyph : glyphs) {
+		glyph.position.y -= lift;
+		glyph.run -= static_cast<sf::Uint32>(firstRun);
+	}
+	runs.erase(runs.begin(), runs.begin() + firstRun);
+	decorations.erase(decorations.begin(), decorations.begin() + firstDecoration);
+	outlineDecorations.erase(outlineDecorations.begin(), outlineDecorations.begin() + firstOutlineDecoration);
+	for (std::vector<Decoration>* moved : { &decorations, &outlineDecorations }) {
+		for (Decoration& decoration : *moved) {
+			decoration.top -= lift;
+			decoration.bottom -= lift;
+		}
+	}
+
+	lines.erase(lines.begin(), lines.begin() + endLine);
+	float const noBound = std::numeric_limits<float>::infinity();
+	float minX = noBound, minY = noBound, maxX = std::numeric_limits<float>::lowest(), maxY = std::numeric_limits<float>::lowest();
+	for (Line& line : lines) {
+		line.firstCharacter -= firstCharacter;
+		line.firstGlyph -= firstGlyph;
+		line.firstDecoration -= firstDecoration;
+		line.firstOutlineDecoration -= firstOutlineDecoration;
+		line.verticalPosition -= lift;
+		line.top -= lift;
+		line.bottom -= lift;
+		minX = fminf(minX, line.left);
+		minY = fminf(minY, line.top);
+		maxX = fmaxf(maxX, line.right);
+		maxY = fmaxf(maxY, line.bottom);
+	}
+	bounds = sf::FloatRect(minX, minY, maxX - minX, maxY - minY);
+	for (size_t& line : stylizerLines)
+		if (line != std::numeric_limits<size_t>::max())
+			line = line >= endLine ? line - endLine : 0;
+	if (firstHiddenCharacter != std::numeric_limits<size_t>::max())
+		firstHiddenCharacter -= firstCharacter;
+}
+
+void RichTextLayout::Result::clear() {
+	glyphs.clear();
+	runs.clear();
+	decorations.clear();
+	outlineDecorations.clear();
+	lines.clear();
+	stylizerLines.clear();
+	bounds = sf::FloatRect();
+	firstHiddenCharacter = std::numeric_limits<size_t>::max();
+}
+
+size_t RichTextLayout::Result::getMemoryUsage() const {
+	return glyphs.size() * sizeof(PlacedGlyph) + runs.size() * sizeof(StyleRun)
+		+ (decorations.size() + outlineDecorations.size()) * sizeof(Decoration)
+		+ lines.size() * sizeof(Line) + stylizerLines.size() * sizeof(size_t);
+}
+
+void RichTextLayout::getQuadCorners(sf::Vector2f position, sf::FloatRect const& bounds, float italicShear, float outlineThickness, sf::Vector2f& topLeft, sf::Vector2f& bottomRight) {
+	float padding = 1.0;
+
+	float left   = bounds.left - padding;
+	float top    = bounds.top - padding;
+	float right  = bounds.left + bounds.width + padding;
+	float bottom = bounds.top  + bounds.height + padding;
+
+	topLeft = sf::Vector2f(position.x + left - italicShear * top - outlineThickness, position.y + top - outlineThickness);
+	bottomRight = sf::Vector2f(position.x + right - italicShear * bottom - outlineThickness, position.y + bottom - outlineThickness);
+}
+
+float RichTextLayout::quantizeOutlineThickness(float thickness, float step) {
+	if (step <= 0.f)
+		return thickness;
+	return std::round(thickness / step) * step;
+}
+
+void addDecoration(std::vector<RichTextLayout::Decoration>& decorations, sf::Vector2f origin, float lineLength, const sf::Color& color, float thickness, float outlineThickness = 0)
+{
+	float top = std::floor(origin.y - (thickness / 2) + 0.5f);
+	float bottom = top + std::floor(thickness + 0.5f);
+	decorations.push_back(RichTextLayout::Decoration { origin.x - outlineThickness, top - outlineThickness, origin.x + lineLength + outlineThickness, bottom + outlineThickness, color });
+}
+
+void extendLineBounds(RichTextLayout::Line& line, float left, float top, float right, float bottom) {
+	line.left = fminf(line.left, left);
+	line.top = fminf(line.top, top);
+	line.right = fmaxf(line.right, right);
+	line.bottom = fmaxf(line.bottom, bottom);
+}
+
+bool RichTextLayout::layout(sf::String const& string, Stylizers const& stylizers, VariableStyle const& style, Settings const& settings, Result& result, size_t startLine) {
+	TabularDigits tabular(*settings.metrics);
+	MetricsProvider const& metrics = settings.tabularDigits ? tabular : *settings.metrics;
+	unsigned int characterSize = settings.characterSize;
+	m_statistics = Statistics();
+	m_style = style;
+
+	float const noBound = std::numeric_limits<float>::infinity();
+	if (result.lines.empty()) {
+		startLine = 0;
+		result.lines.push_back(Line { 0, metrics.getLineSpacing(characterSize) * m_style.lineSpacingFactors.front(), 0.f, 0, 0, 0, noBound, noBound, -noBound, -noBound, -noBound, 0.f, 0.f });
+	}
+	else
+		result.truncate(startLine);
+
+	//Populate the starting variables with the line start info
+	Line& firstLine = result.lines[startLine];
+	size_t i = firstLine.firstCharacter;
+	firstLine.verticalPosition -= firstLine.sizeShift; //Moved again once its glyphs are known
+	firstLine.sizeShift = 0.f;
+	sf::Vector2f pos(0, firstLine.verticalPosition);
+	size_t i_displayOnly = result.glyphs.size();
+	firstLine.left = firstLine.top = noBound;
+	firstLine.right = firstLine.bottom = firstLine.width = -noBound;
+	firstLine.offset = firstLine.gapSpacing = 0.f;
+
+	//Populate the complex variables with the default style values
+	float whitespaceWidth = metrics.getGlyph(L' ', characterSize, false, 0.f).advance;
+	float letterSpacing = (whitespaceWidth / 3.f) * (m_style.letterSpacingFactors.front() - 1.f);
+	whitespaceWidth += letterSpacing;
+	float lineSpacing = metrics.getLineSpacing(characterSize) * m_style.lineSpacingFactors.front();
+	float italicShear = m_style.italics.back() ? 0.209f : 0.f;
+	bool hasOutline = m_style.outlineThicknesses.front() != 0.f;
+
+	//Now, update the style (and complex variables) by iterating through the stylizers up to the starting line
+	//Those at its first character aren't met by the loop below, so their line is noted here
+	result.stylizerLines.resize(stylizers.size(), std::numeric_limits<size_t>::max());
+	auto it = stylizers.begin();
+	while (it != stylizers.end() && it->first <= i) {
+		if (it->first == i)
+			result.stylizerLines[it->second->index] = std::min(result.stylizerLines[it->second->index], startLine);
+		m_statistics.stylizersReplayed++;
+		switch (it->second->stylize(m_style)) {
+		case Stylizer::Italic:
+			italicShear = m_style.italics.back() ? 0.209f : 0.f;
+			break;
+		case Stylizer::OutlineThickness:
+			hasOutline = m_style.outlineThicknesses.back() != 0.f;
+			break;
+		case Stylizer::LetterSpacing:
+		case Stylizer::CharacterSize:
+			whitespaceWidth = metrics.getGlyph(L' ', m_style.getCharacterSize(characterSize), false, 0.f).advance;
+			letterSpacing = (whitespaceWidth / 3.f) * (m_style.letterSpacingFactors.back() - 1.f);
+			whitespaceWidth += letterSpacing;
+			break;
+		case Stylizer::LineSpacing:
+			lineSpacing = metrics.getLineSpacing(characterSize) * m_style.lineSpacingFactors.back();
+			break;
+		default:
+			break;
+		}
+		it++;
+	}
+
+	//Decorations follow the size of the glyphs they run under
+	unsigned int glyphSize = m_style.getCharacterSize(characterSize);
+	float lineThickness = metrics.getUnderlineThickness(glyphSize);
+	sf::Vector2f underlineStart(pos.x, pos.y + metrics.getUnderlinePosition(glyphSize));
+	sf::Vector2f underlineOutlineStart = underlineStart;
+	sf::FloatRect xBounds = metrics.getGlyph(L'x', glyphSize, false, 0.f).bounds;
+	sf::Vector2f strikeThroughStart(pos.x, pos.y + xBounds.top + xBounds.height * 0.4f);
+	sf::Vector2f strikeThroughOutlineStart = strikeThroughStart;
+
+	m_wordGlyphs.clear();
+	m_wordGlyphMetrics.clear();
+	m_wordDecorations.clear();
+	m_wordOutlineDecorations.clear();
+
+	//Lines may start between two glyphs, whose kerning a full layout applied
+	sf::Uint32 previousChar = i > 0 ? string[i-1] : 0;
+	m_progress = Progress { i, pos, i_displayOnly, whitespaceWidth, letterSpacing, lineSpacing, lineThickness,
+		underlineStart, underlineOutlineStart, strikeThroughStart, strikeThroughOutlineStart, italicShear, hasOutline,
+		lineSpacing, m_style.outlineThicknesses.back(), 0.f, 0, 0, 0.f, true, startLine, previousChar, true, false,
+		noBound, noBound, std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest() };
+	return run(string, stylizers, settings, result);
+}
+
+bool RichTextLayout::resume(sf::String const& string, Stylizers const& stylizers, Settings const& settings, Result& result) {
+	m_statistics = Statistics();
+	return run(string, stylizers, settings, result);
+}
+
+bool RichTextLayout::recolor(sf::String const& string, Stylizers const& stylizers, VariableStyle const& style, Result& result, size_t startLine) {
+	m_statistics = Statistics();
+	if (startLine >= result.lines.size())
+		return true;
+	Line const& line = result.lines[startLine];
+	if (line.firstDecoration < result.decorations.size() || line.firstOutlineDecoration < result.outlineDecorations.size()
+			|| result.firstHiddenCharacter != std::numeric_limits<size_t>::max())
+		return false;
+	size_t g = line.firstGlyph;
+	if (g == result.glyphs.size())
+		return true;
+
+	m_style = style;
+	size_t i = line.firstCharacter;
+	auto it = stylizers.begin();
+	while (it != stylizers.end() && it->first <= i) {
+		m_statistics.stylizersReplayed++;
+		it->second->stylize(m_style);
+		it++;
+	}
+
+	//The runs from the first glyph's are rebuilt, keeping it only if glyphs before the line use it too
+	sf::Uint32 firstRun = result.glyphs[g].run;
+	std::vector<StyleRun> oldRuns(result.runs.begin() + firstRun, result.runs.end());
+	result.runs.resize(g > 0 && result.glyphs[g-1].run == firstRun ? firstRun + 1 : firstRun);
+
+	//Every character but whitespace was placed, in order, up to the last glyph
+	size_t len = string.getSize();
+	for (; i < len && g < result.glyphs.size(); i++) {
+		m_statistics.charactersScanned++;
+		while (it != stylizers.end() && it->first == i) {
+			m_statistics.stylizersReplayed++;
+			it->second->stylize(m_style);
+			it++;
+		}
+		if (string[i] == ' ' || string[i] == '\t' || string[i] == '\n')
+			continue;
+
+		StyleRun run = oldRuns[result.glyphs[g].run - firstRun];
+		run.fillColor = m_style.fillColors.back();
+		run.outlineColor = m_style.outlineColors.back();
+		if (result.runs.empty() || !(result.runs.back() == run))
+			result.runs.push_back(run);
+		result.glyphs[g].run = static_cast<sf::Uint32>(result.runs.size() - 1);
+		g++;
+	}
+	return true;
+}
+
+size_t RichTextLayout::replaceGlyphs(sf::String const& string, sf::String const& replaced, size_t first, Settings const& settings, Result& result) {
+	size_t const none = std::numeric_limits<size_t>::max();
+	size_t end = first + replaced.getSize();
+	//The ellipsis depends on the characters the line limit left out, and follows the glyphs without following the characters
+	if (result.lines.empty() || end > string.getSize() || (result.firstHiddenCharacter != none && end >= result.firstHiddenCharacter))
+		return none;
+	TabularDigits tabular(*settings.metrics);
+	MetricsProvider const& metrics = settings.tabularDigits ? tabular : *settings.metrics;
+	auto isWhitespace = [](sf::Uint32 c) { return c == ' ' || c == '\t' || c == '\n'; };
+	auto replacedAt = [&](size_t i) { return i >= first && i < end ? replaced[i - first] : string[i]; };
+
+	auto after = [](size_t character, Line const& line) { return character < line.firstCharacter; };
+	size_t lineIndex = std::upper_bound(result.lines.begin() + 1, result.lines.end(), first, after) - result.lines.begin() - 1;
+	Line& line = result.lines[lineIndex];
+	size_t endGlyph = lineIndex+1 < result.lines.size() ? result.lines[lineIndex+1].firstGlyph : result.glyphs.size();
+	if (lineIndex+1 < result.lines.size() && result.lines[lineIndex+1].firstCharacter < end)
+		return none;
+	size_t firstGlyph = line.firstGlyph;
+	for (size_t i = line.firstCharacter; i < first; i++) {
+		if (!isWhitespace(string[i]))
+			firstGlyph++;
+	}
+
+	//Every character replaced keeps its line, its advance and its font, and the character after them its position: the pairs from the one
+	//before them to the one after them kern and break alike
+	size_t g = firstGlyph;
+	for (size_t i = first; i <= end && i < string.getSize(); i++) {
+		sf::Uint32 before = replacedAt(i), now = string[i];
+		if (isWhitespace(before) || isWhitespace(now)) {
+			if (before != now)
+				return none;
+			continue;
+		}
+		if (g >= result.glyphs.size() || (i < end && g >= endGlyph) || result.glyphs[g].codePoint != before)
+			return none;
+		StyleRun const& run = result.runs[result.glyphs[g].run];
+		if (i < end && (metrics.getFont(now) != run.font
+				|| metrics.getGlyph(now, run.characterSize, run.bold, 0.f).advance != metrics.getGlyph(before, run.characterSize, run.bold, 0.f).advance))
+			return none;
+		if (i > 0 && (replacedAt(i-1) != string[i-1] || before != now)) {
+			if (metrics.getKerning(replacedAt(i-1), before, run.characterSize) != metrics.getKerning(string[i-1], now, run.characterSize)
+					|| isBreakOpportunity(replacedAt(i-1), before) != isBreakOpportunity(string[i-1], now))
+				return none;
+		}
+		if (i < end)
+			g++;
+	}
+	size_t endReplaced = g;
+
+	//The quads of the line are measured again, as the layout measures them: before the alignment, rounded
+	float const noBound = std::numeric_limits<float>::infinity();
+	Line measured[2]; //With the glyphs as they were, then replaced
+	for (size_t k = 0; k < 2; k++) {
+		measured[k].left = measured[k].top = noBound;
+		measured[k].right = measured[k].bottom = -noBound;
+		size_t i = first;
+		for (size_t glyph = line.firstGlyph; glyph < endGlyph; glyph++) {
+			PlacedGlyph const& placed = result.glyphs[glyph];
+			StyleRun const& run = result.runs[placed.run];
+			sf::Uint32 codePoint = placed.codePoint;
+			if (k == 1 && glyph >= firstGlyph && glyph < endReplaced) {
+				while (isWhitespace(string[i]))
+					i++;
+				codePoint = string[i++];
+			}
+			sf::Vector2f topLeft, bottomRight;
+			getQuadCorners(placed.position, metrics.getGlyph(codePoint, run.characterSize, run.bold, 0.f).bounds, run.italicShear, 0.f, topLeft, bottomRight);
+			extendLineBounds(measured[k], roundf(topLeft.x), roundf(topLeft.y), roundf(bottomRight.x), roundf(bottomRight.y));
+			if (run.outlineThickness != 0.f) {
+				getQuadCorners(placed.position, metrics.getGlyph(codePoint, run.characterSize, run.bold, run.outlineThickness).bounds, run.italicShear, run.outlineThickness, topLeft, bottomRight);
+				extendLineBounds(measured[k], roundf(topLeft.x), roundf(topLeft.y), roundf(bottomRight.x), roundf(bottomRight.y));
+			}
+		}
+	}
+
+	//Lines from the left take their new bounds; aligned ones would move with their width, so they need a layout
+	bool boundsChanged = measured[0].left != measured[1].left || measured[0].top != measured[1].top || measured[0].right != measured[1].right || measured[0].bottom != measured[1].bottom;
+	if (boundsChanged && (settings.alignment != Left || line.offset != 0.f || line.gapSpacing != 0.f))
+		return none;
+
+	for (size_t i = first, glyph = firstGlyph; i < end; i++) {
+		if (!isWhitespace(string[i]))
+			result.glyphs[glyph++].codePoint = string[i];
+	}
+	if (boundsChanged) {
+		bool last = lineIndex+1 == result.lines.size();
+		for (size_t k = line.firstDecoration; k < (last ? result.decorations.size() : result.lines[lineIndex+1].firstDecoration); k++) {
+			Decoration const& d = result.decorations[k];
+			extendLineBounds(measured[1], d.left, d.top, d.right, d.bottom);
+		}
+		for (size_t k = line.firstOutlineDecoration; k < (last ? result.outlineDecorations.size() : result.lines[lineIndex+1].firstOutlineDecoration); k++) {
+			Decoration const& d = result.outlineDecorations[k];
+			extendLineBounds(measured[1], d.left, d.top, d.right, d.bottom);
+		}
+		line.left = measured[1].left;
+		line.top = measured[1].top;
+		line.right = measured[1].right;
+		line.bottom = measured[1].bottom;
+		line.width = line.right;
+
+		float minX = noBound, minY = noBound, maxX = std::numeric_limits<float>::lowest(), maxY = std::numeric_limits<float>::lowest();
+		for (Line const& other : result.lines) {
+			minX = fminf(minX, other.left);
+			minY = fminf(minY, other.top);
+			maxX = fmaxf(maxX, other.right);
+			maxY = fmaxf(maxY, other.bottom);
+		}
+		result.bounds = sf::FloatRect(minX, minY, maxX - minX, maxY - minY);
+	}
+	return firstGlyph;
+}
+
+bool RichTextLayout::run(sf::String const& string, Stylizers const& stylizers, Settings const& settings, Result& result) {
+	TabularDigits tabular(*settings.metrics);
+	MetricsProvider const& metrics = settings.tabularDigits ? tabular : *settings.metrics;
+	unsigned int characterSize = settings.characterSize;
+	float const noBound = std::numeric_limits<float>::infinity();
+	result.stylizerLines.resize(stylizers.size(), std::numeric_limits<size_t>::max());
+
+	//We keep the indices so that they can be used at the end of the program for pixel alignment of all new decorations
+	size_t startOfNewDecorations = result.decorations.size();
+	size_t startOfNewOutlineDecorations = result.outlineDecorations.size();
+
+	//Loop state, as set up by layout() or left by the previous call
+	Progress& p = m_progress;
+	size_t i = p.i;
+	sf::Vector2f pos = p.pos;
+	size_t i_displayOnly = p.i_displayOnly;
+	float whitespaceWidth = p.whitespaceWidth;
+	float letterSpacing = p.letterSpacing;
+	float lineSpacing = p.lineSpacing;
+	float lineThickness = p.lineThickness;
+	sf::Vector2f underlineStart = p.underlineStart;
+	sf::Vector2f underlineOutlineStart = p.underlineOutlineStart;
+	sf::Vector2f strikeThroughStart = p.strikeThroughStart;
+	sf::Vector2f strikeThroughOutlineStart = p.strikeThroughOutlineStart;
+	float italicShear = p.italicShear;
+	bool hasOutline = p.hasOutline;
+	unsigned int glyphSize = m_style.getCharacterSize(characterSize);
+	auto it = p.stylizersApplied ? stylizers.upper_bound(i) : stylizers.lower_bound(i);
+
+	float lineSpacingAtWordStart = p.lineSpacingAtWordStart;
+	float outlineThicknessAtWordStart = p.outlineThicknessAtWordStart;
+	float whitespaceWidthAtWordStart = p.whitespaceWidthAtWordStart;
+	size_t whitespacesAtWordStart = p.whitespacesAtWordStart;
+	size_t i_atWordStart = p.i_atWordStart;
+
+	float currentLineWidth = p.currentLineWidth;
+	bool intentionalLineBreak = p.intentionalLineBreak; //When true, whitespace before the first word of a line can push it to line wrapping; becomes false after a line wrap (the whitespace "disappears").
+
+	size_t currentLine = p.currentLine;
+	size_t startLine = currentLine; //First line this call adds to
+	size_t startCharacter = i;
+	bool resumed = p.resumed;
+
+	bool reachedCharacterLimit = false;
+	size_t firstHiddenCharacter = std::numeric_limits<size_t>::max(); //Set when the line limit ends the layout
+	bool lineFinished = false; //Whether the decorations of the last line were finished before the layout ended
+
+	bool timed = settings.timeBudget != std::numeric_limits<float>::infinity();
+	std::chrono::steady_clock::time_point deadline;
+	if (timed)
+		deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(settings.timeBudget));
+	bool stopped = false;
+
+	//Glyph quads are measured once the word has found its line, from the same positions the quads will be built from
+	auto measureGlyph = [&](Line& line, PlacedGlyph const& glyph, sf::FloatRect const& bounds, sf::FloatRect const& outlineBounds) {
+		StyleRun const& run = result.runs[glyph.run];
+		sf::Vector2f topLeft, bottomRight;
+		getQuadCorners(glyph.position, bounds, run.italicShear, 0.f, topLeft, bottomRight);
+		extendLineBounds(line, roundf(topLeft.x), roundf(topLeft.y), roundf(bottomRight.x), roundf(bottomRight.y));
+		if (run.outlineThickness != 0.f) {
+			getQuadCorners(glyph.position, outlineBounds, run.italicShear, run.outlineThickness, topLeft, bottomRight);
+			extendLineBounds(line, roundf(topLeft.x), roundf(topLeft.y), roundf(bottomRight.x), roundf(bottomRight.y));
+		}
+	};
+
+	auto addWordToText = [&]() {
+		Line& line = result.lines.back();
+		for (size_t k = 0; k < m_wordGlyphs.size(); k++)
+			measureGlyph(line, m_wordGlyphs[k], m_wordGlyphMetrics[k].bounds, m_wordGlyphMetrics[k].outlineBounds);
+
+		result.glyphs.insert(result.glyphs.end(), m_wordGlyphs.begin(), m_wordGlyphs.end());
+		result.decorations.insert(result.decorations.end(), m_wordDecorations.begin(), m_wordDecorations.end());
+		result.outlineDecorations.insert(result.outlineDecorations.end(), m_wordOutlineDecorations.begin(), m_wordOutlineDecorations.end());
+	};
+
+	auto resetWord = [&]() {
+		m_wordGlyphs.clear();
+		m_wordGlyphMetrics.clear();
+		m_wordDecorations.clear();
+		m_wordOutlineDecorations.clear();
+
+		currentLineWidth = pos.x;
+		lineSpacingAtWordStart = lineSpacing;
+		outlineThicknessAtWordStart = m_style.outlineThicknesses.back();
+		whitespaceWidthAtWordStart = 0;
+		whitespacesAtWordStart = 0;
+		i_atWordStart = i;
+	};
+
+	//Index of the run with the current style and the font of a glyph, starting a new one if either changed since the last glyph
+	auto currentRun = [&](unsigned int font) {
+		float outlineThickness = hasOutline ? quantizeOutlineThickness(m_style.outlineThicknesses.back(), settings.outlineThicknessStep) : 0.f;
+		sf::Uint8 effects = (m_style.waves.back() ? StyleRun::Wave : 0) | (m_style.shakes.back() ? StyleRun::Shake : 0) | (m_style.pulses.back() ? StyleRun::Pulse : 0);
+		StyleRun run { m_style.fillColors.back(), m_style.outlineColors.back(), outlineThickness, italicShear, m_style.bolds.back(), effects, static_cast<sf::Uint8>(font),
+			static_cast<sf::Uint16>(glyphSize) };
+		if (result.runs.empty() || !(result.runs.back() == run))
+			result.runs.push_back(run);
+		return static_cast<sf::Uint32>(result.runs.size() - 1);
+	};
+
+	//Without glyphs kept, a finished line only keeps its bounds, which take in its decorations first. Justified lines need their glyphs
+	//to count their gaps
+	bool dropLines = !settings.keepGlyphs && settings.alignment != Justify;
+	auto dropLineOutput = [&]() {
+		Line& line = result.lines.back();
+		for (std::vector<Decoration>* decorations : { &result.decorations, &result.outlineDecorations }) {
+			for (size_t k = decorations == &result.decorations ? line.firstDecoration : line.firstOutlineDecoration; k < decorations->size(); k++) {
+				Decoration const& d = (*decorations)[k];
+				extendLineBounds(line, roundf(d.left), roundf(d.top), roundf(d.right), roundf(d.bottom));
+			}
+			decorations->clear();
+		}
+		result.glyphs.clear();
+		line.firstGlyph = line.firstDecoration = line.firstOutlineDecoration = 0;
+	};
+
+	auto setLineStarts = [&]() {
+		if (dropLines)
+			dropLineOutput();
+		result.lines.push_back(Line { i_atWordStart + whitespacesAtWordStart, pos.y, 0.f, result.glyphs.size(), result.decorations.size(), result.outlineDecorations.size(),
+			noBound, noBound, -noBound, -noBound, -noBound, 0.f, 0.f });
+	};
+
+	//Once everything on the last line is known, it moves down by how much taller than the size of the settings its largest glyphs are,
+	//and what comes after it by that and how much deeper they are
+	auto finishLine = [&]() {
+		Line& line = result.lines.back();
+		unsigned int largest = characterSize;
+		for (size_t g = line.firstGlyph; g < result.glyphs.size(); g++)
+			largest = std::max<unsigned int>(largest, result.runs[result.glyphs[g].run].characterSize);
+		if (largest == characterSize)
+			return;
+
+		float above = static_cast<float>(largest - characterSize);
+		float below = std::max(0.f, (metrics.getLineSpacing(largest) - largest) - (metrics.getLineSpacing(characterSize) - characterSize));
+		line.verticalPosition += above;
+		line.sizeShift = above;
+		line.top += above;
+		line.bottom += above;
+		for (size_t g = line.firstGlyph; g < result.glyphs.size(); g++)
+			result.glyphs[g].position.y += above;
+		for (size_t k = line.firstDecoration; k < result.decorations.size(); k++) {
+			result.decorations[k].top += above;
+			result.decorations[k].bottom += above;
+		}
+		for (size_t k = line.firstOutlineDecoration; k < result.outlineDecorations.size(); k++) {
+			result.outlineDecorations[k].top += above;
+			result.outlineDecorations[k].bottom += above;
+		}
+
+		float movement = above + below;
+		pos.y += movement;
+		underlineStart.y += movement;
+		underlineOutlineStart.y += movement;
+		strikeThroughStart.y += movement;
+		strikeThroughOutlineStart.y += movement;
+		for (PlacedGlyph& glyph : m_wordGlyphs)
+			glyph.position.y += movement;
+		for (std::vector<Decoration>* decorations : { &m_wordDecorations, &m_wordOutlineDecorations }) {
+			for (Decoration& decoration : *decorations) {
+				decoration.top += movement;
+				decoration.bottom += movement;
+			}
+		}
+	};
+
+	sf::Uint32 previousChar = p.previousChar;
+	size_t len = string.getSize();
+
+	while (i < len) {
+		//Once the budget is spent, stops at the start of a line, before anything was placed on it
+		Line const& lastLine = result.lines.back();
+		if (currentLine != startLine && !reachedCharacterLimit && lastLine.firstGlyph == result.glyphs.size()
+				&& lastLine.firstDecoration == result.decorations.size() && lastLine.firstOutlineDecoration == result.outlineDecorations.size()
+				&& (currentLine - startLine >= settings.lineBudget || (timed && std::chrono::steady_clock::now() >= deadline))) {
+			p = Progress { i, pos, i_displayOnly, whitespaceWidth, letterSpacing, lineSpacing, lineThickness,
+				underlineStart, underlineOutlineStart, strikeThroughStart, strikeThroughOutlineStart, italicShear, hasOutline,
+				lineSpacingAtWordStart, outlineThicknessAtWordStart, whitespaceWidthAtWordStart, whitespacesAtWordStart, i_atWordStart,
+				currentLineWidth, intentionalLineBreak, currentLine, previousChar, false, true, p.left, p.top, p.right, p.bottom };
+			stopped = true;
+			break;
+		}
+
+		if (i_displayOnly == settings.characterLimit) {
+			if (m_style.underlineds.back()) {
+				addDecoration(m_wordDecorations, underlineStart, pos.x - underlineStart.x, m_style.fillColors.back(), lineThickness);
+				if (hasOutline) {
+					addDecoration(m_wordOutlineDecorations, underlineOutlineStart, pos.x - underlineOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
+				}
+			}
+			if (m_style.strikeThroughs.back()) {
+				addDecoration(m_wordDecorations, strikeThroughStart, pos.x - strikeThroughStart.x, m_style.fillColors.back(), lineThickness);
+				if (hasOutline) {
+					addDecoration(m_wordOutlineDecorations, strikeThroughOutlineStart, pos.x - strikeThroughOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
+				}
+			}
+
+			reachedCharacterLimit = true;
+		}
+
+		if (it != stylizers.end() && it->first == i) { //If stylizers exist at i
+			bool shouldUpdateUnderline = false, shouldUpdateUnderlineOutline = false, shouldUpdateStrikeThrough = false, shouldUpdateStrikeThroughOutline = false;
+			bool wasUnderlined = m_style.underlineds.back();
+			bool wasStrikeThrough = m_style.strikeThroughs.back();
+			bool hadOutline = hasOutline;
+			float oldLineThickness = lineThickness;
+			sf::Color oldFillColor = m_style.fillColors.back();
+			float oldOutlineThickness = m_style.outlineThicknesses.back();
+			sf::Color oldOutlineColor = m_style.outlineColors.back();
+			bool resized = false;
+
+			while (it != stylizers.end() && it->first == i) { //Modify the style; the return type gives info on whether or not the modification changed the style visually
+				result.stylizerLines[it->second->index] = currentLine;
+				m_statistics.stylizersReplayed++;
+				switch (it->second->stylize(m_style)) {
+				case Stylizer::Italic:
+					italicShear = m_style.italics.back() ? 0.209f : 0.f;
+					break;
+				case Stylizer::Underlined:
+					shouldUpdateUnderline = true;
+					shouldUpdateUnderlineOutline = true;
+					break;
+				case Stylizer::StrikeThrough:
+					shouldUpdateStrikeThrough = true;
+					shouldUpdateStrikeThroughOutline = true;
+					break;
+				case Stylizer::FillColor:
+					shouldUpdateUnderline = true;
+					shouldUpdateStrikeThrough = true;
+					break;
+				case Stylizer::OutlineThickness:
+					shouldUpdateUnderlineOutline = true;
+					shouldUpdateStrikeThroughOutline = true;
+					hasOutline = m_style.outlineThicknesses.back() != 0.f;
+					break;
+				case Stylizer::OutlineColor:
+					shouldUpdateUnderlineOutline = true;
+					shouldUpdateStrikeThroughOutline = true;
+					break;
+				case Stylizer::CharacterSize: //Decorations are split where the size changes, like where the colour does
+					shouldUpdateUnderline = true;
+					shouldUpdateUnderlineOutline = true;
+					shouldUpdateStrikeThrough = true;
+					shouldUpdateStrikeThroughOutline = true;
+					glyphSize = m_style.getCharacterSize(characterSize);
+					lineThickness = metrics.getUnderlineThickness(glyphSize);
+					resized = true;
+					whitespaceWidth = metrics.getGlyph(L' ', glyphSize, false, 0.f).advance;
+					letterSpacing = (whitespaceWidth / 3.f) * (m_style.letterSpacingFactors.back() - 1.f);
+					whitespaceWidth += letterSpacing;
+					break;
+				case Stylizer::LetterSpacing:
+					whitespaceWidth = metrics.getGlyph(L' ', glyphSize, false, 0.f).advance;
+					letterSpacing = (whitespaceWidth / 3.f) * (m_style.letterSpacingFactors.back() - 1.f);
+					whitespaceWidth += letterSpacing;
+					break;
+				case Stylizer::LineSpacing:
+					lineSpacing = metrics.getLineSpacing(characterSize) * m_style.lineSpacingFactors.back();
+					break;
+				default:
+					break;
+				}
+				it++;
+			}
+
+			if (!reachedCharacterLimit) {
+				if (shouldUpdateUnderline) {
+					if (wasUnderlined)
+						addDecoration(m_wordDecorations, underlineStart, pos.x - underlineStart.x, oldFillColor, oldLineThickness);
+					if (m_style.underlineds.back())
+						underlineStart.x = pos.x;
+				}
+				if (shouldUpdateStrikeThrough) {
+					if (wasStrikeThrough)
+						addDecoration(m_wordDecorations, strikeThroughStart, pos.x - strikeThroughStart.x, oldFillColor, oldLineThickness);
+					if (m_style.strikeThroughs.back())
+						strikeThroughStart.x = pos.x;
+				}
+				if (shouldUpdateUnderlineOutline) {
+					if (hadOutline && wasUnderlined)
+						addDecoration(m_wordOutlineDecorations, underlineOutlineStart, pos.x - underlineOutlineStart.x, oldOutlineColor, oldLineThickness, oldOutlineThickness);
+					if (hasOutline && m_style.underlineds.back())
+						underlineOutlineStart.x = pos.x;
+				}
+				if (shouldUpdateStrikeThroughOutline) {
+					if (hadOutline && wasStrikeThrough)
+						addDecoration(m_wordOutlineDecorations, strikeThroughOutlineStart, pos.x - strikeThroughOutlineStart.x, oldOutlineColor, oldLineThickness, oldOutlineThickness);
+					if (hasOutline && m_style.strikeThroughs.back())
+						strikeThroughOutlineStart.x = pos.x;
+				}
+			}
+
+			if (resized) {
+				underlineStart.y = pos.y + metrics.getUnderlinePosition(glyphSize);
+				underlineOutlineStart.y = underlineStart.y;
+				sf::FloatRect xBounds = metrics.getGlyph(L'x', glyphSize, false, 0.f).bounds;
+				strikeThroughStart.y = pos.y + xBounds.top + xBounds.height * 0.4f;
+				strikeThroughOutlineStart.y = strikeThroughStart.y;
+			}
+		}
+
+		sf::Uint32 currentChar = string[i];
+
+		bool shouldStop = false;
+
+		switch (currentChar) {
+		case ' ': {
+			if (reachedCharacterLimit) {
+				shouldStop = true;
+				break;
+			}
+			if (!m_wordGlyphs.empty()) {
+				addWordToText();
+				resetWord();
+				intentionalLineBreak = false;
+			}
+
+			pos.x += whitespaceWidth;
+			if (intentionalLineBreak) {
+				currentLineWidth = pos.x;
+			}
+			else {
+				whitespaceWidthAtWordStart += whitespaceWidth;
+				whitespacesAtWordStart++;
+			}
+			break;
+		}
+		case '\t': {
+			if (reachedCharacterLimit) {
+				shouldStop = true;
+				break;
+			}
+			float added = whitespaceWidth*8;
+			added -= fmodf(pos.x + added, whitespaceWidth*8);
+			if (!m_wordGlyphs.empty()) {
+				addWordToText();
+				resetWord();
+				intentionalLineBreak = false;
+			}
+
+			pos.x += added;
+			if (intentionalLineBreak) {
+				currentLineWidth = pos.x;
+			}
+			else {
+				whitespaceWidthAtWordStart += added;
+				whitespacesAtWordStart++;
+			}
+			break;
+		}
+		case '\n': {
+			if (reachedCharacterLimit) {
+				shouldStop = true;
+				break;
+			}
+			if (currentLine + 1 >= settings.maxLines) { //The line ends like the text would
+				firstHiddenCharacter = i;
+				shouldStop = true;
+				break;
+			}
+
+			addWordToText();
+			resetWord();
+
+			if (m_style.underlineds.back()) {
+				addDecoration(result.decorations, underlineStart, pos.x - underlineStart.x, m_style.fillColors.back(), lineThickness);
+				if (hasOutline) {
+					addDecoration(result.outlineDecorations, underlineOutlineStart, pos.x - underlineOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
+				}
+			}
+			if (m_style.strikeThroughs.back()) {
+				addDecoration(result.decorations, strikeThroughStart, pos.x - strikeThroughStart.x, m_style.fillColors.back(), lineThickness);
+				if (hasOutline) {
+					addDecoration(result.outlineDecorations, strikeThroughOutlineStart, pos.x - strikeThroughOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
+				}
+			}
+			pos.x = 0;
+			pos.y += lineSpacing;
+
+			underlineStart.x = 0;
+			underlineStart.y += lineSpacing;
+			underlineOutlineStart = underlineStart;
+			strikeThroughStart.x = 0;
+			strikeThroughStart.y += lineSpacing;
+			strikeThroughOutlineStart = strikeThroughStart;
+
+			currentLineWidth = 0;
+			currentLine++;
+			whitespacesAtWordStart++;
+
+			finishLine();
+			setLineStarts();
+
+			intentionalLineBreak = true;
+			break;
+		}
+		default: {
+			//Between glyphs, a break opportunity (after a hyphen, around an ideograph...) ends the word like whitespace would
+			if (isBreakOpportunity(previousChar, currentChar)) {
+				if (reachedCharacterLimit) {
+					shouldStop = true;
+					break;
+				}
+				if (!m_wordGlyphs.empty()) {
+					addWordToText();
+					resetWord();
+					intentionalLineBreak = false;
+				}
+			}
+
+			pos.x += metrics.getKerning(previousChar, string[i], glyphSize);
+
+			sf::Glyph g = metrics.getGlyph(string[i], glyphSize, m_style.bolds.back(), 0.f);
+			if (!reachedCharacterLimit) {
+				sf::Uint32 run = currentRun(metrics.getFont(string[i]));
+				float outlineThickness = result.runs[run].outlineThickness;
+				m_wordGlyphs.push_back(PlacedGlyph { pos, string[i], run });
+				m_wordGlyphMetrics.push_back(WordGlyph { g.bounds, outlineThickness != 0.f ? metrics.getGlyph(string[i], glyphSize, m_style.bolds.back(), outlineThickness).bounds : sf::FloatRect() });
+			}
+			pos.x += g.advance + letterSpacing;
+			i_displayOnly++;
+
+			//Move the word down a line if it became too long
+			if (currentLineWidth != 0.f && pos.x > settings.horizontalLimit) {
+				float extendedLineWidth = currentLineWidth + whitespaceWidthAtWordStart;
+				sf::Vector2f wordMovement(-extendedLineWidth, lineSpacingAtWordStart);
+
+				//If a line was in progress and started before the word, finish it before moving on. Lines starting in the whitespace before
+				//the word (where a style changed) start with the word instead, like they would on a line laid out from there
+				if (!reachedCharacterLimit) {
+					if (m_style.underlineds.back()) {
+						if (underlineStart.x < currentLineWidth)
+							addDecoration(result.decorations, underlineStart, currentLineWidth - underlineStart.x, m_style.fillColors.back(), lineThickness);
+						if (hasOutline && underlineOutlineStart.x < currentLineWidth)
+							addDecoration(result.outlineDecorations, underlineOutlineStart, currentLineWidth - underlineOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
+					}
+					if (m_style.strikeThroughs.back()) {
+						if (strikeThroughStart.x < currentLineWidth)
+							addDecoration(result.decorations, strikeThroughStart, currentLineWidth - strikeThroughStart.x, m_style.fillColors.back(), lineThickness);
+						if (hasOutline && strikeThroughOutlineStart.x < currentLineWidth)
+							addDecoration(result.outlineDecorations, strikeThroughOutlineStart, currentLineWidth - strikeThroughOutlineStart.x, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
+					}
+					for (sf::Vector2f* start : { &underlineStart, &underlineOutlineStart, &strikeThroughStart, &strikeThroughOutlineStart })
+						start->x = std::max(start->x, extendedLineWidth);
+				}
+
+				//If any finished decoration in the word stemmed from before it, cut it in half at the start of the word (one half will stay, the other will move with the word)
+				for (Decoration& decoration : m_wordDecorations) {
+					if (decoration.left <= currentLineWidth) {
+						Decoration kept = decoration;
+						kept.right = roundf(currentLineWidth); //Shorten the end of the first half, which will stay on the line
+						result.decorations.push_back(kept);
+					}
+					decoration.left = fmaxf(decoration.left, extendedLineWidth); //Push the beginning of the second, which will go down with the word afterwards
+					decoration.right = fmaxf(decoration.right, decoration.left);
+					decoration.left += wordMovement.x;
+					decoration.right += wordMovement.x;
+					decoration.top += wordMovement.y;
+					decoration.bottom += wordMovement.y;
+				}
+				for (Decoration& decoration : m_wordOutlineDecorations) {
+					if (decoration.left + outlineThicknessAtWordStart <= currentLineWidth) {
+						Decoration kept = decoration;
+						kept.right = roundf(currentLineWidth + outlineThicknessAtWordStart);
+						result.outlineDecorations.push_back(kept);
+					}
+					decoration.left = fmaxf(decoration.left, extendedLineWidth - outlineThicknessAtWordStart);
+					decoration.right = fmaxf(decoration.right, decoration.left);
+					decoration.left += wordMovement.x;
+					decoration.right += wordMovement.x;
+					decoration.top += wordMovement.y;
+					decoration.bottom += wordMovement.y;
+				}
+				//Halves that ended where the word starts have nothing left to move, as if the line had been laid out from the word
+				for (std::vector<Decoration>* decorations : { &m_wordDecorations, &m_wordOutlineDecorations })
+					decorations->erase(std::remove_if(decorations->begin(), decorations->end(), [](Decoration const& d) { return d.left >= d.right; }), decorations->end());
+
+				//On the last line allowed, the line is finished and the word dropped instead
+				if (!reachedCharacterLimit && currentLine + 1 >= settings.maxLines) {
+					m_wordGlyphs.clear();
+					m_wordGlyphMetrics.clear();
+					m_wordDecorations.clear();
+					m_wordOutlineDecorations.clear();
+					firstHiddenCharacter = i_atWordStart + whitespacesAtWordStart;
+					lineFinished = true;
+					shouldStop = true;
+					break;
+				}
+
+				for (PlacedGlyph& glyph : m_wordGlyphs)
+					glyph.position += wordMovement;
+
+				pos += wordMovement;
+				underlineStart += wordMovement;
+				underlineOutlineStart += wordMovement;
+				strikeThroughStart += wordMovement;
+				strikeThroughOutlineStart += wordMovement;
+
+				currentLineWidth = 0;
+				currentLine++;
+
+				finishLine();
+				setLineStarts();
+
+				if (reachedCharacterLimit)
+					shouldStop = true;
+			}
+
+			break;
+		}
+		}
+
+		if (shouldStop)
+			break;
+
+		previousChar = string[i];
+		i++;
+	}
+
+	if (!reachedCharacterLimit && !stopped && !lineFinished) {
+		float excessWhiteSpace = m_wordGlyphs.empty() ? whitespaceWidthAtWordStart : 0;
+		if (m_style.underlineds.back()) {
+			addDecoration(m_wordDecorations, underlineStart, pos.x - underlineStart.x - excessWhiteSpace, m_style.fillColors.back(), lineThickness);
+			if (hasOutline)
+				addDecoration(m_wordOutlineDecorations, underlineOutlineStart, pos.x - underlineOutlineStart.x - excessWhiteSpace, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
+		}
+		if (m_style.strikeThroughs.back()) {
+			addDecoration(m_wordDecorations, strikeThroughStart, pos.x - strikeThroughStart.x - excessWhiteSpace, m_style.fillColors.back(), lineThickness);
+			if (hasOutline)
+				addDecoration(m_wordOutlineDecorations, strikeThroughOutlineStart, pos.x - strikeThroughOutlineStart.x - excessWhiteSpace, m_style.outlineColors.back(), lineThickness, m_style.outlineThicknesses.back());
+		}
+	}
+
+	if (!stopped) {
+		addWordToText();
+		finishLine();
+	}
+	m_statistics.charactersScanned = i - startCharacter;
+
+	//A layout ended by the line limit ends its last line with the ellipsis, giving up glyphs from the end until it fits
+	result.firstHiddenCharacter = firstHiddenCharacter;
+	if (firstHiddenCharacter != std::numeric_limits<size_t>::max() && !settings.ellipsis.isEmpty()) {
+		Line& line = result.lines.back();
+		float start = m_wordGlyphs.empty() ? currentLineWidth : pos.x;
+		StyleRun run = result.runs[result.glyphs.size() > line.firstGlyph ? result.glyphs.back().run : currentRun(0)];
+		sf::String const& ellipsis = settings.ellipsis;
+		float ellipsisWidth = 0.f;
+		for (size_t k = 0; k < ellipsis.getSize(); k++) {
+			if (k > 0)
+				ellipsisWidth += metrics.getKerning(ellipsis[k-1], ellipsis[k], run.characterSize);
+			ellipsisWidth += metrics.getGlyph(ellipsis[k], run.characterSize, run.bold, 0.f).advance + letterSpacing;
+		}
+
+		size_t kept = result.glyphs.size();
+		while (kept > line.firstGlyph && start + ellipsisWidth > settings.horizontalLimit) {
+			kept--;
+			start = result.glyphs[kept].position.x;
+			do
+				firstHiddenCharacter--;
+			while (string[firstHiddenCharacter] == ' ' || string[firstHiddenCharacter] == '\t' || string[firstHiddenCharacter] == '\n');
+		}
+		if (kept < result.glyphs.size()) {
+			result.firstHiddenCharacter = firstHiddenCharacter;
+			result.glyphs.resize(kept);
+			result.runs.resize(result.glyphs.empty() ? 0 : result.glyphs.back().run + 1);
+
+			//Decorations end where the ellipsis starts, and the line is measured again without the glyphs given up
+			for (std::vector<Decoration>* decorations : { &result.decorations, &result.outlineDecorations }) {
+				size_t first = decorations == &result.decorations ? line.firstDecoration : line.firstOutlineDecoration;
+				for (size_t k = first; k < decorations->size(); k++)
+					(*decorations)[k].right = fminf((*decorations)[k].right, start);
+				decorations->erase(std::remove_if(decorations->begin() + first, decorations->end(), [](Decoration const& d) { return d.left >= d.right; }), decorations->end());
+			}
+			line.left = line.top = noBound;
+			line.right = line.bottom = -noBound;
+			for (size_t g = line.firstGlyph; g < kept; g++) {
+				PlacedGlyph const& glyph = result.glyphs[g];
+				StyleRun const& glyphRun = result.runs[glyph.run];
+				measureGlyph(line, glyph, metrics.getGlyph(glyph.codePoint, glyphRun.characterSize, glyphRun.bold, 0.f).bounds,
+					glyphRun.outlineThickness != 0.f ? metrics.getGlyph(glyph.codePoint, glyphRun.characterSize, glyphRun.bold, glyphRun.outlineThickness).bounds : sf::FloatRect());
+			}
+		}
+
+		sf::Vector2f position(start, line.verticalPosition);
+		for (size_t k = 0; k < ellipsis.getSize(); k++) {
+			run.font = static_cast<sf::Uint8>(metrics.getFont(ellipsis[k]));
+			if (result.runs.empty() || !(result.runs.back() == run))
+				result.runs.push_back(run);
+			if (k > 0)
+				position.x += metrics.getKerning(ellipsis[k-1], ellipsis[k], run.characterSize);
+			sf::Glyph g = metrics.getGlyph(ellipsis[k], run.characterSize, run.bold, 0.f);
+			result.glyphs.push_back(PlacedGlyph { position, ellipsis[k], static_cast<sf::Uint32>(result.runs.size() - 1) });
+			measureGlyph(line, result.glyphs.back(), g.bounds, run.outlineThickness != 0.f ? metrics.getGlyph(ellipsis[k], run.characterSize, run.bold, run.outlineThickness).bounds : sf::FloatRect());
+			position.x += g.advance + letterSpacing;
+		}
+	}
+
+	for (std::vector<Decoration>* decorations : { &result.decorations, &result.outlineDecorations }) {
+		size_t start = decorations == &result.decorations ? startOfNewDecorations : startOfNewOutlineDecorations;
+		for (size_t k = start; k < decorations->size(); k++) {
+			Decoration& decoration = (*decorations)[k];
+			decoration.left = roundf(decoration.left);
+			decoration.top = roundf(decoration.top);
+			decoration.right = roundf(decoration.right);
+			decoration.bottom = roundf(decoration.bottom);
+		}
+	}
+
+	//Bounds of the new lines, then of everything
+	for (size_t l = startLine; l < result.lines.size(); l++) {
+		Line& line = result.lines[l];
+		bool last = l+1 == result.lines.size();
+		for (size_t k = line.firstDecoration; k < (last ? result.decorations.size() : result.lines[l+1].firstDecoration); k++) {
+			Decoration const& d = result.decorations[k];
+			extendLineBounds(line, d.left, d.top, d.right, d.bottom);
+		}
+		for (size_t k = line.firstOutlineDecoration; k < (last ? result.outlineDecorations.size() : result.lines[l+1].firstOutlineDecoration); k++) {
+			Decoration const& d = result.outlineDecorations[k];
+			extendLineBounds(line, d.left, d.top, d.right, d.bottom);
+		}
+		line.width = line.right;
+	}
+
+	//The new lines are moved to their alignment, and the earlier ones too if they are aligned to the widest line and it changed
+	bool widest = !(settings.horizontalLimit < noBound) && settings.alignment != Left;
+	alignLines(string, settings, result, widest ? 0 : startLine, startLine);
+	if (m_firstMovedLine < startLine)
+		resumed = false;
+
+	//Lines before the one a stopped layout will resume from are final, so their bounds are kept rather than gathered again by every call
+	float minX = noBound, minY = noBound, maxX = std::numeric_limits<float>::lowest(), maxY = std::numeric_limits<float>::lowest();
+	size_t firstLine = 0;
+	if (resumed) {
+		minX = p.left;
+		minY = p.top;
+		maxX = p.right;
+		maxY = p.bottom;
+		firstLine = startLine;
+	}
+	for (size_t l = firstLine; l < result.lines.size(); l++) {
+		Line const& line = result.lines[l];
+		if (stopped && l+1 == result.lines.size()) {
+			p.left = minX;
+			p.top = minY;
+			p.right = maxX;
+			p.bottom = maxY;
+		}
+		minX = fminf(minX, line.left);
+		minY = fminf(minY, line.top);
+		maxX = fmaxf(maxX, line.right);
+		maxY = fmaxf(maxY, line.bottom);
+	}
+	result.bounds = sf::FloatRect(minX, minY, maxX - minX, maxY - minY);
+	return !stopped;
+}
+
+sf::FloatRect RichTextLayout::findCharacterBounds(sf::String const& string, Stylizers const& stylizers, VariableStyle const& style, Settings const& settings, size_t index,
+		Result const* laidOut) {
+	TabularDigits tabular(*settings.metrics);
+	MetricsProvider const& metrics = settings.tabularDigits ? tabular : *settings.metrics;
+	unsigned int characterSize = settings.characterSize;
+	m_statistics = Statistics();
+	m_style = style;
+
+	float whitespaceWidth = metrics.getGlyph(L' ', characterSize, false, 0.f).advance;
+	float letterSpacing = (whitespaceWidth / 3.f) * (m_style.letterSpacingFactors.front() - 1.f);
+	float lineSpacing = metrics.getLineSpacing(characterSize) * m_style.lineSpacingFactors.front();
+
+	sf::Vector2f pos(0, lineSpacing - characterSize);
+	bool inWord = false;
+	float currentLineWidth = 0;
+	bool intentionalLineBreak = true;
+	float whiteSpaceWidthAtWordStart = 0;
+
+	bool passedTarget = false;
+	bool shouldStop = false;
+	float extraWidth = 0;
+
+	float characterWidth = 0;
+	unsigned int glyphSize = characterSize;
+	unsigned int targetSize = characterSize;
+
+	auto it = stylizers.begin();
+	sf::Uint32 previousChar = 0;
+	size_t i = 0;
+	while (i < string.getSize() && !shouldStop) {
+		if (i >= index)
+			passedTarget = true;
+
+		while (it != stylizers.end() && it->first <= i) {
+			m_statistics.stylizersReplayed++;
+			switch (it->second->stylize(m_style)) {
+			case Stylizer::LetterSpacing:
+			case Stylizer::CharacterSize:
+				glyphSize = m_style.getCharacterSize(characterSize);
+				whitespaceWidth = metrics.getGlyph(L' ', glyphSize, false, 0.f).advance;
+				letterSpacing = (whitespaceWidth / 3.f) * (m_style.letterSpacingFactors.back() - 1.f);
+				whitespaceWidth += letterSpacing;
+				break;
+			case Stylizer::LineSpacing:
+				lineSpacing = metrics.getLineSpacing(characterSize) * m_style.lineSpacingFactors.back();
+				break;
+			default:
+				break;
+			}
+			it++;
+		}
+		if (i == index)
+			targetSize = glyphSize;
+
+		switch (string[i]) {
+		case ' ':
+			if (i == index)
+				characterWidth = whitespaceWidth;
+			if (passedTarget) {
+				shouldStop = true;
+				break;
+			}
+			if (inWord) {
+				inWord = false;
+				whiteSpaceWidthAtWordStart = 0;
+				currentLineWidth = pos.x;
+				intentionalLineBreak = false;
+			}
+
+			pos.x += whitespaceWidth;
+			if (intentionalLineBreak) {
+				currentLineWidth = pos.x;
+			}
+			else {
+				whiteSpaceWidthAtWordStart += whitespaceWidth;
+			}
+			break;
+		case '\n':
+			if (i == index)
+				characterWidth = whitespaceWidth;
+			if (passedTarget) {
+				shouldStop = true;
+				break;
+			}
+			inWord = false;
+			whiteSpaceWidthAtWordStart = 0;
+			pos.x = 0;
+			pos.y += lineSpacing;
+			currentLineWidth = pos.x;
+			intentionalLineBreak = true;
+			break;
+		case '\t': {
+			float added = whitespaceWidth*8;
+			added -= fmodf(pos.x + added, whitespaceWidth*8);
+			if (i == index)
+				characterWidth = added;
+			if (passedTarget) {
+				shouldStop = true;
+				break;
+			}
+			if (inWord) {
+				inWord = false;
+				whiteSpaceWidthAtWordStart = 0;
+				currentLineWidth = pos.x;
+				intentionalLineBreak = false;
+			}
+
+			pos.x += added;
+			if (intentionalLineBreak) {
+				currentLineWidth = pos.x;
+			}
+			else {
+				whiteSpaceWidthAtWordStart += added;
+			}
+			break;
+		}
+		default:
+			if (isBreakOpportunity(previousChar, string[i])) {
+				if (passedTarget && i != index) {
+					shouldStop = true;
+					break;
+				}
+				currentLineWidth = pos.x;
+				whiteSpaceWidthAtWordStart = 0;
+			}
+			float added = metrics.getKerning(previousChar, string[i], glyphSize) + metrics.getGlyph(string[i], glyphSize, m_style.bolds.back(), 0.f).advance + letterSpacing;
+			pos.x += added;
+			if (i == index)
+				characterWidth = added;
+			if (passedTarget)
+				extraWidth += added;
+
+			if (currentLineWidth > 0 && pos.x > settings.horizontalLimit) {
+				pos.x -= currentLineWidth + whiteSpaceWidthAtWordStart;
+				pos.y += lineSpacing;
+				currentLineWidth = 0;
+			}
+			break;
+		}
+
+		previousChar = string[i];
+		i++;
+	}
+
+	m_statistics.charactersScanned = i;
+	float top = pos.y;
+	if (laidOut && !laidOut->lines.empty()) {
+		auto after = std::upper_bound(laidOut->lines.begin() + 1, laidOut->lines.end(), index, [](size_t index, Line const& line) { return index < line.firstCharacter; });
+		top = (after - 1)->verticalPosition - targetSize;
+	}
+	else if (targetSize != characterSize)
+		top += static_cast<float>(characterSize) - targetSize;
+	if (targetSize != characterSize)
+		lineSpacing += metrics.getLineSpacing(targetSize) - metrics.getLineSpacing(characterSize);
+	return sf::FloatRect(pos.x - extraWidth, top, characterWidth, lineSpacing);
+}
+
+RichTextLayout::Statistics const& RichTextLayout::getStatistics() const { return m_statistics; }
+
+void RichTextLayout::align(sf::String const& string, Settings const& settings, Result& result) {
+	alignLines(string, settings, result, 0, result.lines.size());
+	if (m_firstMovedLine == result.lines.size())
+		return;
+
+	//Bounds of everything, and of the lines before the one a stopped layout resumes from
+	float minX = std::numeric_limits<float>::infinity(), minY = minX, maxX = std::numeric_limits<float>::lowest(), maxY = maxX;
+	for (size_t l = 0; l < result.lines.size(); l++) {
+		Line const& line = result.lines[l];
+		if (l+1 == result.lines.size()) {
+			m_progress.left = minX;
+			m_progress.top = minY;
+			m_progress.right = maxX;
+			m_progress.bottom = maxY;
+		}
+		minX = fminf(minX, line.left);
+		minY = fminf(minY, line.top);
+		maxX = fmaxf(maxX, line.right);
+		maxY = fmaxf(maxY, line.bottom);
+	}
+	result.bounds = sf::FloatRect(minX, minY, maxX - minX, maxY - minY);
+}
+
+size_t RichTextLayout::getFirstMovedLine() const { return m_firstMovedLine; }
+std::vector<float> const& RichTextLayout::getGlyphMovements() const { return m_glyphMovements; }
+
+void RichTextLayout::alignLines(sf::String const& string, Settings const& settings, Result& result, size_t firstLine, size_t newLine) {
+	m_firstMovedLine = result.lines.size();
+	m_glyphMovements.clear();
+
+	float width = settings.horizontalLimit;
+	if (!(width < std::numeric_limits<float>::infinity())) {
+		width = 0.f;
+		for (Line const& line : result.lines)
+			width = fmaxf(width, line.width);
+	}
+	auto shift = [](float offset, float gapSpacing, size_t gaps) { return offset + roundf(gaps * gapSpacing); };
+
+	for (size_t l = firstLine; l < result.lines.size(); l++) {
+		Line& line = result.lines[l];
+		if (line.left > line.right)
+			continue;
+		bool last = l+1 == result.lines.size();
+		size_t endGlyph = last ? result.glyphs.size() : result.lines[l+1].firstGlyph;
+
+		float offset = 0.f, gapSpacing = 0.f;
+		if (settings.alignment == Center)
+			offset = roundf((width - line.width) / 2.f);
+		else if (settings.alignment == Right)
+			offset = roundf(width - line.width);
+
+		//Words after a gap start a pixel before their first glyph, so that decorations starting with a word move with it
+		bool justified = settings.alignment == Justify && !last && width > line.width;
+		bool gapped = justified || line.gapSpacing != 0.f;
+		size_t gaps = 0;
+		if (gapped) {
+			size_t i = findGaps(string, result, l, m_gapIndices);
+			gaps = m_gapIndices.empty() ? 0 : static_cast<size_t>(m_gapIndices.back());
+			m_wordStarts.clear();
+			for (size_t g = line.firstGlyph + 1; g < endGlyph; g++) {
+				float k = m_gapIndices[g - line.firstGlyph];
+				if (k != m_gapIndices[g - line.firstGlyph - 1])
+					m_wordStarts.push_back(result.glyphs[g].position.x + shift(line.offset, line.gapSpacing, k) - 1.f);
+			}
+
+			//The last line of a paragraph isn't stretched
+			for (; justified && i < result.lines[l+1].firstCharacter; i++) {
+				if (string[i] == '\n')
+					justified = false;
+			}
+			if (justified && gaps > 0)
+				gapSpacing = (width - line.width) / gaps;
+		}
+		if (offset == line.offset && gapSpacing == line.gapSpacing)
+			continue;
+
+		if (l < newLine) {
+			if (m_firstMovedLine == result.lines.size())
+				m_firstMovedLine = l;
+			size_t firstMovedGlyph = result.lines[m_firstMovedLine].firstGlyph;
+			m_glyphMovements.resize(endGlyph - firstMovedGlyph, 0.f);
+			for (size_t g = line.firstGlyph; g < endGlyph; g++) {
+				size_t k = gapped ? static_cast<size_t>(m_gapIndices[g - line.firstGlyph]) : 0;
+				m_glyphMovements[g - firstMovedGlyph] = shift(offset, gapSpacing, k) - shift(line.offset, line.gapSpacing, k);
+			}
+		}
+
+		//Decorations spanning a gap are stretched over it
+		for (std::vector<Decoration>* decorations : { &result.decorations, &result.outlineDecorations }) {
+			bool outline = decorations == &result.outlineDecorations;
+			size_t first = outline ? line.firstOutlineDecoration : line.firstDecoration;
+			size_t end = last ? decorations->size() : (outline ? result.lines[l+1].firstOutlineDecoration : result.lines[l+1].firstDecoration);
+			for (size_t k = first; k < end; k++) {
+				for (float* edge : { &(*decorations)[k].left, &(*decorations)[k].right }) {
+					size_t edgeGaps = gapped ? std::upper_bound(m_wordStarts.begin(), m_wordStarts.end(), *edge) - m_wordStarts.begin() : 0;
+					*edge += shift(offset, gapSpacing, edgeGaps) - shift(line.offset, line.gapSpacing, edgeGaps);
+				}
+			}
+		}
+
+		line.left += offset - line.offset;
+		line.right = line.width + shift(offset, gapSpacing, gaps);
+		line.offset = offset;
+		line.gapSpacing = gapSpacing;
+	}
+}
+
+size_t RichTextLayout::findGaps(sf::String const& string, Result const& result, size_t line, std::vector<float>& gapIndices) {
+	//Word gaps are whitespace between two glyphs of the line
+	Line const& start = result.lines[line];
+	size_t endGlyph = line+1 < result.lines.size() ? result.lines[line+1].firstGlyph : result.glyphs.size();
+	gapIndices.clear();
+	size_t g = start.firstGlyph;
+	size_t i = start.firstCharacter;
+	float gaps = 0.f;
+	bool inGap = false;
+	for (; i < string.getSize() && g < endGlyph; i++) {
+		if (string[i] == ' ' || string[i] == '\t' || string[i] == '\n') {
+			inGap = g > start.firstGlyph;
+			continue;
+		}
+		if (inGap)
+			gaps++;
+		inGap = false;
+		gapIndices.push_back(gaps);
+		g++;
+	}
+	gapIndices.resize(endGlyph - start.firstGlyph, gaps);
+	return i;
+}
+
+void RichTextLayout::getGlyphShifts(sf::String const& string, Result const& result, size_t line, std::vector<float>& shifts) {
+	Line const& start = result.lines[line];
+	if (start.gapSpacing == 0.f) {
+		size_t endGlyph = line+1 < result.lines.size() ? result.lines[line+1].firstGlyph : result.glyphs.size();
+		shifts.assign(endGlyph - start.firstGlyph, start.offset);
+		return;
+	}
+	findGaps(string, result, line, shifts);
+	for (float& shift : shifts)
+		shift = start.offset + roundf(shift * start.gapSpacing);
+}
+
+float RichTextLayout::getAlignmentMovement(sf::String const& string, Result const& result, size_t index) {
+	auto next = std::upper_bound(result.lines.begin(), result.lines.end(), index, [](size_t index, Line const& line) { return index < line.firstCharacter; });
+	if (next == result.lines.begin())
+		return 0.f;
+	Line const& line = *(next - 1);
+	if (line.gapSpacing == 0.f)
+		return line.offset;
+
+	size_t gaps = 0;
+	bool inGap = false, seenGlyph = false;
+	for (size_t i = line.firstCharacter; i <= index && i < string.getSize(); i++) {
+		if (string[i] == ' ' || string[i] == '\t' || string[i] == '\n') {
+			inGap = seenGlyph;
+			continue;
+		}
+		if (inGap)
+			gaps++;
+		inGap = false;
+		seenGlyph = true;
+	}
+	return line.offset + roundf(gaps * line.gapSpacing);
+}
@@ -0,0 +1,347 @@
+#ifndef RICHTEXTLAYOUT_H
+#define RICHTEXTLAYOUT_H
+
+#include <SFML/Graphics.hpp>
+#include <map>
+#include <deque>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <limits>
+#include <string>
+
+//Line breaking and glyph placement of RichText, without any vertex or texture: it reads the parsed string and stylizers,
+//takes glyph metrics from a MetricsProvider and outputs glyph placements, decoration segments and line records.
+//Nothing here needs a GL context unless the metrics provider does (FontMetrics does, MetricsTable doesn't).
+class RichTextLayout
+{
+public:
+	class VariableStyle {
+	public:
+		VariableStyle();
+		void rewind();
+		unsigned int getCharacterSize(unsigned int characterSize) const; //Size in effect: characterSize, unless a size tag is open
+
+		std::deque<bool> bolds;
+		std::deque<bool> italics;
+		std::deque<bool> underlineds;
+		std::deque<bool> strikeThroughs;
+		std::deque<sf::Color> fillColors;
+		std::deque<float> outlineThicknesses;
+		std::deque<sf::Color> outlineColors;
+		std::deque<float> letterSpacingFactors;
+		std::deque<float> lineSpacingFactors;
+		std::deque<float> characterSizes; //0 for the size of the settings
+		std::deque<bool> waves;
+		std::deque<bool> shakes;
+		std::deque<bool> pulses;
+	};
+
+	class Stylizer {
+	public:
+		enum StyleProperty { None, Bold, Italic, Underlined, StrikeThrough, FillColor, OutlineThickness, OutlineColor, LetterSpacing, LineSpacing, CharacterSize, Wave, Shake, Pulse };
+
+		Stylizer(StyleProperty const& type) : m_type(type) {}
+		virtual ~Stylizer() {}
+		virtual StyleProperty stylize(VariableStyle& vs) const = 0; //Return is not necessarily m_type (stylize() computes if the change to vs was visually noticeable)
+		virtual sf::Uint64 hash() const = 0; //Identifies the stylizer's effect, for the layout cache
+		virtual Stylizer* clone() const = 0;
+		StyleProperty getType() const { return m_type; }
+
+		size_t index = 0; //Position in the document's stylizers
+
+	protected:
+		StyleProperty m_type;
+	};
+
+	typedef std::multimap<size_t, Stylizer*> Stylizers; //Mapped to the character they activate at
+
+	//What a layout needs to know about a font. Implementations must be usable from the thread laying out.
+	//A provider may draw from a chain of fonts, the main one followed by the fallbacks for the code points it lacks: getGlyph() and
+	//getKerning() then answer for the font getFont() picks (pairs from different fonts aren't kerned), the rest for the main font
+	class MetricsProvider {
+	public:
+		virtual ~MetricsProvider() {}
+		virtual sf::Glyph getGlyph(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness) const = 0; //textureRect is not used
+		virtual float getKerning(sf::Uint32 first, sf::Uint32 second, unsigned int characterSize) const = 0;
+		virtual float getLineSpacing(unsigned int characterSize) const = 0;
+		virtual float getUnderlinePosition(unsigned int characterSize) const = 0;
+		virtual float getUnderlineThickness(unsigned int characterSize) const = 0;
+		virtual unsigned int getFont(sf::Uint32) const { return 0; } //Index in the chain of the font drawing the code point
+	};
+
+	//Code points a font has a glyph for, as a two-level table: every block of 256 code points points to a bitset, shared between the
+	//blocks that are all empty or all covered. Blocks are probed with sf::Font::hasGlyph() (SFML 2.6) the first time a code point in them is
+	//looked up, so that choosing a font in the layout loop costs two reads rather than FreeType probes. Probing uses the font, like drawing it does
+	class FontCoverage {
+	public:
+		explicit FontCoverage(sf::Font const& font);
+		bool covers(sf::Uint32 codePoint) const;
+
+		//Shared by the users of the font while any holds it: a font loaded later at the address of a released one gets its own
+		static std::shared_ptr<FontCoverage const> of(sf::Font const& font);
+		static unsigned int findFont(std::vector<std::shared_ptr<FontCoverage const>> const& chain, sf::Uint32 codePoint); //First covering, or 0
+
+	private:
+		typedef std::array<sf::Uint64, 4> Bitset;
+		Bitset const* probe(size_t block) const;
+
+		sf::Font const* m_font;
+		mutable std::unique_ptr<std::atomic<Bitset const*>[]> m_blocks; //Null until probed
+		mutable std::deque<Bitset> m_bitsets; //Of the partly covered blocks; never moved once added
+		mutable std::mutex m_mutex;
+	};
+
+	//Asks the fonts directly; sf::Font rasterizes the glyphs it is asked for, so this needs a GL context
+	class FontMetrics : public MetricsProvider {
+	public:
+		FontMetrics(sf::Font const& font, std::vector<sf::Font const*> const& fallbacks = {});
+		virtual sf::Glyph getGlyph(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness) const;
+		virtual float getKerning(sf::Uint32 first, sf::Uint32 second, unsigned int characterSize) const;
+		virtual float getLineSpacing(unsigned int characterSize) const;
+		virtual float getUnderlinePosition(unsigned int characterSize) const;
+		virtual float getUnderlineThickness(unsigned int characterSize) const;
+		virtual unsigned int getFont(sf::Uint32 codePoint) const;
+	private:
+		std::vector<sf::Font const*> m_fonts; //Main font first
+		std::vector<std::shared_ptr<FontCoverage const>> m_coverages; //Empty without fallbacks
+	};
+
+	//Metrics captured once from a font (regular and bold), then usable without it: on worker threads, or saved to a file and loaded by a process
+	//without graphics. Glyphs outside the captured charset are empty; outlined glyphs of an uncaptured thickness are derived from the regular glyph.
+	//Code points of the charset the font lacks are captured from the first fallback font that has them, whose index is kept for getFont()
+	class MetricsTable : public MetricsProvider {
+	public:
+		void capture(sf::Font const& font, sf::String const& charset, std::vector<unsigned int> const& sizes, std::vector<float> const& outlineThicknesses = { 0.f },
+			std::vector<sf::Font const*> const& fallbacks = {});
+		bool saveToFile(std::string const& filename) const;
+		bool loadFromFile(std::string const& filename);
+
+		virtual sf::Glyph getGlyph(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness) const;
+		virtual float getKerning(sf::Uint32 first, sf::Uint32 second, unsigned int characterSize) const;
+		virtual float getLineSpacing(unsigned int characterSize) const;
+		virtual float getUnderlinePosition(unsigned int characterSize) const;
+		virtual float getUnderlineThickness(unsigned int characterSize) const;
+		virtual unsigned int getFont(sf::Uint32 codePoint) const;
+
+	private:
+		struct SizeMetrics {
+			float lineSpacing = 0.f;
+			float underlinePosition = 0.f;
+			float underlineThickness = 0.f;
+		};
+
+		static sf::Uint64 glyphKey(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness);
+		static sf::Uint64 kerningKey(sf::Uint32 first, sf::Uint32 second, unsigned int characterSize);
+
+		std::unordered_map<sf::Uint64, sf::Glyph> m_glyphs;
+		std::unordered_map<sf::Uint64, float> m_kernings; //Only the pairs that are kerned
+		std::map<unsigned int, SizeMetrics> m_sizes;
+		std::unordered_map<sf::Uint32, sf::Uint8> m_fonts; //Only the code points taken from a fallback font
+	};
+
+	//Metrics of another provider in which the digits 0 to 9 all advance by the widest one's advance and aren't kerned, so that numbers with
+	//as many digits take the same room. Digits keep their bounds, at the start of their wider advance
+	class TabularDigits : public MetricsProvider {
+	public:
+		explicit TabularDigits(MetricsProvider const& metrics);
+		virtual sf::Glyph getGlyph(sf::Uint32 codePoint, unsigned int characterSize, bool bold, float outlineThickness) const;
+		virtual float getKerning(sf::Uint32 first, sf::Uint32 second, unsigned int characterSize) const;
+		virtual float getLineSpacing(unsigned int characterSize) const;
+		virtual float getUnderlinePosition(unsigned int characterSize) const;
+		virtual float getUnderlineThickness(unsigned int characterSize) const;
+		virtual unsigned int getFont(sf::Uint32 codePoint) const;
+
+		static bool isDigit(sf::Uint32 codePoint);
+	private:
+		MetricsProvider const& m_metrics;
+		mutable std::map<std::pair<unsigned int, bool>, float> m_advances; //Of the widest digit, by size and boldness, filled as sizes are met
+		mutable std::mutex m_mutex; //A provider may be shared by layouts on several threads
+	};
+
+	//Lines are laid out from the left, then moved within the horizontal limit, or within the widest line without one. Justified lines are
+	//stretched at their word gaps instead, except the last line of every paragraph
+	enum Alignment { Left, Center, Right, Justify };
+
+	struct Settings {
+		MetricsProvider const* metrics = nullptr;
+		unsigned int characterSize = 20; //Outside size tags; lines are at least as tall as with it, and taller ones move down by how much larger their glyphs are
+		float horizontalLimit = std::numeric_limits<float>::infinity();
+		size_t characterLimit = std::numeric_limits<size_t>::max(); //In displayable characters; the rest is measured but not placed
+		float outlineThicknessStep = 0.f; //Glyph outline thicknesses are rounded to a multiple of it (see GlyphAtlas); 0 keeps them as they are
+		size_t lineBudget = std::numeric_limits<size_t>::max(); //New lines a call may reach before it stops, to be resumed (see resume())
+		float timeBudget = std::numeric_limits<float>::infinity(); //In seconds, likewise
+		Alignment alignment = Left;
+		size_t maxLines = std::numeric_limits<size_t>::max(); //The layout ends at the line break that would start the line after them
+		sf::String ellipsis; //Ends the last line when the text goes on past maxLines, replacing as many of its glyphs as it needs to fit
+		bool tabularDigits = false; //Lays out with the metrics through TabularDigits
+		bool keepGlyphs = true; //False for layouts from the first line that only need the lines and bounds: only the last line keeps its glyphs and decorations
+	};
+
+	//Glyph placed at its pen position (not rounded), in the style of its run. The position leaves out the alignment of its line (see
+	//getGlyphShifts()), so that aligning again doesn't accumulate rounding errors
+	struct PlacedGlyph {
+		sf::Vector2f position;
+		sf::Uint32 codePoint;
+		sf::Uint32 run; //Index in Result::runs
+	};
+
+	//Style shared by consecutive glyphs
+	struct StyleRun {
+		enum Effect { Wave = 1, Shake = 2, Pulse = 4 };
+		sf::Color fillColor;
+		sf::Color outlineColor;
+		float outlineThickness; //0 without outline
+		float italicShear;
+		bool bold;
+		sf::Uint8 effects;
+		sf::Uint8 font; //Index in the font chain of the metrics provider (see MetricsProvider::getFont())
+		sf::Uint16 characterSize;
+		bool operator==(StyleRun const& other) const;
+	};
+
+	//Underline or strikethrough rectangle, rounded to whole pixels
+	struct Decoration {
+		float left, top, right, bottom;
+		sf::Color color;
+	};
+
+	struct Line {
+		size_t firstCharacter; //Index in the parsed string
+		float verticalPosition; //Baseline
+		float sizeShift; //Movement of the line down, included in verticalPosition, making room for glyphs larger than the size of the settings
+		size_t firstGlyph;
+		size_t firstDecoration;
+		size_t firstOutlineDecoration;
+		float left, top, right, bottom; //Bounds of the line's glyph quads and decorations; left > right while empty
+		float width; //Right bound of the line as laid out from the left
+		float offset; //Horizontal movement of the line by the alignment, included in its bounds and decorations but not in its glyph positions
+		float gapSpacing; //Space added to each word gap of a justified line: what follows the k-th gap moves by offset + round(k * gapSpacing)
+	};
+
+	//Output of a layout. Lines are the ones explored so far: a layout stops early at the character limit and at the line limit
+	class Result {
+	public:
+		Result() {}
+		Result(Result const& other, size_t startLine); //Copies what comes before startLine, and where startLine starts
+		void truncate(size_t startLine); //Discards what comes after the start of startLine
+		void eraseFront(size_t endLine, float lift); //Discards the lines before endLine, moving the rest up by lift and counting characters from it
+		void clear(); //Discards everything, keeping the memory for the next layout
+		size_t getMemoryUsage() const;
+
+		std::vector<PlacedGlyph> glyphs;
+		std::vector<StyleRun> runs;
+		std::vector<Decoration> decorations;
+		std::vector<Decoration> outlineDecorations;
+		std::vector<Line> lines;
+		std::vector<size_t> stylizerLines; //Line at which every stylizer was last sighted, by index
+		sf::FloatRect bounds;
+		//First character the line limit left out, or max. The glyphs of the last line then end with the ellipsis, so they no longer
+		//follow the characters of the string one to one
+		size_t firstHiddenCharacter = std::numeric_limits<size_t>::max();
+	};
+
+	//Work done by the last call, for performance counters
+	struct Statistics {
+		size_t stylizersReplayed = 0;
+		size_t charactersScanned = 0;
+	};
+
+	//Lays out from startLine onwards, keeping the lines of result before it (startLine must be 0 if result is empty).
+	//Returns false if the budget of the settings ran out: the layout stopped at the start of a line, before placing anything on it,
+	//and the lines before it are final
+	bool layout(sf::String const& string, Stylizers const& stylizers, VariableStyle const& style, Settings const& settings, Result& result, size_t startLine = 0);
+	//Continues a stopped layout from where it stopped, with the style, word and decorations it had in progress rather than by replaying
+	//the stylizers; the string and stylizers may only have grown at their end since. Returns false if the budget ran out again
+	bool resume(sf::String const& string, Stylizers const& stylizers, Settings const& settings, Result& result);
+	//Gives the glyphs from startLine onwards the colours of the stylizers again, without moving anything, for when only colours changed.
+	//Returns false, leaving result as it was, if decorations start from startLine on: they are split where colours change, so they need a layout.
+	//Likewise if the line limit truncated the result
+	bool recolor(sf::String const& string, Stylizers const& stylizers, VariableStyle const& style, Result& result, size_t startLine);
+	//Gives the characters from first on, which the string now holds in place of as many replaced ones, the glyphs of the replaced ones,
+	//when that lays them out the same: same whitespace, advances, kerning, break opportunities and fonts. The bounds of their line, and of the
+	//result, follow their quads, unless that would move an aligned line. Returns the first glyph replaced, or max, leaving the result as it
+	//was, if the characters need a layout
+	static size_t replaceGlyphs(sf::String const& string, sf::String const& replaced, size_t first, Settings const& settings, Result& result);
+	//Lines taller than the size of the settings are only known once laid out: with laidOut, the character is placed on its line in it
+	sf::FloatRect findCharacterBounds(sf::String const& string, Stylizers const& stylizers, VariableStyle const& style, Settings const& settings, size_t index,
+		Result const* laidOut = nullptr);
+	Statistics const& getStatistics() const;
+
+	//Moves the lines of result to the alignment of the settings, without laying them out again
+	void align(sf::String const& string, Settings const& settings, Result& result);
+	//Lines the last align(), or the last layout through lines before the ones it laid out, moved (aligned to the widest line, they all move
+	//when it changes): from getFirstMovedLine() on, getGlyphMovements() holds how far every glyph of them moved
+	size_t getFirstMovedLine() const;
+	std::vector<float> const& getGlyphMovements() const;
+	//Horizontal movement of the character at index by the alignment of its line
+	static float getAlignmentMovement(sf::String const& string, Result const& result, size_t index);
+	//Horizontal movement of every glyph of a line by its alignment, in whole pixels, to add to the glyph positions
+	static void getGlyphShifts(sf::String const& string, Result const& result, size_t line, std::vector<float>& shifts);
+
+	//Corners of the quad RichText draws for a glyph (before rounding): the first one is the upper left and the second the bottom right
+	static void getQuadCorners(sf::Vector2f position, sf::FloatRect const& bounds, float italicShear, float outlineThickness, sf::Vector2f& topLeft, sf::Vector2f& bottomRight);
+	static float quantizeOutlineThickness(float thickness, float step);
+	//Whether a line may break between two adjacent characters that aren't whitespace, which lines break at anyway: the pair rules of UAX #14
+	//over its classes that matter between glyphs. Scripts written without spaces that need a dictionary (Thai, Lao...) only break at spaces
+	static bool isBreakOpportunity(sf::Uint32 previous, sf::Uint32 next);
+
+private:
+	bool run(sf::String const& string, Stylizers const& stylizers, Settings const& settings, Result& result); //Main loop of layout() and resume()
+	void alignLines(sf::String const& string, Settings const& settings, Result& result, size_t firstLine, size_t newLine); //Lines from newLine on were just laid out
+	static size_t findGaps(sf::String const& string, Result const& result, size_t line, std::vector<float>& gapIndices); //Returns where the scan stopped
+
+	VariableStyle m_style; //Working copy of the style given to a layout
+
+	//State of the main loop, kept between a layout that stopped and its resumption
+	struct Progress {
+		size_t i;
+		sf::Vector2f pos;
+		size_t i_displayOnly;
+		float whitespaceWidth;
+		float letterSpacing;
+		float lineSpacing;
+		float lineThickness;
+		sf::Vector2f underlineStart;
+		sf::Vector2f underlineOutlineStart;
+		sf::Vector2f strikeThroughStart;
+		sf::Vector2f strikeThroughOutlineStart;
+		float italicShear;
+		bool hasOutline;
+		float lineSpacingAtWordStart;
+		float outlineThicknessAtWordStart;
+		float whitespaceWidthAtWordStart;
+		size_t whitespacesAtWordStart;
+		size_t i_atWordStart;
+		float currentLineWidth;
+		bool intentionalLineBreak;
+		size_t currentLine;
+		sf::Uint32 previousChar;
+		bool stylizersApplied; //Whether the stylizers at i were already applied
+		bool resumed; //Whether the lines before currentLine were laid out by an earlier call
+		float left, top, right, bottom; //Bounds of the lines before currentLine, for resumed layouts
+	};
+	Progress m_progress = Progress();
+
+	//Words in progress, reused between layouts
+	struct WordGlyph {
+		sf::FloatRect bounds;
+		sf::FloatRect outlineBounds; //Only if the run has an outline
+	};
+	std::vector<PlacedGlyph> m_wordGlyphs;
+	std::vector<WordGlyph> m_wordGlyphMetrics;
+	std::vector<Decoration> m_wordDecorations;
+	std::vector<Decoration> m_wordOutlineDecorations;
+
+	Statistics m_statistics;
+
+	size_t m_firstMovedLine = 0;
+	std::vector<float> m_glyphMovements;
+	std::vector<float> m_gapIndices; //Scratch space of alignLines(): gaps before every glyph of a line, and where the words after them start
+	std::vector<float> m_wordStarts;
+};
+
+#endif // RICHTEXTLAYOUT_H
@@ -0,0 +1,226 @@
+#include "richtextscheduler.h"
+#include "richtext.h"
+#include <algorithm>
+
+RichTextScheduler::RichTextScheduler() :
+	RichTextScheduler(std::max(std::thread::hardware_concurrency(), 1u) - 1)
+{
+}
+
+RichTextScheduler::RichTextScheduler(unsigned int workers) :
+	m_registry(std::make_shared<Registry>()),
+	m_layouts(0),
+	m_steals(0)
+{
+	m_registry->scheduler = this;
+	startWorkers(workers);
+}
+
+RichTextScheduler::~RichTextScheduler() {
+	{
+		std::lock_guard<std::mutex> lock(m_frameMutex);
+		m_stopping = true;
+	}
+	m_frameStarted.notify_all();
+	for (std::unique_ptr<Worker>& worker : m_workers)
+		worker->thread.join();
+}
+
+void RichTextScheduler::startWorkers(unsigned int workers) {
+	for (unsigned int i = 0; i < workers; i++)
+		m_workers.push_back(std::make_unique<Worker>());
+	for (size_t i = 0; i < m_workers.size(); i++)
+		m_workers[i]->thread = std::thread(&RichTextScheduler::workerLoop, this, i);
+}
+
+void RichTextScheduler::submit(RichText& text) {
+	m_registry->submit(&text);
+}
+
+void RichTextScheduler::Registry::submit(RichText* text) {
+	std::lock_guard<std::mutex> lock(mutex);
+	Entry& entry = entries[text];
+	entry.text = text;
+	if (!entry.pending) {
+		entry.pending = true;
+		entry.order = nextOrder++;
+		pendingCount++;
+	}
+}
+
+void RichTextScheduler::Registry::remove(RichText const* text) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = entries.find(text);
+	if (it == entries.end())
+		return;
+	if (it->second.pending)
+		pendingCount--;
+	entries.erase(it);
+}
+
+void RichTextScheduler::Registry::markDrawn(RichText const* text) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = entries.find(text);
+	if (it != entries.end()) //Instances are only registered by submit()
+		it->second.lastDrawnFrame = frame;
+}
+
+void RichTextScheduler::runFrame(float budget) {
+	auto start = std::chrono::steady_clock::now();
+	auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(budget));
+
+	//Takes every pending instance out of the registry, the ones drawn since the previous frame first, then in submission order
+	std::vector<Registry::Entry> tasks;
+	{
+		std::lock_guard<std::mutex> lock(m_registry->mutex);
+		for (auto& entry : m_registry->entries) {
+			if (entry.second.pending) {
+				tasks.push_back(entry.second);
+				entry.second.pending = false;
+			}
+		}
+		size_t drawnFrame = m_registry->frame++;
+		std::sort(tasks.begin(), tasks.end(), [drawnFrame](Registry::Entry const& a, Registry::Entry const& b) {
+			bool aVisible = a.lastDrawnFrame == drawnFrame;
+			bool bVisible = b.lastDrawnFrame == drawnFrame;
+			return (aVisible != bVisible) ? aVisible : a.order < b.order;
+		});
+		m_registry->pendingCount = 0;
+	}
+	m_stats.frames++;
+	m_stats.maxQueueDepth = std::max(m_stats.maxQueueDepth, tasks.size());
+
+	//Instances that can be laid out anywhere are dealt to the workers in turn, so that every queue starts with urgent ones
+	std::vector<RichText*> localTasks;
+	size_t dealt = 0;
+	for (Registry::Entry const& task : tasks) {
+		if (m_workers.empty() || !task.text->getMetricsProvider())
+			localTasks.push_back(task.text);
+		else {
+			m_workers[dealt % m_workers.size()]->tasks.push_back(task.text);
+			dealt++;
+		}
+	}
+
+	if (dealt > 0) {
+		std::lock_guard<std::mutex> lock(m_frameMutex);
+		m_deadline = deadline;
+		m_busyWorkers = m_workers.size();
+		m_frameNumber++;
+	}
+	if (dealt > 0)
+		m_frameStarted.notify_all();
+
+	//The calling thread takes the instances that need it, then helps the workers
+	size_t localDone = 0;
+	while (localDone < localTasks.size() && std::chrono::steady_clock::now() < deadline)
+		runTask(localTasks[localDone++]);
+	if (dealt > 0) {
+		while (std::chrono::steady_clock::now() < deadline) {
+			RichText* text = takeTask(m_workers.size());
+			if (!text)
+				break;
+			runTask(text);
+		}
+
+		std::unique_lock<std::mutex> lock(m_frameMutex);
+		m_frameFinished.wait(lock, [this] { return m_busyWorkers == 0; });
+	}
+
+	//Whatever wasn't started waits for the next frame, in its original order
+	std::vector<RichText const*> leftovers(localTasks.begin() + localDone, localTasks.end());
+	for (std::unique_ptr<Worker>& worker : m_workers) {
+		leftovers.insert(leftovers.end(), worker->tasks.begin(), worker->tasks.end());
+		worker->tasks.clear();
+	}
+	if (!leftovers.empty()) {
+		std::lock_guard<std::mutex> lock(m_registry->mutex);
+		for (RichText const* text : leftovers) {
+			auto it = m_registry->entries.find(text);
+			if (it != m_registry->entries.end() && !it->second.pending) {
+				it->second.pending = true;
+				m_registry->pendingCount++;
+			}
+		}
+	}
+
+	std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+	std::chrono::steady_clock::duration allowed = deadline - start;
+	if (elapsed > allowed) {
+		m_stats.budgetOverruns++;
+		m_stats.overrunNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed - allowed).count();
+	}
+}
+
+void RichTextScheduler::workerLoop(size_t index) {
+	size_t lastFrame = 0;
+	while (true) {
+		std::chrono::steady_clock::time_point deadline;
+		{
+			std::unique_lock<std::mutex> lock(m_frameMutex);
+			m_frameStarted.wait(lock, [this, lastFrame] { return m_stopping || m_frameNumber != lastFrame; });
+			if (m_stopping)
+				return;
+			lastFrame = m_frameNumber;
+			deadline = m_deadline;
+		}
+
+		while (std::chrono::steady_clock::now() < deadline) {
+			RichText* text = takeTask(index);
+			if (!text)
+				break;
+			runTask(text);
+		}
+
+		std::lock_guard<std::mutex> lock(m_frameMutex);
+		if (--m_busyWorkers == 0)
+			m_frameFinished.notify_all();
+	}
+}
+
+RichText* RichTextScheduler::takeTask(size_t index) {
+	if (index < m_workers.size()) {
+		Worker& own = *m_workers[index];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			RichText* text = own.tasks.front();
+			own.tasks.pop_front();
+			return text;
+		}
+	}
+
+	//Steals the least urgent task of the first other worker that has some
+	for (size_t i = 1; i <= m_workers.size(); i++) {
+		Worker& victim = *m_workers[(index + i) % m_workers.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			RichText* text = victim.tasks.back();
+			victim.tasks.pop_back();
+			m_steals++;
+			return text;
+		}
+	}
+	return nullptr;
+}
+
+void RichTextScheduler::runTask(RichText* text) {
+	text->prepare();
+	m_layouts++;
+	if (!text->isLayoutComplete())
+		m_registry->submit(text); //A progressive layout continues next frame
+}
+
+RichTextScheduler::Stats RichTextScheduler::getStats() const {
+	Stats stats = m_stats;
+	stats.layouts = m_layouts;
+	stats.steals = m_steals;
+	std::lock_guard<std::mutex> lock(m_registry->mutex);
+	stats.queueDepth = m_registry->pendingCount;
+	return stats;
+}
+
+void RichTextScheduler::resetStats() {
+	m_stats = Stats();
+	m_layouts = 0;
+	m_steals = 0;
+}
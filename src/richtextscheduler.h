@@ -0,0 +1,105 @@
+#ifndef RICHTEXTSCHEDULER_H
+#define RICHTEXTSCHEDULER_H
+
+#include <SFML/Config.hpp>
+#include <unordered_map>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+class RichText;
+
+//Lays out dirty RichText instances with RichText::prepare() across a pool of worker threads, a frame's budget at a time, so that a screen
+//full of text becoming dirty at once doesn't produce one huge frame. Instances attached with RichText::setScheduler() register themselves
+//whenever they change and keep drawing their previous layout until their turn comes; instances drawn since the previous frame go first.
+//Instances without a metrics provider need the font, so they are laid out on the thread calling runFrame(), which must then be the render thread.
+//Workers only call prepare(), which counts into the layout it publishes (see RichText::getPerformanceCounters()), so that scheduled instances
+//can be drawn, queried and counted on the render thread meanwhile.
+class RichTextScheduler
+{
+public:
+	RichTextScheduler(); //One worker per hardware thread, besides the one calling runFrame()
+	explicit RichTextScheduler(unsigned int workers); //0 lays out everything on the thread calling runFrame()
+	~RichTextScheduler();
+
+	RichTextScheduler(RichTextScheduler const&) = delete;
+	RichTextScheduler& operator=(RichTextScheduler const&) = delete;
+
+	//Registers an attached instance for layout; instances do it themselves when they change, but copies of them only from their first change
+	void submit(RichText& text);
+
+	//Lays out registered instances until the budget (in seconds) is spent, then waits for the layouts in progress, which can't be interrupted.
+	//The instances must not be modified meanwhile; they may be drawn from another thread.
+	void runFrame(float budget);
+
+	struct Stats {
+		size_t queueDepth = 0; //Instances waiting for a layout
+		size_t maxQueueDepth = 0; //Largest queue depth at the start of a frame
+		size_t frames = 0;
+		size_t layouts = 0;
+		size_t steals = 0; //Layouts taken from another worker's queue
+		size_t budgetOverruns = 0; //Frames that took longer than their budget
+		sf::Uint64 overrunNanoseconds = 0; //Time spent beyond the budgets, in total
+	};
+
+	Stats getStats() const;
+	void resetStats();
+
+private:
+	friend class RichText;
+
+	//Instances attached to the scheduler; RichText holds it weakly, so that instances may outlive the scheduler
+	class Registry {
+	public:
+		void submit(RichText* text);
+		void remove(RichText const* text);
+		void markDrawn(RichText const* text);
+
+		struct Entry {
+			RichText* text = nullptr;
+			bool pending = false;
+			size_t order = 0; //Submission order among the pending instances
+			size_t lastDrawnFrame = 0;
+		};
+
+		RichTextScheduler* scheduler = nullptr;
+		std::mutex mutex;
+		std::unordered_map<RichText const*, Entry> entries;
+		size_t pendingCount = 0;
+		size_t nextOrder = 0;
+		size_t frame = 1;
+	};
+
+	struct Worker {
+		std::thread thread;
+		std::mutex mutex;
+		std::deque<RichText*> tasks; //Most urgent first; the owner pops the front, thieves the back
+	};
+
+	void startWorkers(unsigned int workers);
+	void workerLoop(size_t index);
+	RichText* takeTask(size_t index); //index is the size of m_workers for the thread calling runFrame(), which has no queue of its own
+	void runTask(RichText* text);
+
+	std::shared_ptr<Registry> m_registry;
+	std::vector<std::unique_ptr<Worker>> m_workers;
+
+	std::mutex m_frameMutex;
+	std::condition_variable m_frameStarted;
+	std::condition_variable m_frameFinished;
+	size_t m_frameNumber = 0;
+	size_t m_busyWorkers = 0;
+	bool m_stopping = false;
+	std::chrono::steady_clock::time_point m_deadline;
+
+	std::atomic<size_t> m_layouts;
+	std::atomic<size_t> m_steals;
+	Stats m_stats;
+};
+
+#endif // RICHTEXTSCHEDULER_H